@@ -22,6 +22,7 @@
 #define _GNU_SOURCE
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
@@ -31,11 +32,28 @@
 
 #define LINEMAX 8192
 
+/* membership checks walk the user's side of the relationship,
+   since users belong to a handful of groups, but groups like
+   'users' can have thousands of members */
+static member_t* s_find_member(int type, group_t *group, user_t *user)
+{
+	list_t *user_list = (type == GROUP_MEMBER ? &user->member_of : &user->admin_of);
+
+	member_t *needle;
+	for_each_object(needle, user_list, on_user)
+		if (needle->group == group)
+			return needle;
+	return NULL;
+}
+
 static void s_add_member(authdb_t *db, int type, group_t *group, user_t *user)
 {
 	if (!group || !user) return;
 	assert(type == GROUP_MEMBER || type == GROUP_ADMIN);
 
+	if (s_find_member(type, group, user))
+		return;
+
 	list_t *group_list = (type == GROUP_MEMBER ? &group->members  : &group->admins);
 	list_t *user_list  = (type == GROUP_MEMBER ? &user->member_of : &user->admin_of);
 
@@ -44,27 +62,10 @@ static void s_add_member(authdb_t *db, int type, group_t *group, user_t *user)
 	member->group = group; list_init(&member->on_group);
 	                       list_init(&member->l);
 
-	member_t *needle;
-	for_each_object(needle, group_list, on_group)
-		if (needle->group == group && needle->user == user)
-			goto check_user;
-
 	list_push(group_list, &member->on_group);
-	member->refs++;
-
-check_user:
-	for_each_object(needle, user_list, on_user)
-		if (needle->group == group && needle->user == user)
-			goto done;
-
-	list_push(user_list, &member->on_user);
-	member->refs++;
-
-done:
-	if (member->refs == 0)
-		free(member);
-	else
-		list_push(&db->memberships, &member->l);
+	list_push(user_list,  &member->on_user);
+	member->refs = 2;
+	list_push(&db->memberships, &member->l);
 }
 
 static void s_member_free(member_t *m)
@@ -81,15 +82,136 @@ static void s_remove_member(authdb_t *db, int type, group_t *group, user_t *user
 	if (!group || !user) return;
 	assert(type == GROUP_MEMBER || type == GROUP_ADMIN);
 
-	list_t *group_list = (type == GROUP_MEMBER ? &group->members : &group->admins);
+	s_member_free(s_find_member(type, group, user));
+}
 
-	member_t *needle;
-	for_each_object(needle, group_list, on_group) {
-		if (needle->group != group || needle->user != user)
-			continue;
-		s_member_free(needle);
+static void s_index_free(hash_t **h)
+{
+	if (!*h) return;
+	hash_done(*h, 0);
+	free(*h);
+	*h = NULL;
+}
+
+/* each index maps a name (or ID) to the first user / group that
+   has it; any others with the same key are chained off of that one,
+   through the member at offset $link, in the order they were indexed */
+#define NEXT(o,link) (*(void**)((char*)(o) + (link)))
+
+static void s_index_add(hash_t *idx, const char *key, void *o, size_t link)
+{
+	void *p = hash_get(idx, key);
+
+	NEXT(o, link) = NULL;
+	if (!p) {
+		hash_set(idx, key, o);
 		return;
 	}
+	while (NEXT(p, link))
+		p = NEXT(p, link);
+	NEXT(p, link) = o;
+}
+
+static void s_index_del(hash_t *idx, const char *key, void *o, size_t link)
+{
+	void *p = hash_get(idx, key);
+
+	if (p == o) {
+		hash_set(idx, key, NEXT(o, link));
+	} else {
+		while (p && NEXT(p, link) != o)
+			p = NEXT(p, link);
+		if (p)
+			NEXT(p, link) = NEXT(o, link);
+	}
+	NEXT(o, link) = NULL;
+}
+
+static const char* s_id(char *buf, unsigned int id)
+{
+	snprintf(buf, 16, "%u", id);
+	return buf;
+}
+
+#define USER_NAME  offsetof(user_t,  same_name)
+#define USER_UID   offsetof(user_t,  same_uid)
+#define GROUP_NAME offsetof(group_t, same_name)
+#define GROUP_GID  offsetof(group_t, same_gid)
+
+static void s_index_user(user_t *user)
+{
+	char id[16];
+	if (user->name)
+		s_index_add(user->db->user_names, user->name, user, USER_NAME);
+	s_index_add(user->db->user_ids, s_id(id, user->uid), user, USER_UID);
+}
+
+static void s_unindex_user(user_t *user)
+{
+	char id[16];
+	if (user->name)
+		s_index_del(user->db->user_names, user->name, user, USER_NAME);
+	s_index_del(user->db->user_ids, s_id(id, user->uid), user, USER_UID);
+}
+
+static void s_index_group(group_t *group)
+{
+	char id[16];
+	if (group->name)
+		s_index_add(group->db->group_names, group->name, group, GROUP_NAME);
+	s_index_add(group->db->group_ids, s_id(id, group->gid), group, GROUP_GID);
+}
+
+static void s_unindex_group(group_t *group)
+{
+	char id[16];
+	if (group->name)
+		s_index_del(group->db->group_names, group->name, group, GROUP_NAME);
+	s_index_del(group->db->group_ids, s_id(id, group->gid), group, GROUP_GID);
+}
+
+/* (re)build the indexes from scratch, in list order */
+static void s_index_all(authdb_t *db)
+{
+	user_t *user;
+	group_t *group;
+
+	s_index_free(&db->user_names);
+	s_index_free(&db->user_ids);
+	s_index_free(&db->group_names);
+	s_index_free(&db->group_ids);
+
+	db->user_names  = vmalloc(sizeof(hash_t));
+	db->user_ids    = vmalloc(sizeof(hash_t));
+	db->group_names = vmalloc(sizeof(hash_t));
+	db->group_ids   = vmalloc(sizeof(hash_t));
+
+	for_each_object(user, &db->users, l)
+		s_index_user(user);
+	for_each_object(group, &db->groups, l)
+		s_index_group(group);
+}
+
+static user_t* s_user_new(authdb_t *db)
+{
+	user_t *user = vmalloc(sizeof(user_t));
+	user->db = db;
+	db->dirty |= AUTHDB_PASSWD | AUTHDB_SHADOW;
+	list_push(&db->users, &user->l);
+	list_init(&user->member_of);
+	list_init(&user->admin_of);
+	return user;
+}
+
+static group_t* s_group_new(authdb_t *db)
+{
+	group_t *group = vmalloc(sizeof(group_t));
+	group->db = db;
+	db->dirty |= AUTHDB_GROUP | AUTHDB_GSHADOW;
+	list_push(&db->groups, &group->l);
+	list_init(&group->members);
+	list_init(&group->admins);
+	return group;
 }
 
 static char* s_group_list(group_t *group, int type)
@@ -123,6 +245,11 @@ authdb_t* authdb_read(const char *root, int dbs)
 	db->dbs = dbs;
 	db->root = strdup(root);
 
+	/* while loading, the name indexes are kept up to date by hand;
+	   the rest are built once everything has been read */
+	db->user_names  = vmalloc(sizeof(hash_t));
+	db->group_names = vmalloc(sizeof(hash_t));
+
 #define FIELD(d,n) do { \
 	field++; \
 	while (*b && *b != ':') b++; \
@@ -154,10 +281,11 @@ authdb_t* authdb_read(const char *root, int dbs)
 			line++; field = 0; a = b = LINE;
 
 			FIELD("passwd", "username");
-			user = user_find(db, a, -1);
+			user = hash_get(db->user_names, a);
 			if (!user) {
-				user = user_add(db);
+				user = s_user_new(db);
 				user->name = strdup(a);
+				hash_set(db->user_names, a, user);
 			}
 			user->state |= AUTHDB_PASSWD;
 
@@ -183,7 +311,7 @@ authdb_t* authdb_read(const char *root, int dbs)
 		fclose(io);
 	}
 
-	if (db->dbs & AUTHDB_SHADOW) {
+	if (dbs & AUTHDB_SHADOW) {
 		file = string("%s/shadow",  db->root);
 		io = fopen(file, "r"); free(file);
 		if (!io) goto bail;
@@ -194,10 +322,11 @@ authdb_t* authdb_read(const char *root, int dbs)
 			line++; field = 0; a = b = LINE;
 
 			FIELD("shadow", "usernae");
-			user = user_find(db, a, -1);
+			user = hash_get(db->user_names, a);
 			if (!user) {
-				user = user_add(db);
+				user = s_user_new(db);
 				user->name = strdup(a);
+				hash_set(db->user_names, a, user);
 			}
 			user->state |= AUTHDB_SHADOW;
 
@@ -232,7 +361,7 @@ authdb_t* authdb_read(const char *root, int dbs)
 		fclose(io);
 	}
 
-	if (db->dbs & AUTHDB_GROUP) {
+	if (dbs & AUTHDB_GROUP) {
 		file = string("%s/group",  db->root);
 		io = fopen(file, "r"); free(file);
 		if (!io) goto bail;
@@ -243,10 +372,11 @@ authdb_t* authdb_read(const char *root, int dbs)
 			line++; field = 0; a = b = LINE;
 
 			FIELD("group", "group name");
-			group = group_find(db, a, -1);
+			group = hash_get(db->group_names, a);
 			if (!group) {
-				group = group_add(db);
+				group = s_group_new(db);
 				group->name = strdup(a);
+				hash_set(db->group_names, a, group);
 			}
 			group->state |= AUTHDB_GROUP;
 
@@ -263,7 +393,7 @@ authdb_t* authdb_read(const char *root, int dbs)
 		fclose(io);
 	}
 
-	if (db->dbs & AUTHDB_GSHADOW) {
+	if (dbs & AUTHDB_GSHADOW) {
 		file = string("%s/gshadow",  db->root);
 		io = fopen(file, "r"); free(file);
 		if (!io) goto bail;
@@ -274,10 +404,11 @@ authdb_t* authdb_read(const char *root, int dbs)
 			line++; field = 0; a = b = LINE;
 
 			FIELD("gshadow", "group name");
-			group = group_find(db, a, -1);
+			group = hash_get(db->group_names, a);
 			if (!group) {
-				group = group_add(db);
+				group = s_group_new(db);
 				group->name = strdup(a);
+				hash_set(db->group_names, a, group);
 			}
 			group->state |= AUTHDB_GSHADOW;
 
@@ -295,6 +426,8 @@ authdb_t* authdb_read(const char *root, int dbs)
 		fclose(io);
 	}
 
+	s_index_all(db);
+
 	/* set up membership / adminhood lists */
 	for_each_object(group, &db->groups, l) {
 		if (group->raw_members && *group->raw_members) {
@@ -316,6 +449,7 @@ authdb_t* authdb_read(const char *root, int dbs)
 		}
 	}
 
+	db->dirty = 0;
 	return db;
 
 bail:
@@ -327,15 +461,15 @@ bail:
 #undef NUMBER
 }
 
-int authdb_write(authdb_t *db)
+static int s_write(authdb_t *db, int dbs)
 {
 	user_t *user;
 	group_t *group;
-	FILE *io;
+	FILE *io = NULL;
 	char *tmpfile, *file;
 	int rc;
 
-	if (db->dbs & AUTHDB_PASSWD) {
+	if (dbs & AUTHDB_PASSWD) {
 		file = string("%s/passwd", db->root);
 		tmpfile = string("%s/.passwd.%x", db->root, rand());
 
@@ -348,7 +482,7 @@ int authdb_write(authdb_t *db)
 				user->comment, user->home, user->shell);
 		}
 
-		fclose(io);
+		fclose(io); io = NULL;
 		rc = cw_frename(tmpfile, file); free(file);
 		if (rc != 0) {
 			unlink(tmpfile); free(tmpfile);
@@ -381,7 +515,7 @@ int authdb_write(authdb_t *db)
 			free(inact); free(expiry); free(flags);
 		}
 
-		fclose(io);
+		fclose(io); io = NULL;
 		rc = cw_frename(tmpfile, file); free(file);
 		if (rc != 0) {
 			unlink(tmpfile); free(tmpfile);
@@ -406,7 +540,7 @@ int authdb_write(authdb_t *db)
 				group->name, group->clear_pass, group->gid, group->raw_members);
 		}
 
-		fclose(io);
+		fclose(io); io = NULL;
 		rc = cw_frename(tmpfile, file); free(file);
 		if (rc != 0) {
 			unlink(tmpfile); free(tmpfile);
@@ -436,7 +570,7 @@ int authdb_write(authdb_t *db)
 				group->raw_admins, group->raw_members);
 		}
 
-		fclose(io);
+		fclose(io); io = NULL;
 		rc = cw_frename(tmpfile, file); free(file);
 		if (rc != 0) {
 			unlink(tmpfile); free(tmpfile);
@@ -445,12 +579,23 @@ int authdb_write(authdb_t *db)
 		free(tmpfile);
 	}
 
+	db->dirty &= ~dbs;
 	return 0;
 bail:
 	if (io) fclose(io);
 	return 1;
 }
 
+int authdb_write(authdb_t *db)
+{
+	return s_write(db, db->dbs);
+}
+
+int authdb_commit(authdb_t *db)
+{
+	return s_write(db, db->dbs & db->dirty);
+}
+
 void authdb_close(authdb_t *db)
 {
 	if (!db) return;
@@ -483,6 +628,11 @@ void authdb_close(authdb_t *db)
 		free(member);
 	}
 
+	s_index_free(&db->user_names);
+	s_index_free(&db->user_ids);
+	s_index_free(&db->group_names);
+	s_index_free(&db->group_ids);
+
 	free(db->root);
 	free(db);
 }
@@ -511,59 +661,46 @@ char* authdb_creds(authdb_t *db, const char *username)
 }
 
 
+/* IDs are indexed, so finding the next free one is one lookup
+   for each taken ID in the run that starts at $uid (or $gid) */
 uid_t authdb_nextuid(authdb_t *db, uid_t uid)
 {
-	user_t *user;
-	NEXT:
-	for_each_object(user, &db->users, l) {
-		if (user->uid != uid) continue;
-		uid++; goto NEXT;
-	}
+	while (user_find(db, NULL, uid))
+		uid++;
 	return uid;
 }
 
 gid_t authdb_nextgid(authdb_t *db, gid_t gid)
 {
-	group_t *group;
-	NEXT:
-	for_each_object(group, &db->groups, l) {
-		if (group->gid != gid) continue;
-		gid++; goto NEXT;
-	}
+	while (group_find(db, NULL, gid))
+		gid++;
 	return gid;
 }
 
 
+/* users (and groups) must be renamed and renumbered through
+   user_set_* (and group_set_*), which keep the indexes current */
 user_t* user_find(authdb_t *db, const char *name, uid_t uid)
 {
-	user_t *user;
-
-	if (name) {
-		for_each_object(user, &db->users, l)
-			if (strcmp(user->name, name) == 0)
-				return user;
-	} else {
-		for_each_object(user, &db->users, l)
-			if (user->uid == uid)
-				return user;
-	}
-	return NULL;
+	char id[16];
+	if (name)
+		return hash_get(db->user_names, name);
+	return hash_get(db->user_ids, s_id(id, uid));
 }
 
 user_t* user_add(authdb_t *db)
 {
-	user_t *user = vmalloc(sizeof(user_t));
-	user->db = db;
-	list_push(&db->users, &user->l);
-	list_init(&user->member_of);
-	list_init(&user->admin_of);
+	user_t *user = s_user_new(db);
+	s_index_user(user);
 	return user;
 }
 
 void user_remove(user_t *user)
 {
 	if (!user) return;
+	s_unindex_user(user);
 	list_delete(&user->l);
+	user->db->dirty |= AUTHDB_ALL;
 
 	member_t *member, *tmp;
 	for_each_object_safe(member, tmp, &user->db->memberships, l)
@@ -579,37 +716,53 @@ void user_remove(user_t *user)
 	free(user);
 }
 
+void user_set_name(user_t *user, const char *name)
+{
+	if (user->name && strcmp(user->name, name) == 0)
+		return;
 
-group_t* group_find(authdb_t *db, const char *name, gid_t gid)
+	if (user->name)
+		s_index_del(user->db->user_names, user->name, user, USER_NAME);
+	free(user->name);
+	user->name = strdup(name);
+	s_index_add(user->db->user_names, user->name, user, USER_NAME);
+	user->db->dirty |= AUTHDB_ALL;
+}
+
+void user_set_uid(user_t *user, uid_t uid)
 {
-	group_t *group;
+	char id[16];
+	if (user->uid == uid)
+		return;
 
-	if (name) {
-		for_each_object(group, &db->groups, l)
-			if (strcmp(group->name, name) == 0)
-				return group;
-	} else {
-		for_each_object(group, &db->groups, l)
-			if (group->gid == gid)
-				return group;
-	}
-	return NULL;
+	s_index_del(user->db->user_ids, s_id(id, user->uid), user, USER_UID);
+	user->uid = uid;
+	s_index_add(user->db->user_ids, s_id(id, user->uid), user, USER_UID);
+	user->db->dirty |= AUTHDB_PASSWD;
+}
+
+
+group_t* group_find(authdb_t *db, const char *name, gid_t gid)
+{
+	char id[16];
+	if (name)
+		return hash_get(db->group_names, name);
+	return hash_get(db->group_ids, s_id(id, gid));
 }
 
 group_t* group_add(authdb_t *db)
 {
-	group_t *group = vmalloc(sizeof(group_t));
-	group->db = db;
-	list_push(&db->groups, &group->l);
-	list_init(&group->members);
-	list_init(&group->admins);
+	group_t *group = s_group_new(db);
+	s_index_group(group);
 	return group;
 }
 
 void group_remove(group_t *group)
 {
 	if (!group) return;
+	s_unindex_group(group);
 	list_delete(&group->l);
+	group->db->dirty |= AUTHDB_GROUP | AUTHDB_GSHADOW;
 
 	member_t *member, *tmp;
 	for_each_object_safe(member, tmp, &group->db->memberships, l)
@@ -624,36 +777,53 @@ void group_remove(group_t *group)
 	free(group);
 }
 
+void group_set_name(group_t *group, const char *name)
+{
+	if (group->name && strcmp(group->name, name) == 0)
+		return;
+
+	if (group->name)
+		s_index_del(group->db->group_names, group->name, group, GROUP_NAME);
+	free(group->name);
+	group->name = strdup(name);
+	s_index_add(group->db->group_names, group->name, group, GROUP_NAME);
+	group->db->dirty |= AUTHDB_GROUP | AUTHDB_GSHADOW;
+}
+
+void group_set_gid(group_t *group, gid_t gid)
+{
+	char id[16];
+	if (group->gid == gid)
+		return;
+
+	s_index_del(group->db->group_ids, s_id(id, group->gid), group, GROUP_GID);
+	group->gid = gid;
+	s_index_add(group->db->group_ids, s_id(id, group->gid), group, GROUP_GID);
+	group->db->dirty |= AUTHDB_GROUP;
+}
+
 int group_has(group_t *group, int type, user_t *user)
 {
 	if (!user) return 1;
-	member_t *needle;
-	list_t *list = (type == GROUP_MEMBER ? &group->members : &group->admins);
-	for_each_object(needle, list, on_group)
-		if (needle->user == user) return 0;
-	return 1;
+	return s_find_member(type, group, user) ? 0 : 1;
 }
 
 int group_join(group_t *group, int type, user_t *user)
 {
 	if (!user) return 1;
-	s_add_member(group->db, type, group, user);
-
-	member_t *needle;
-	list_t *list = (type == GROUP_MEMBER ? &group->members : &group->admins);
-	for_each_object(needle, list, on_group)
-		if (needle->user == user) return 0;
-	return 1;
+	if (group_has(group, type, user) != 0) {
+		s_add_member(group->db, type, group, user);
+		group->db->dirty |= (type == GROUP_MEMBER ? AUTHDB_GROUP : 0) | AUTHDB_GSHADOW;
+	}
+	return group_has(group, type, user);
 }
 
 int group_kick(group_t *group, int type, user_t *user)
 {
 	if (!user) return 1;
-	s_remove_member(group->db, type, group, user);
-
-	member_t *needle;
-	list_t *list = (type == GROUP_MEMBER ? &group->members : &group->admins);
-	for_each_object(needle, list, on_group)
-		if (needle->user == user) return 1;
-	return 0;
+	if (group_has(group, type, user) == 0) {
+		s_remove_member(group->db, type, group, user);
+		group->db->dirty |= (type == GROUP_MEMBER ? AUTHDB_GROUP : 0) | AUTHDB_GSHADOW;
+	}
+	return group_has(group, type, user) == 0 ? 1 : 0;
 }
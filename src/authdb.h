@@ -36,11 +36,18 @@
 
 typedef struct {
 	int    dbs;
+	int    dirty;  /* AUTHDB_* databases changed since last written */
 	char  *root;
 
 	list_t users;
 	list_t groups;
 	list_t memberships;
+
+	/* lookup indexes, kept up to date by user_* / group_* */
+	hash_t *user_names;
+	hash_t *user_ids;
+	hash_t *group_names;
+	hash_t *group_ids;
 } authdb_t;
 
 typedef struct {
@@ -70,6 +77,9 @@ typedef struct {
 	list_t member_of;
 	list_t admin_of;
 
+	void  *same_name; /* next user with this name (see user_find) */
+	void  *same_uid;  /* next user with this UID */
+
 	list_t l;
 } user_t;
 
@@ -88,6 +98,9 @@ typedef struct {
 	list_t members;
 	list_t admins;
 
+	void  *same_name; /* next group with this name (see group_find) */
+	void  *same_gid;  /* next group with this GID */
+
 	list_t l;
 } group_t;
 
@@ -103,6 +116,7 @@ typedef struct {
 
 authdb_t* authdb_read(const char *root, int dbs);
 int authdb_write(authdb_t *db);
+int authdb_commit(authdb_t *db);
 void authdb_close(authdb_t *db);
 
 char* authdb_creds(authdb_t *db, const char *user);
@@ -114,11 +128,15 @@ gid_t authdb_nextgid(authdb_t *db, gid_t start);
 user_t* user_find(authdb_t *db, const char *name, uid_t uid);
 user_t* user_add(authdb_t *db);
 void user_remove(user_t *user);
+void user_set_name(user_t *user, const char *name);
+void user_set_uid(user_t *user, uid_t uid);
 
 #define NO_GID (gid_t)(-1)
 group_t* group_find(authdb_t *db, const char *name, gid_t gid);
 group_t* group_add(authdb_t *db);
 void group_remove(group_t *group);
+void group_set_name(group_t *group, const char *name);
+void group_set_gid(group_t *group, gid_t gid);
 
 #define GROUP_MEMBER 1
 #define GROUP_ADMIN  2
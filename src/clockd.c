@@ -23,8 +23,10 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <libgen.h>
+#include <glob.h>
 #include <getopt.h>
 #include <signal.h>
+#include <time.h>
 
 #include "spec/parser.h"
 #include "resources.h"
@@ -117,6 +119,25 @@ static const char *FSM_ERRORS[] = {
 typedef struct __client_t client_t;
 typedef struct __server_t server_t;
 
+/* a reference-counted string in the intern pool */
+typedef struct {
+	unsigned int refs;
+	char         str[];
+} interned_t;
+
+/* a single fact, both name and value interned */
+typedef struct {
+	const char *name;
+	const char *value;
+} factent_t;
+
+/* compact fact table, sorted by fact name */
+typedef struct {
+	size_t     len;
+	size_t     cap;
+	factent_t *ent;
+} factab_t;
+
 struct __client_t {
 	state_t           state;
 	event_t           event;
@@ -125,15 +146,24 @@ struct __client_t {
 
 	char             *id;
 	char             *name;
+	struct manifest  *manifest; /* reference to the manifest pnode came from */
 	struct stree     *pnode;
 	struct policy    *policy;
-	hash_t           *facts;
+	factab_t         *factab;   /* interned facts, owned by client */
+	hash_t           *facts;    /* facts set by policy generation */
+	hash_t           *factview; /* all of the above, for templates */
 
 	content_t        *contents;
 	unsigned long     offset;
 	sha1_t            sha1;
 };
 
+typedef struct {
+	char     *token;
+	factab_t  facts;
+	time_t    last_seen;
+} factset_t;
+
 struct __server_t {
 	char *config_file;
 	int   verbose;
@@ -152,6 +182,24 @@ struct __server_t {
 	cert_t     *cert;
 	trustdb_t  *tdb;
 	void       *zap;
+
+	hash_t        *interned;   /* string intern pool, for facts */
+	hash_t        *factsets;   /* last known facts, by FQDN */
+	unsigned long  factserial;
+	unsigned int   factexpire; /* drop fact sets idle this long (s) */
+	time_t         factswept;  /* when we last looked for idle ones */
+
+	char          *factsdir;   /* where to keep each host's last facts */
+	hash_t        *unsaved;    /* facts not yet written there, by FQDN */
+	strings_t     *saveq;      /* ... and the order they came in */
+	unsigned int   saved;      /* how far through saveq we are */
+	time_t         savedat;    /* when we last wrote any out */
+	unsigned int   warmup_max;   /* how many hosts to precompile */
+	unsigned int   warmup_batch; /* how many to precompile at a time */
+	strings_t     *warmup;       /* hosts left to precompile */
+	unsigned int   warmed;       /* how far through warmup we are */
+
+	unsigned int   checkin;      /* window to spread check-ins over (s) */
 };
 
 static void s_sighandler(int signal, siginfo_t *info, void *_)
@@ -159,6 +207,41 @@ static void s_sighandler(int signal, siginfo_t *info, void *_)
 	if (signal == SIGHUP) DO_RELOAD++;
 }
 
+/* suggest how long (in seconds) a client should wait before checking
+   in again: each host gets a slot in the check-in window (by a hash of
+   its name), and the window is stretched by up to 2x as the connection
+   cache fills up.  Clients that we turned away because we are busy are
+   spread out over the next window instead, after a short back-off. */
+static unsigned int s_checkin(server_t *s, const char *key, int busy)
+{
+	size_t i, used = 0;
+	unsigned long h = 5381, window, slot, now, next;
+
+	if (!s->checkin)
+		return 0;
+
+	for (; *key; key++)
+		h = h * 33 + (unsigned char)*key;
+
+	for (i = 0; i < s->clients->max_len; i++)
+		if (s->clients->entries[i].ident)
+			used++;
+
+	window = s->checkin;
+	if (s->clients->max_len)
+		window += s->checkin * used / s->clients->max_len;
+
+	slot = h % window;
+	if (busy)
+		return window / 4 + slot;
+
+	now = (unsigned long)time(NULL) % window;
+	next = (slot + window - now) % window;
+	if (next < window / 2)
+		next += window;
+	return next;
+}
+
 static int s_sha1(client_t *fsm)
 {
 	if (fsm->contents->error)
@@ -169,8 +252,19 @@ static int s_sha1(client_t *fsm)
 	return 0;
 }
 
-static int s_gencode(client_t *c, byte_t **code, size_t *len)
+/* compile $pol into Pendulum bytecode, for host $name.  The result
+   is kept with the policy, which may be shared with other hosts
+   (see manifest_generate), so it only ever has to be done once. */
+static int s_gencode(server_t *s, struct policy *pol, const char *name, byte_t **code, size_t *len)
 {
+	if (pol->code) {
+		*code = vmalloc(pol->code_len);
+		memcpy(*code, pol->code, pol->code_len);
+		*len = pol->code_len;
+		logger(LOG_INFO, "using cached %lub policy for %s", (unsigned long)*len, name);
+		return 0;
+	}
+
 	int rc = 0;
 	size_t src_len = 0;
 	FILE *io = tmpfile();
@@ -179,7 +273,7 @@ static int s_gencode(client_t *c, byte_t **code, size_t *len)
 	stopwatch_t t;
 	uint32_t ms = 0;
 	STOPWATCH(&t, ms) {
-		policy_gencode(c->policy, io);
+		policy_gencode(pol, io);
 
 		src_len = ftell(io);
 		rewind(io);
@@ -204,7 +298,7 @@ static int s_gencode(client_t *c, byte_t **code, size_t *len)
 			return 1;
 		}
 
-		rc = asm_setopt(pna, PNASM_OPT_INCLUDE, c->server->include, strlen(c->server->include));
+		rc = asm_setopt(pna, PNASM_OPT_INCLUDE, s->include, strlen(s->include));
 		if (rc != 0) {
 			logger(LOG_ERR, "Failed to set module include path");
 			asm_free(pna);
@@ -268,13 +362,457 @@ static int s_gencode(client_t *c, byte_t **code, size_t *len)
 		bin_unit = 'b';
 	}
 	logger(LOG_INFO, "generated %0.2f%c policy (%0.2f%c src) for %s in %lums",
-		bin_size, bin_unit, src_size, src_unit, c->name, ms);
+		bin_size, bin_unit, src_size, src_unit, name, ms);
 
+	pol->code = vmalloc(*len);
+	memcpy(pol->code, *code, *len);
+	pol->code_len = *len;
 	return 0;
 }
 
+static const char* s_intern(hash_t *pool, const char *str)
+{
+	interned_t *in = hash_get(pool, str);
+	if (!in) {
+		size_t n = strlen(str);
+		in = vmalloc(sizeof(interned_t) + n + 1);
+		memcpy(in->str, str, n);
+		hash_set(pool, str, in);
+	}
+	in->refs++;
+	return in->str;
+}
+
+static void s_unintern(hash_t *pool, const char *str)
+{
+	interned_t *in = hash_get(pool, str);
+	if (!in || --in->refs > 0)
+		return;
+	hash_set(pool, str, NULL);
+	free(in);
+}
+
+/* binary search for name; returns the index it is (or would be) at */
+static size_t s_factab_find(factab_t *t, const char *name, int *found)
+{
+	size_t lo = 0, hi = t->len, mid;
+	int rc;
+
+	*found = 0;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		rc = strcmp(t->ent[mid].name, name);
+		if (rc == 0) {
+			*found = 1;
+			return mid;
+		}
+		if (rc < 0) lo = mid + 1;
+		else        hi = mid;
+	}
+	return lo;
+}
+
+/* set (or, for a NULL value, remove) a fact in a fact table */
+static void s_factab_set(hash_t *pool, factab_t *t, const char *name, const char *value)
+{
+	int found;
+	size_t i = s_factab_find(t, name, &found);
+
+	if (found) {
+		s_unintern(pool, t->ent[i].value);
+		if (value) {
+			t->ent[i].value = s_intern(pool, value);
+			return;
+		}
+		s_unintern(pool, t->ent[i].name);
+		memmove(&t->ent[i], &t->ent[i + 1], (t->len - i - 1) * sizeof(factent_t));
+		t->len--;
+		return;
+	}
+
+	if (!value)
+		return;
+
+	if (t->len == t->cap) {
+		t->cap = t->cap ? t->cap * 2 : 64;
+		t->ent = realloc(t->ent, t->cap * sizeof(factent_t));
+		assert(t->ent); // LCOV_EXCL_LINE
+	}
+	memmove(&t->ent[i + 1], &t->ent[i], (t->len - i) * sizeof(factent_t));
+	t->ent[i].name  = s_intern(pool, name);
+	t->ent[i].value = s_intern(pool, value);
+	t->len++;
+}
+
+static void s_factab_done(hash_t *pool, factab_t *t)
+{
+	size_t i;
+	for (i = 0; i < t->len; i++) {
+		s_unintern(pool, t->ent[i].name);
+		s_unintern(pool, t->ent[i].value);
+	}
+	free(t->ent);
+	t->ent = NULL;
+	t->len = t->cap = 0;
+}
+
+static factab_t* s_factab_copy(hash_t *pool, factab_t *src)
+{
+	size_t i;
+	factab_t *t = vmalloc(sizeof(factab_t));
+
+	t->len = t->cap = src->len;
+	t->ent = vmalloc((t->cap ? t->cap : 1) * sizeof(factent_t));
+	for (i = 0; i < src->len; i++) {
+		t->ent[i].name  = s_intern(pool, src->ent[i].name);
+		t->ent[i].value = s_intern(pool, src->ent[i].value);
+	}
+	return t;
+}
+
+/* look up the (interned) values of the facts that the conditionals
+   in manifest $m read, by slot, without building a hash of them */
+static const char** s_factab_slots(factab_t *t, struct manifest *m)
+{
+	unsigned int i;
+	size_t at;
+	int found;
+	const char **slots = vcalloc(m->nslots + 1, sizeof(char*));
+
+	for (i = 0; i < m->nslots; i++) {
+		at = s_factab_find(t, m->slot_names[i], &found);
+		if (found)
+			slots[i] = t->ent[at].value;
+	}
+	return slots;
+}
+
+/* build a hash_t view of a fact table, overlaid with $extra (if
+   given); the values are borrowed, and must not be freed */
+static hash_t* s_factab_hash(factab_t *t, hash_t *extra)
+{
+	size_t i;
+	char *k, *v;
+	hash_t *h = vmalloc(sizeof(hash_t));
+
+	for (i = 0; i < t->len; i++)
+		hash_set(h, t->ent[i].name, (void*)t->ent[i].value);
+	if (extra)
+		for_each_key_value(extra, k, v)
+			hash_set(h, k, v);
+	return h;
+}
+
+static int s_factab_patch(const char *name, const char *value, void *udata)
+{
+	void **args = (void**)udata;
+	s_factab_set((hash_t*)args[0], (factab_t*)args[1], name, value);
+	return 0;
+}
+
+static void s_client_facts_free(client_t *c)
+{
+	if (c->factview) {
+		hash_done(c->factview, 0);
+		free(c->factview);
+		c->factview = NULL;
+	}
+
+	if (c->facts) {
+		hash_done(c->facts, 1);
+		free(c->facts);
+		c->facts = NULL;
+	}
+
+	if (c->factab) {
+		s_factab_done(c->server->interned, c->factab);
+		free(c->factab);
+		c->factab = NULL;
+	}
+}
+
+static void s_factset_free(server_t *s, factset_t *fs)
+{
+	if (!fs) return;
+	s_factab_done(s->interned, &fs->facts);
+	free(fs->token);
+	free(fs);
+}
+
+/* apply a fact delta from a client against the last known fact set
+   for that host, and give the client its own copy of the result.
+   Returns the new version token, or NULL if the client needs to
+   resync. */
+static const char* s_patch_facts(client_t *fsm, const char *token, uint8_t *delta, size_t len)
+{
+	server_t *s = fsm->server;
+	factset_t *fs = hash_get(s->factsets, fsm->name);
+
+	if (strcmp(token, "0") != 0 && (!fs || !fs->token || strcmp(fs->token, token) != 0)) {
+		logger(LOG_INFO, "fact set version %s for %s is unknown or stale; requesting a resync",
+			token, fsm->name);
+		return NULL;
+	}
+
+	if (!fs) {
+		fs = vmalloc(sizeof(factset_t));
+		hash_set(s->factsets, fsm->name, fs);
+
+	} else if (strcmp(token, "0") == 0) {
+		s_factab_done(s->interned, &fs->facts);
+	}
+
+	free(fs->token);
+	fs->token = NULL;
+
+	void *args[2] = { s->interned, &fs->facts };
+	if (fact_delta_walk(delta, len, s_factab_patch, args) != 0) {
+		logger(LOG_ERR, "malformed fact delta from %s; requesting a resync", fsm->name);
+		hash_set(s->factsets, fsm->name, NULL);
+		s_factset_free(s, fs);
+		return NULL;
+	}
+
+	fs->last_seen = time(NULL);
+	fs->token = string("%lx.%lx", (unsigned long)fs->last_seen, ++s->factserial);
+	fsm->factab = s_factab_copy(s->interned, &fs->facts);
+
+	logger(LOG_DEBUG, "applied %lu byte fact delta for %s; fact set is now version %s",
+		len, fsm->name, fs->token);
+	return fs->token;
+}
+
+/* forget the fact sets of hosts that haven't sent a delta in
+   facts.expiration seconds; if they come back, they resync. */
+static void s_factsets_purge(server_t *s)
+{
+	char *k;
+	factset_t *fs;
+	time_t now = time(NULL);
+	unsigned int i;
+
+	if (!s->factexpire || now - s->factswept < 60)
+		return;
+	s->factswept = now;
+
+	strings_t *idle = strings_new(NULL);
+	for_each_key_value(s->factsets, k, fs)
+		if (fs && now - fs->last_seen >= s->factexpire)
+			strings_add(idle, k);
+
+	for (i = 0; i < idle->num; i++) {
+		s_factset_free(s, hash_get(s->factsets, idle->strings[i]));
+		hash_set(s->factsets, idle->strings[i], NULL);
+	}
+	if (idle->num)
+		logger(LOG_INFO, "forgot the fact sets of %lu idle host(s)",
+			(unsigned long)idle->num);
+	strings_free(idle);
+}
+
+/* parse a plain-text (key=value) fact upload into an interned fact table */
+static void s_read_facts(client_t *fsm, const char *text)
+{
+	char *k, *v;
+	hash_t *tmp = vmalloc(sizeof(hash_t));
+
+	fact_read_string(text, tmp);
+	fsm->factab = vmalloc(sizeof(factab_t));
+	for_each_key_value(tmp, k, v)
+		if (v) s_factab_set(fsm->server->interned, fsm->factab, k, v);
+
+	hash_done(tmp, 1);
+	free(tmp);
+}
+
+/* write the facts of host $name out to facts.dir, so
+   that its policy can be precompiled after a reload */
+static void s_write_facts(server_t *s, const char *name, factab_t *facts)
+{
+	char *tmp  = string("%s/.%s.facts", s->factsdir, name);
+	char *path = string("%s/%s.facts",  s->factsdir, name);
+
+	FILE *io = fopen(tmp, "w");
+	if (!io) {
+		logger(LOG_WARNING, "Unable to save facts for %s to %s: %s",
+			name, tmp, strerror(errno));
+	} else {
+		hash_t *h = s_factab_hash(facts, NULL);
+		fact_write(io, h);
+		hash_done(h, 0);
+		free(h);
+		if (fclose(io) != 0 || rename(tmp, path) != 0) {
+			logger(LOG_WARNING, "Unable to save facts for %s to %s: %s",
+				name, path, strerror(errno));
+			unlink(tmp);
+		}
+	}
+
+	free(tmp);
+	free(path);
+}
+
+/* remember to save the last facts seen from host $name; they are
+   written out later (see s_save_pending), so that check-ins don't
+   have to wait on the disk */
+static void s_save_facts(server_t *s, const char *name, factab_t *facts)
+{
+	if (!s->factsdir || !*s->factsdir)
+		return;
+	if (!name || !*name || *name == '.' || strchr(name, '/'))
+		return;
+
+	factab_t *old = hash_get(s->unsaved, name);
+	if (old) {
+		s_factab_done(s->interned, old);
+		free(old);
+	} else {
+		if (!s->saveq) {
+			s->saveq = strings_new(NULL);
+			s->savedat = time(NULL);
+		}
+		strings_add(s->saveq, name);
+	}
+	hash_set(s->unsaved, name, s_factab_copy(s->interned, facts));
+}
+
+/* write out up to $max of the queued fact sets (all of them, if
+   $max is 0), oldest first */
+static void s_save_pending(server_t *s, unsigned int max)
+{
+	unsigned int n = 0;
+	factab_t *facts;
+
+	while (s->saveq && s->saved < s->saveq->num && (!max || n < max)) {
+		const char *name = s->saveq->strings[s->saved++];
+		facts = hash_get(s->unsaved, name);
+		if (!facts)
+			continue;
+
+		s_write_facts(s, name, facts);
+		hash_set(s->unsaved, name, NULL);
+		s_factab_done(s->interned, facts);
+		free(facts);
+		n++;
+	}
+
+	if (s->saveq && s->saved == s->saveq->num) {
+		strings_free(s->saveq);
+		s->saveq = NULL;
+		s->saved = 0;
+	}
+	s->savedat = time(NULL);
+}
+
+typedef struct {
+	char   *name;
+	time_t  seen;
+} recent_t;
+
+static int s_recent_cmp(const void *a, const void *b)
+{
+	const recent_t *x = a, *y = b;
+	return x->seen < y->seen ? 1 : x->seen > y->seen ? -1 : strcmp(x->name, y->name);
+}
+
+/* queue up the most recently seen hosts (by the age of their
+   saved facts) to have their policies precompiled */
+static void s_warmup_start(server_t *s)
+{
+	glob_t files;
+	struct stat st;
+	recent_t *recent;
+	size_t i, n = 0;
+
+	if (!s->factsdir || !*s->factsdir || !s->warmup_max)
+		return;
+
+	char *pattern = string("%s/*.facts", s->factsdir);
+	int rc = glob(pattern, 0, NULL, &files);
+	free(pattern);
+	if (rc != 0)
+		return;
+
+	recent = vcalloc(files.gl_pathc, sizeof(recent_t));
+	for (i = 0; i < files.gl_pathc; i++) {
+		if (stat(files.gl_pathv[i], &st) != 0)
+			continue;
+
+		const char *base = strrchr(files.gl_pathv[i], '/');
+		base = base ? base + 1 : files.gl_pathv[i];
+		recent[n].name = strndup(base, strlen(base) - strlen(".facts"));
+		recent[n].seen = st.st_mtime;
+		n++;
+	}
+	globfree(&files);
+	qsort(recent, n, sizeof(recent_t), s_recent_cmp);
+
+	if (s->warmup) strings_free(s->warmup);
+	s->warmup = strings_new(NULL);
+	s->warmed = 0;
+	for (i = 0; i < n; i++) {
+		if (i < s->warmup_max)
+			strings_add(s->warmup, recent[i].name);
+		free(recent[i].name);
+	}
+	free(recent);
+
+	logger(LOG_INFO, "Precompiling policies for the %lu most recently seen host(s)",
+		(unsigned long)s->warmup->num);
+}
+
+static void s_warmup_host(server_t *s, const char *name)
+{
+	struct stree *pnode;
+	struct policy *pol;
+	hash_t *facts;
+	byte_t *code = NULL;
+	size_t len = 0;
+
+	char *path = string("%s/%s.facts", s->factsdir, name);
+	FILE *io = fopen(path, "r");
+	free(path);
+	if (!io)
+		return;
+
+	facts = vmalloc(sizeof(hash_t));
+	fact_read(io, facts);
+	fclose(io);
+
+	pnode = hash_get(s->manifest->hosts, name);
+	if (!pnode) pnode = s->manifest->fallback;
+	if (pnode && (pol = manifest_generate(s->manifest, pnode, facts)) != NULL) {
+		s_gencode(s, pol, name, &code, &len);
+		free(code);
+		policy_free_all(pol);
+	}
+
+	hash_done(facts, 1);
+	free(facts);
+}
+
+/* precompile the next few queued policies; this is only done
+   when there are no clients waiting to be served */
+static void s_warmup(server_t *s)
+{
+	unsigned int i, total = s->warmup->num, before = s->warmed;
+
+	for (i = 0; i < s->warmup_batch && s->warmed < total; i++)
+		s_warmup_host(s, s->warmup->strings[s->warmed++]);
+
+	if (s->warmed == total) {
+		logger(LOG_INFO, "Precompiled policies for %u host(s)", total);
+		strings_free(s->warmup);
+		s->warmup = NULL;
+
+	} else if (before * 10 / total != s->warmed * 10 / total) {
+		logger(LOG_INFO, "Precompiled policies for %u of %u host(s)", s->warmed, total);
+	}
+}
+
 static int s_state_machine(client_t *fsm, pdu_t *pdu, pdu_t **reply)
 {
+	unsigned int next;
 	cache_touch(fsm->server->clients, fsm->id, 0);
 
 	logger(LOG_DEBUG, "fsm: transition %s [%i] -> %s [%i]",
@@ -289,6 +827,7 @@ static int s_state_machine(client_t *fsm, pdu_t *pdu, pdu_t **reply)
 	case EVENT_PING:
 		*reply = pdu_reply(pdu, "PONG", 0);
 		pdu_extendf(*reply, "%lu", CLOCKWORK_PROTOCOL);
+		pdu_extendf(*reply, "%s", "facts.delta");
 		return 0;
 
 	case EVENT_HELLO:
@@ -304,10 +843,11 @@ static int s_state_machine(client_t *fsm, pdu_t *pdu, pdu_t **reply)
 			fsm->offset = 0;
 
 		case STATE_POLICY:
-			hash_done(fsm->facts, 1);
-			fsm->facts = NULL;
+			s_client_facts_free(fsm);
 			policy_free(fsm->policy);
 			fsm->policy = NULL;
+			manifest_free(fsm->manifest);
+			fsm->manifest = NULL;
 
 		case STATE_IDENTIFIED:
 			free(fsm->name);
@@ -378,34 +918,63 @@ static int s_state_machine(client_t *fsm, pdu_t *pdu, pdu_t **reply)
 			fsm->offset = 0;
 
 		case STATE_POLICY:
-			hash_done(fsm->facts, 1);
-			fsm->facts = NULL;
+			s_client_facts_free(fsm);
 			policy_free(fsm->policy);
 			fsm->policy = NULL;
+			manifest_free(fsm->manifest);
+			fsm->manifest = NULL;
 
 		case STATE_IDENTIFIED:
 			/* fall-through */
 			break;
 		}
 
-		char *facts = pdu_string(pdu, 2);
-		fsm->facts = vmalloc(sizeof(hash_t));
-		fact_read_string(facts, fsm->facts);
-		free(facts);
+		/* clients that understand fact deltas send a binary delta
+		   in the second frame, and the base version in the third */
+		const char *version = NULL;
+		char *token = pdu_string(pdu, 3);
+		if (token) {
+			size_t n = 0;
+			uint8_t *delta = pdu_segment(pdu, 2, &n);
+			version = s_patch_facts(fsm, token, delta, delta ? n : 0);
+			free(delta);
+			free(token);
+
+			if (!version) {
+				*reply = pdu_reply(pdu, "RESYNC", 0);
+				fsm->state = STATE_IDENTIFIED;
+				return 0;
+			}
 
-		fsm->pnode = hash_get(fsm->server->manifest->hosts, fsm->name);
-		if (!fsm->pnode) fsm->pnode = fsm->server->manifest->fallback;
+		} else {
+			char *facts = pdu_string(pdu, 2);
+			s_read_facts(fsm, facts);
+			free(facts);
+		}
+		fsm->facts = vmalloc(sizeof(hash_t));
+		s_save_facts(fsm->server, fsm->name, fsm->factab);
+
+		/* hold on to this manifest until we're done with it,
+		   even if clockd reloads a new one in the meantime */
+		manifest_free(fsm->manifest);
+		fsm->manifest = manifest_retain(fsm->server->manifest);
+		fsm->pnode = hash_get(fsm->manifest->hosts, fsm->name);
+		if (!fsm->pnode) fsm->pnode = fsm->manifest->fallback;
 		if (!fsm->pnode) {
 			fsm->error = FSM_ERR_NO_POLICY_FOUND;
 			return 1;
 		}
-		fsm->policy = policy_generate(fsm->pnode, fsm->facts);
+		const char **slots = s_factab_slots(fsm->factab, fsm->manifest);
+		fsm->policy = manifest_generate_slots(fsm->manifest, fsm->pnode, slots, fsm->facts);
+		free(slots);
 
 		byte_t *code = NULL;
 		size_t len = 0;
-		int rc = s_gencode(fsm, &code, &len); assert(rc == 0);
+		int rc = s_gencode(fsm->server, fsm->policy, fsm->name, &code, &len); assert(rc == 0);
 		*reply = pdu_reply(pdu, "POLICY", 0); assert(*reply);
 		pdu_extend(*reply, code, len);
+		if (version)
+			pdu_extendf(*reply, "%s", version);
 		free(code);
 		fsm->state = STATE_POLICY;
 		return 0;
@@ -443,7 +1012,10 @@ static int s_state_machine(client_t *fsm, pdu_t *pdu, pdu_t **reply)
 			return 1;
 		}
 
-		fsm->contents = resource_content(r, fsm->facts);
+		/* templates get to see every fact */
+		if (!fsm->factview)
+			fsm->factview = s_factab_hash(fsm->factab, fsm->facts);
+		fsm->contents = resource_content(r, fsm->factview);
 		if (!fsm->contents) {
 			logger(LOG_ERR, "failed to generate content for %s (on behalf of %s): %s",
 				r->key, fsm->name, strerror(errno));
@@ -533,6 +1105,7 @@ static int s_state_machine(client_t *fsm, pdu_t *pdu, pdu_t **reply)
 		break;
 
 	case EVENT_BYE:
+		next = s_checkin(fsm->server, fsm->name ? fsm->name : fsm->id, 0);
 		switch (fsm->state) {
 		case STATE_REPORT:
 		case STATE_FILE:
@@ -546,11 +1119,11 @@ static int s_state_machine(client_t *fsm, pdu_t *pdu, pdu_t **reply)
 			fsm->offset = 0;
 
 		case STATE_POLICY:
-			hash_done(fsm->facts, 1);
-			free(fsm->facts);
-			fsm->facts = NULL;
+			s_client_facts_free(fsm);
 			policy_free_all(fsm->policy);
 			fsm->policy = NULL;
+			manifest_free(fsm->manifest);
+			fsm->manifest = NULL;
 
 		case STATE_IDENTIFIED:
 			free(fsm->name);
@@ -564,6 +1137,8 @@ static int s_state_machine(client_t *fsm, pdu_t *pdu, pdu_t **reply)
 		fsm->state = STATE_INIT;
 		cache_touch(fsm->server->clients, fsm->id, 1);
 		*reply = pdu_reply(pdu, "BYE", 0);
+		if (next)
+			pdu_extendf(*reply, "%u", next);
 		return 0;
 	}
 
@@ -580,10 +1155,8 @@ static void s_client_destroy(void *p)
 	free(c->id);
 	free(c->name);
 
-	if (c->facts) {
-		hash_done(c->facts, 1);
-		free(c->facts);
-	}
+	if (c->server)
+		s_client_facts_free(c);
 
 	if (c->contents) {
 		fclose(c->contents->io);
@@ -591,6 +1164,7 @@ static void s_client_destroy(void *p)
 	}
 
 	policy_free_all(c->policy);
+	manifest_free(c->manifest);
 	free(c);
 }
 
@@ -600,6 +1174,12 @@ static inline void s_server_default_config(list_t *config, int init)
 	config_set(config, "ccache.connections",  "2048");
 	config_set(config, "ccache.expiration",   "600");
 	config_set(config, "manifest",            "/etc/clockwork/manifest.pol");
+	config_set(config, "manifest.cache",      CW_CACHE_DIR "/manifest.cache");
+	config_set(config, "facts.dir",           "");
+	config_set(config, "facts.expiration",    "3600");
+	config_set(config, "warmup.hosts",        "1000");
+	config_set(config, "warmup.concurrency",  "4");
+	config_set(config, "checkin.interval",    "0");
 	config_set(config, "copydown",            CW_GATHER_DIR);
 	config_set(config, "syslog.ident",        "clockd");
 	config_set(config, "syslog.facility",     "daemon");
@@ -619,6 +1199,12 @@ static inline void s_server_default_config(list_t *config, int init)
 	logger(LOG_DEBUG, "  ccache.connections  %s", config_get(config, "ccache.connections"));
 	logger(LOG_DEBUG, "  ccache.expiration   %s", config_get(config, "ccache.expiration"));
 	logger(LOG_DEBUG, "  manifest            %s", config_get(config, "manifest"));
+	logger(LOG_DEBUG, "  manifest.cache      %s", config_get(config, "manifest.cache"));
+	logger(LOG_DEBUG, "  facts.dir           %s", config_get(config, "facts.dir"));
+	logger(LOG_DEBUG, "  facts.expiration    %s", config_get(config, "facts.expiration"));
+	logger(LOG_DEBUG, "  warmup.hosts        %s", config_get(config, "warmup.hosts"));
+	logger(LOG_DEBUG, "  warmup.concurrency  %s", config_get(config, "warmup.concurrency"));
+	logger(LOG_DEBUG, "  checkin.interval    %s", config_get(config, "checkin.interval"));
 	logger(LOG_DEBUG, "  copydown            %s", config_get(config, "copydown"));
 	logger(LOG_DEBUG, "  syslog.ident        %s", config_get(config, "syslog.ident"));
 	logger(LOG_DEBUG, "  syslog.facility     %s", config_get(config, "syslog.facility"));
@@ -672,6 +1258,25 @@ static void s_server_setup_logger(server_t *s, list_t *config)
 	logger(LOG_INFO, "clockd starting up");
 }
 
+static inline void s_server_warmup_config(server_t *s, list_t *config)
+{
+	int n;
+
+	s->factsdir = strdup(config_get(config, "facts.dir"));
+
+	n = atoi(config_get(config, "facts.expiration"));
+	s->factexpire = n > 0 ? n : 0;
+
+	n = atoi(config_get(config, "warmup.hosts"));
+	s->warmup_max = n > 0 ? n : 0;
+
+	n = atoi(config_get(config, "warmup.concurrency"));
+	s->warmup_batch = n > 0 ? n : 1;
+
+	n = atoi(config_get(config, "checkin.interval"));
+	s->checkin = n > 0 ? n : 0;
+}
+
 static inline server_t *s_server_reload(server_t *orig)
 {
 	if (!orig->daemonize) {
@@ -692,16 +1297,19 @@ static inline server_t *s_server_reload(server_t *orig)
 	LIST(config);
 	s_server_default_config(&config, 0);
 
-	logger(LOG_DEBUG, "parsing clockd configuration file '%s'", s->config_file);
-	FILE *io = fopen(s->config_file, "r");
+	logger(LOG_DEBUG, "parsing clockd configuration file '%s'", orig->config_file);
+	FILE *io = fopen(orig->config_file, "r");
 	if (!io) {
 		logger(LOG_WARNING, "Failed to read configuration from %s: %s",
-			s->config_file, strerror(errno));
+			orig->config_file, strerror(errno));
 		logger(LOG_WARNING, "Using default configuration");
 
 	} else {
 		if (config_read(&config, io) != 0) {
-			logger(LOG_ERR, "Unable to parse %s");
+			logger(LOG_ERR, "Unable to parse %s", orig->config_file);
+			fclose(io);
+			config_done(&config);
+			free(s);
 			return NULL;
 		}
 		fclose(io);
@@ -711,19 +1319,73 @@ static inline server_t *s_server_reload(server_t *orig)
 	/* set log level, facility and ident */
 	s_server_setup_logger(s, &config);
 
-	s->manifest = parse_file(config_get(&config, "manifest"));
+	/* if none of the policy files have changed, there's no
+	   need to parse (or even load) anything; just share the
+	   manifest that we're already running with */
+	if (parse_current(orig->manifest, config_get(&config, "manifest"))
+	 && strcmp(orig->include, config_get(&config, "pendulum.inc")) == 0) {
+		logger(LOG_INFO, "Manifest %s is unchanged", config_get(&config, "manifest"));
+		s->manifest = manifest_retain(orig->manifest);
+
+	} else {
+		s->manifest = parse_cached(config_get(&config, "manifest"),
+		                           config_get(&config, "manifest.cache"));
+	}
 	if (!s->manifest) {
 		if (errno)
 			logger(LOG_CRIT, "Failed to parse %s: %s",
 				config_get(&config, "manifest"), strerror(errno));
+		config_done(&config);
+		free(s);
 		return NULL;
 	}
 
 	s->copydown = strdup(config_get(&config, "copydown"));
 	s->include  = strdup(config_get(&config, "pendulum.inc"));
+	s_server_warmup_config(s, &config);
+	config_done(&config);
 	return s;
 }
 
+/* hand the listener, clients and facts of $old over to the freshly
+   reloaded $new, and free what's left of $old.  Clients that are
+   in the middle of a run keep a reference to the old manifest, so
+   it sticks around until the last of them is done with it. */
+static inline server_t *s_server_swap(server_t *old, server_t *new)
+{
+	new->config_file = old->config_file;
+	new->zmq         = old->zmq;
+	new->listener    = old->listener;
+	new->clients     = old->clients;
+	new->cert        = old->cert;
+	new->tdb         = old->tdb;
+	new->zap         = old->zap;
+	new->interned    = old->interned;
+	new->factsets    = old->factsets;
+	new->factserial  = old->factserial;
+
+	/* facts.dir may have moved, and warm-up is about to read it */
+	s_save_pending(old, 0);
+	new->unsaved     = old->unsaved;
+
+	/* cached clients still point at $old (until they send their
+	   next PDU), and expiring them needs the intern pool */
+	size_t i;
+	for (i = 0; i < new->clients->max_len; i++) {
+		client_t *c = new->clients->entries[i].data;
+		if (new->clients->entries[i].ident && c)
+			c->server = new;
+	}
+
+	manifest_free(old->manifest);
+	free(old->copydown);
+	free(old->include);
+	free(old->factsdir);
+	if (old->warmup) strings_free(old->warmup);
+	free(old);
+	return new;
+}
+
 static inline server_t *s_server_new(int argc, char **argv)
 {
 	char *t;
@@ -840,6 +1502,12 @@ static inline server_t *s_server_new(int argc, char **argv)
 		printf("ccache.connections  %s\n", config_get(&config, "ccache.connections"));
 		printf("ccache.expiration   %s\n", config_get(&config, "ccache.expiration"));
 		printf("manifest            %s\n", config_get(&config, "manifest"));
+		printf("manifest.cache      %s\n", config_get(&config, "manifest.cache"));
+		printf("facts.dir           %s\n", config_get(&config, "facts.dir"));
+		printf("facts.expiration    %s\n", config_get(&config, "facts.expiration"));
+		printf("warmup.hosts        %s\n", config_get(&config, "warmup.hosts"));
+		printf("warmup.concurrency  %s\n", config_get(&config, "warmup.concurrency"));
+		printf("checkin.interval    %s\n", config_get(&config, "checkin.interval"));
 		printf("copydown            %s\n", config_get(&config, "copydown"));
 		printf("syslog.ident        %s\n", config_get(&config, "syslog.ident"));
 		printf("syslog.facility     %s\n", config_get(&config, "syslog.facility"));
@@ -878,7 +1546,12 @@ static inline server_t *s_server_new(int argc, char **argv)
 
 	s->copydown = strdup(config_get(&config, "copydown"));
 	s->include  = strdup(config_get(&config, "pendulum.inc"));
-	s->manifest = parse_file(config_get(&config, "manifest"));
+	s_server_warmup_config(s, &config);
+	/* don't let a syntax check rewrite the precompiled manifest */
+	s->manifest = s->mode == MODE_TEST
+		? parse_file(config_get(&config, "manifest"))
+		: parse_cached(config_get(&config, "manifest"),
+		               config_get(&config, "manifest.cache"));
 	if (!s->manifest) {
 		if (errno)
 			logger(LOG_CRIT, "Failed to parse %s: %s",
@@ -897,6 +1570,9 @@ static inline server_t *s_server_new(int argc, char **argv)
 	s->clients = cache_new(atoi(config_get(&config, "ccache.connections")),
 	                       atoi(config_get(&config, "ccache.expiration")));
 	s->clients->destroy_f = s_client_destroy;
+	s->interned = vmalloc(sizeof(hash_t));
+	s->factsets = vmalloc(sizeof(hash_t));
+	s->unsaved  = vmalloc(sizeof(hash_t));
 
 
 	s->zmq = zmq_ctx_new();
@@ -936,13 +1612,29 @@ static inline server_t *s_server_new(int argc, char **argv)
 
 static inline void s_server_destroy(server_t *s)
 {
+	char *k;
+	factset_t *fs;
 	cache_free(s->clients);
+
+	s_save_pending(s, 0);
+	hash_done(s->unsaved, 0);
+	free(s->unsaved);
+
+	for_each_key_value(s->factsets, k, fs)
+		s_factset_free(s, fs);
+	hash_done(s->factsets, 0);
+	free(s->factsets);
+	hash_done(s->interned, 1);
+	free(s->interned);
+
 	manifest_free(s->manifest);
 	cert_free(s->cert);
 	trustdb_free(s->tdb);
 	free(s->config_file);
 	free(s->copydown);
 	free(s->include);
+	free(s->factsdir);
+	if (s->warmup) strings_free(s->warmup);
 
 	zap_shutdown(s->zap);
 	zmq_ctx_destroy(s->zmq);
@@ -957,7 +1649,7 @@ int main(int argc, char **argv)
 	alarm(60);
 #endif
 
-	server_t *new = NULL;
+	server_t *new;
 	server_t *s = s_server_new(argc, argv);
 
 #ifdef UNIT_TESTS
@@ -972,33 +1664,24 @@ int main(int argc, char **argv)
 	}
 
 	signal_handlers();
+	s_warmup_start(s);
 again:
 	while (!signalled() && !DO_RELOAD) {
 		cache_purge(s->clients, 0);
-		if (new) {
-			int empty = 1;
-			int i;
-			for (i = 0; i < s->clients->max_len; i++) {
-				if (!s->clients->entries[i].ident) continue;
-				empty = 0;
-				break;
-			}
-
-			if (empty) {
-				new->config_file = s->config_file;
-				new->zmq         = s->zmq;
-				new->listener    = s->listener;
-				new->clients     = s->clients;
-				new->cert        = s->cert;
-				new->tdb         = s->tdb;
-				new->zap         = s->zap;
-
-				manifest_free(s->manifest);
-				free(s->copydown);
-				free(s->include);
-				free(s);
-				s = new;
-				new = NULL;
+		s_factsets_purge(s);
+
+		/* don't let saved facts fall too far behind a busy server */
+		if (s->saveq && time(NULL) - s->savedat >= 60)
+			s_save_pending(s, s->warmup_batch);
+
+		if (s->warmup || s->saveq) {
+			/* only save / precompile when nobody is waiting on us */
+			zmq_pollitem_t socks[] = {{ s->listener, 0, ZMQ_POLLIN, 0 }};
+			int rc = zmq_poll(socks, 1, 0);
+			if (rc <= 0) {
+				if (rc == 0 && s->saveq) s_save_pending(s, s->warmup_batch);
+				else if (rc == 0)        s_warmup(s);
+				continue;
 			}
 		}
 
@@ -1010,21 +1693,15 @@ again:
 		logger(LOG_DEBUG, "received inbound connection, checking for client details");
 		client_t *c = cache_get(s->clients, pdu_peer(pdu));
 		if (!c) {
-			if (new) {
-				/* don't accept new inbound connections while reloading... */
-				logger(LOG_WARNING, "clockd is reloading; turning away client");
-				reply = pdu_reply(pdu, "ERROR", 1, "Server busy; try again later\n");
-				pdu_send_and_free(reply, s->listener);
-				pdu_free(pdu);
-				continue;
-			}
-
 			c = vmalloc(sizeof(client_t));
 			c->id = strdup(pdu_peer(pdu));
 
 			if (!cache_set(s->clients, pdu_peer(pdu), c)) {
 				logger(LOG_CRIT, "max connections reached!");
 				reply = pdu_reply(pdu, "ERROR", 1, "Server busy; try again later\n");
+				unsigned int next = s_checkin(s, pdu_peer(pdu), 1);
+				if (next)
+					pdu_extendf(reply, "%u", next);
 				pdu_send_and_free(reply, s->listener);
 				pdu_free(pdu);
 				s_client_destroy(c);
@@ -1063,6 +1740,10 @@ again:
 		logger(LOG_INFO, "Caught %u SIGHUP(s); reloading", DO_RELOAD);
 		DO_RELOAD = 0;
 		new = s_server_reload(s);
+		if (new) {
+			s = s_server_swap(s, new);
+			s_warmup_start(s);
+		}
 		goto again;
 	}
 
@@ -43,6 +43,9 @@
 #define MINIMUM_INTERVAL 30
 #define MINIMUM_TIMEOUT  5
 
+#define MASTER_STAGGER   250   /* ms between connection attempts */
+#define MASTER_BACKOFF   3600  /* max s to deprioritize a failing master */
+
 /* should we try to reload config?
    (for when we catch a SIGHUP) */
 static int DO_RELOAD = 0;
@@ -65,6 +68,7 @@ typedef struct {
 
 	char *cfm_last_retr;
 	char *cfm_last_exec;
+	char *cfm_masters;
 
 	int   mode;
 	int   trace;
@@ -76,10 +80,14 @@ typedef struct {
 		char *endpoint;
 		char *cert_file;
 		cert_t *cert;
+
+		int     fails;  /* consecutive failed attempts */
+		int64_t retry;  /* don't prefer this master until (s) */
 	} masters[8];
 	int nmasters;
 	int current_master;
 	int timeout;
+	int parallel;
 
 	cert_t *cert;
 	void *zap;
@@ -87,9 +95,14 @@ typedef struct {
 	list_t *acl;
 	hash_t *facts;
 
+	int     fact_delta;  /* does the current master accept fact deltas? */
+	char   *fact_token;  /* version of fact_base, as known to the master */
+	hash_t *fact_base;   /* facts last acknowledged by the master */
+
 	struct {
 		int64_t next_run;
 		int     interval;
+		int     hint;     /* master-suggested delay (ms) until next run */
 	} schedule;
 
 	void    *cfm_client;
@@ -140,14 +153,137 @@ static int s_zmq_connect(void *z, const char *endpoint)
 	return rc;
 }
 
-static inline int s_cfm_connect(client_t *c)
+/* masters can suggest (in seconds) when we should next check in, as
+   an extra frame on BYE replies and 'server busy' ERRORs; anything
+   outside of [MINIMUM_INTERVAL, 4 x interval] is ignored */
+static void s_cfm_hint(client_t *c, pdu_t *pdu, int frame)
+{
+	char *s = pdu_string(pdu, frame);
+	if (!s) return;
+
+	char *end;
+	long n = strtol(s, &end, 10);
+	if (*s && !*end && n >= MINIMUM_INTERVAL && n * 1000 <= 4L * c->schedule.interval) {
+		logger(LOG_DEBUG, "master suggests checking back in %lis", n);
+		c->schedule.hint = n * 1000;
+	}
+	free(s);
+}
+
+/* master health is kept in the statedir between runs, one
+   "ENDPOINT FAILS RETRY" line per master */
+static void s_masters_load(client_t *c)
+{
+	int i;
+	for (i = 0; i < c->nmasters; i++) {
+		c->masters[i].fails = 0;
+		c->masters[i].retry = 0;
+	}
+
+	FILE *io = fopen(c->cfm_masters, "r");
+	if (!io) return;
+
+	char line[512], endpoint[256];
+	int fails;
+	long retry;
+	while (fgets(line, sizeof(line), io)) {
+		if (sscanf(line, "%255s %i %li", endpoint, &fails, &retry) != 3)
+			continue;
+		for (i = 0; i < c->nmasters; i++) {
+			if (strcmp(c->masters[i].endpoint, endpoint) != 0)
+				continue;
+			c->masters[i].fails = fails;
+			c->masters[i].retry = retry;
+		}
+	}
+	fclose(io);
+}
+
+static void s_masters_save(client_t *c)
+{
+	char *tmp = string("%s.tmp", c->cfm_masters);
+	FILE *io = fopen(tmp, "w");
+	if (!io) {
+		logger(LOG_WARNING, "Failed to open %s for writing: %s", tmp, strerror(errno));
+		free(tmp);
+		return;
+	}
+
+	int i;
+	for (i = 0; i < c->nmasters; i++)
+		fprintf(io, "%s %i %li\n", c->masters[i].endpoint,
+			c->masters[i].fails, (long)c->masters[i].retry);
+
+	if (fclose(io) != 0 || rename(tmp, c->cfm_masters) != 0) {
+		logger(LOG_WARNING, "Failed to update %s: %s", c->cfm_masters, strerror(errno));
+		unlink(tmp);
+	}
+	free(tmp);
+}
+
+static void s_master_failed(client_t *c, int i)
 {
-	c->cfm_client = zmq_socket(c->zmq, ZMQ_DEALER);
-	if (!c->cfm_client) return 0;
+	int64_t backoff = c->schedule.interval / 1000;
+	int n = c->masters[i].fails++;
+	while (n-- > 0 && backoff < MASTER_BACKOFF)
+		backoff *= 2;
+	if (backoff > MASTER_BACKOFF)
+		backoff = MASTER_BACKOFF;
+	c->masters[i].retry = time_s() + backoff;
+}
+
+/* rank the masters for this host: healthy masters first, ordered by a
+   consistent (rendezvous) hash of our FQDN and their endpoint, so that
+   each host sticks to the same master and hosts are spread evenly over
+   all of them; failing masters last, soonest-to-recover first. */
+static int s_masters_rank(client_t *c, int *order)
+{
+	uint32_t score[8];
+	int64_t now = time_s();
+	int i, j, n;
+
+	for (i = 0; i < c->nmasters; i++) {
+		uint32_t h = 5381;
+		const char *p;
+		for (p = c->fqdn; p && *p; p++)
+			h = h * 33 + (uint8_t)*p;
+		h = h * 33 + '|';
+		for (p = c->masters[i].endpoint; *p; p++)
+			h = h * 33 + (uint8_t)*p;
+		score[i] = h ^ (h >> 16);
+	}
+
+	for (n = 0; n < c->nmasters; n++) {
+		for (i = n; i > 0; i--) {
+			int a = order[i-1];
+			int sick_a = c->masters[a].retry > now,
+			    sick_n = c->masters[n].retry > now;
+
+			if (sick_a != sick_n ? !sick_a
+			  : sick_a ? c->masters[a].retry <= c->masters[n].retry
+			           : score[a] >= score[n])
+				break;
+			order[i] = a;
+		}
+		order[i] = n;
+	}
+
+	for (j = 0; j < n; j++)
+		logger(LOG_DEBUG, "master preference #%i: master.%i (%s)%s", j+1,
+			order[j]+1, c->masters[order[j]].endpoint,
+			c->masters[order[j]].retry > now ? " [failing]" : "");
+	return n;
+}
+
+/* open a socket to master i and send it a PING */
+static void* s_cfm_ping(client_t *c, int i, pdu_t *ping)
+{
+	void *z = zmq_socket(c->zmq, ZMQ_DEALER);
+	if (!z) return NULL;
 
 	int rc;
 	logger(LOG_DEBUG, "Setting ZMQ_CURVE_SECRETKEY (sec) to %s", c->cert->seckey_b16);
-	rc = zmq_setsockopt(c->cfm_client, ZMQ_CURVE_SECRETKEY, cert_secret(c->cert), 32);
+	rc = zmq_setsockopt(z, ZMQ_CURVE_SECRETKEY, cert_secret(c->cert), 32);
 	if (rc != 0) {
 		logger(LOG_CRIT, "Failed to set ZMQ_CURVE_SECRETKEY option on client socket: %s",
 			zmq_strerror(errno));
@@ -160,77 +296,188 @@ static inline int s_cfm_connect(client_t *c)
 		exit(4);
 	}
 	logger(LOG_DEBUG, "Setting ZMQ_CURVE_PUBLICKEY (pub) to %s", c->cert->pubkey_b16);
-	rc = zmq_setsockopt(c->cfm_client, ZMQ_CURVE_PUBLICKEY, cert_public(c->cert), 32);
+	rc = zmq_setsockopt(z, ZMQ_CURVE_PUBLICKEY, cert_public(c->cert), 32);
 	assert(rc == 0);
 
-	pdu_t *ping = pdu_make("PING", 0);
-	pdu_extendf(ping, "%lu", CLOCKWORK_PROTOCOL);
-	pdu_t *pong;
+	logger(LOG_DEBUG, "Setting ZMQ_CURVE_SERVERKEY (pub) to %s",
+			c->masters[i].cert->pubkey_b16);
+	rc = zmq_setsockopt(z, ZMQ_CURVE_SERVERKEY, cert_public(c->masters[i].cert), 32);
+	assert(rc == 0);
 
 	char endpoint[256] = "tcp://";
-	int i;
-	for (i = (c->current_master + 1) % 8; ; i = (i + 1) % 8) {
-		if (!c->masters[i].endpoint) continue;
+	strncat(endpoint+6, c->masters[i].endpoint, 249);
+	logger(LOG_DEBUG, "Attempting to connect to %s (%s)", endpoint, c->masters[i].endpoint);
+	rc = s_zmq_connect(z, endpoint);
+	if (rc != 0) {
+		logger(LOG_ERR, "Failed to connect to %s: %s", endpoint, zmq_strerror(errno));
+		vzmq_shutdown(z, 0);
+		return NULL;
+	}
+	logger(LOG_DEBUG, "Connected to %s", endpoint);
 
-		logger(LOG_DEBUG, "Setting ZMQ_CURVE_SERVERKEY (pub) to %s",
-				c->masters[i].cert->pubkey_b16);
-		rc = zmq_setsockopt(c->cfm_client, ZMQ_CURVE_SERVERKEY, cert_public(c->masters[i].cert), 32);
-		assert(rc == 0);
+	if (pdu_send(ping, z) != 0) {
+		logger(LOG_ERR, "Failed to send PING to master %i (%s): %s",
+			i+1, c->masters[i].endpoint, zmq_strerror(errno));
+		vzmq_shutdown(z, 0);
+		return NULL;
+	}
+	return z;
+}
 
-		strncat(endpoint+6, c->masters[i].endpoint, 249);
-		logger(LOG_DEBUG, "Attempting to connect to %s (%s)", endpoint, c->masters[i].endpoint);
-		rc = s_zmq_connect(c->cfm_client, endpoint);
-		if (rc != 0) {
-			logger(LOG_ERR, "Failed to connect to %s: %s", endpoint, zmq_strerror(errno));
+/* check a PING reply from master i; returns 0 if we can use it */
+static int s_cfm_pong(client_t *c, int i, pdu_t *pong)
+{
+	if (strcmp(pdu_type(pong), "ERROR") == 0) {
+		char *e = pdu_string(pong, 1);
+		logger(LOG_ERR, "Master %i (%s) refused us: %s",
+			i+1, c->masters[i].endpoint, e);
+		free(e);
+		s_cfm_hint(c, pong, 2);
+		return 1;
+	}
+
+	if (strcmp(pdu_type(pong), "PONG") != 0) {
+		logger(LOG_ERR, "Unexpected %s response from master %i (%s) - expected PONG",
+			pdu_type(pong), i+1, c->masters[i].endpoint);
+		return 1;
+	}
+
+	char *vframe = pdu_string(pong, 1);
+	int vers = atoi(vframe);
+	free(vframe);
+
+	if (vers != CLOCKWORK_PROTOCOL) {
+		logger(LOG_ERR, "Upstream server speaks protocol %i (we want %i)",
+		vers, CLOCKWORK_PROTOCOL);
+		return 1;
+	}
+
+	char *cap = pdu_string(pong, 2);
+	c->fact_delta = cap && strcmp(cap, "facts.delta") == 0;
+	free(cap);
+	return 0;
+}
+
+/* try masters in order of preference, starting a new attempt every
+   MASTER_STAGGER ms until one of them answers our PING (happy eyeballs) */
+static inline int s_cfm_connect(client_t *c)
+{
+	int order[8], n, next = 0, live = 0, k, won = -1;
+	void *socks[8];
+	int who[8];
+	int64_t until[8], launch = 0, now;
+	zmq_pollitem_t items[8];
+
+	c->cfm_client = NULL;
+	s_masters_load(c);
+	n = s_masters_rank(c, order);
+
+	pdu_t *ping = pdu_make("PING", 0);
+	pdu_extendf(ping, "%lu", CLOCKWORK_PROTOCOL);
+
+	while (won < 0) {
+		now = time_ms();
+
+		/* start another attempt, if it's time */
+		if (next < n && (live == 0 || now >= launch)) {
+			int i = order[next++];
+			void *z = s_cfm_ping(c, i, ping);
+			if (!z) {
+				s_master_failed(c, i);
+				continue;
+			}
+			socks[live] = z;
+			who[live]   = i;
+			until[live] = now + c->timeout;
+			live++;
+			launch = now + MASTER_STAGGER;
 			continue;
 		}
-		logger(LOG_DEBUG, "Connected to %s", endpoint);
 
-		/* send the PING */
-		pong = s_sendto(c->cfm_client, ping, c->timeout);
-		if (pong) {
-			if (strcmp(pdu_type(pong), "PONG") != 0) {
-				logger(LOG_ERR, "Unexpected %s response from master %i (%s) - expected PONG",
-					pdu_type(pong), i+1, c->masters[i].endpoint);
+		/* give up on attempts that have timed out */
+		for (k = 0; k < live; k++) {
+			if (until[k] > now) continue;
+			logger(LOG_ERR, "No response from master %i (%s): possible certificate mismatch",
+				who[k]+1, c->masters[who[k]].endpoint);
+			s_master_failed(c, who[k]);
+			vzmq_shutdown(socks[k], 0);
+			live--;
+			socks[k] = socks[live]; who[k] = who[live]; until[k] = until[live];
+			k--;
+		}
+		if (live == 0) {
+			if (next < n) continue;
+			break;
+		}
 
-			} else {
-				char *vframe = pdu_string(pong, 1);
-				int vers = atoi(vframe);
-				free(vframe);
-
-				if (vers != CLOCKWORK_PROTOCOL) {
-					logger(LOG_ERR, "Upstream server speaks protocol %i (we want %i)",
-					vers, CLOCKWORK_PROTOCOL);
-				} else break;
+		int64_t wait = until[0];
+		for (k = 1; k < live; k++)
+			if (until[k] < wait) wait = until[k];
+		if (next < n && launch < wait)
+			wait = launch;
+		wait -= now;
+
+		for (k = 0; k < live; k++) {
+			items[k].socket  = socks[k];
+			items[k].fd      = 0;
+			items[k].events  = ZMQ_POLLIN;
+			items[k].revents = 0;
+		}
+		if (zmq_poll(items, live, wait < 0 ? 0 : wait) < 0) {
+			if (errno == EINTR) continue;
+			logger(LOG_ERR, "Failed to poll masters: %s", zmq_strerror(errno));
+			break;
+		}
+
+		for (k = 0; k < live; k++) {
+			if (!(items[k].revents & ZMQ_POLLIN))
+				continue;
+
+			pdu_t *pong = pdu_recv(socks[k]);
+			if (pong && s_cfm_pong(c, who[k], pong) == 0) {
+				pdu_free(pong);
+				won = k;
+				break;
 			}
+			pdu_free(pong);
 
-		} else {
-			if (errno == 0)
-				logger(LOG_ERR, "No response from master %i (%s)",
-					i+1, c->masters[i].endpoint);
-			else if (errno == EAGAIN)
-				logger(LOG_ERR, "No response from master %i (%s): possible certificate mismatch",
-					i+1, c->masters[i].endpoint);
-			else
-				logger(LOG_ERR, "Unexpected error talking to master %i (%s): %s",
-					i+1, c->masters[i].endpoint, zmq_strerror(errno));
+			s_master_failed(c, who[k]);
+			vzmq_shutdown(socks[k], 0);
+			live--;
+			socks[k] = socks[live]; who[k] = who[live]; until[k] = until[live];
+			items[k] = items[live];
+			k--;
 		}
+	}
+	pdu_free(ping);
 
-		if (i == c->current_master) {
-			logger(LOG_ERR, "No masters were reachable; falling back to cached policy");
-			vzmq_shutdown(c->cfm_client, 0);
-			pdu_free(ping);
-			pdu_free(pong);
-			c->cfm_client = NULL;
-			return 0;
-		};
+	/* hang up on everyone who was too slow */
+	for (k = 0; k < live; k++) {
+		if (k == won) continue;
+		vzmq_shutdown(socks[k], 0);
 	}
 
-	pdu_free(ping);
-	pdu_free(pong);
+	if (won < 0) {
+		logger(LOG_ERR, "No masters were reachable; falling back to cached policy");
+		s_masters_save(c);
+		return 0;
+	}
 
-	logger(LOG_DEBUG, "setting current master idx to %i", i);
-	c->current_master = i;
+	c->masters[who[won]].fails = 0;
+	c->masters[who[won]].retry = 0;
+	s_masters_save(c);
+
+	/* fact tokens only mean something to the master that issued
+	   them; a different master gets the full set of facts */
+	if (c->current_master != who[won] && c->fact_token) {
+		logger(LOG_INFO, "switching masters; sending a full set of facts");
+		free(c->fact_token);
+		c->fact_token = NULL;
+	}
+
+	logger(LOG_DEBUG, "setting current master idx to %i", who[won]);
+	c->current_master = who[won];
+	c->cfm_client = socks[won];
 	return 0;
 }
 
@@ -314,8 +561,15 @@ static inline int s_cfm_copydown(client_t *c)
 
 static inline int s_cfm_facts(client_t *c)
 {
-	hash_done(c->facts, 1);
-	free(c->facts);
+	if (c->fact_token) {
+		/* keep the last facts the master saw, for the delta */
+		hash_done(c->fact_base, 1);
+		free(c->fact_base);
+		c->fact_base = c->facts;
+	} else {
+		hash_done(c->facts, 1);
+		free(c->facts);
+	}
 
 	c->facts = vmalloc(sizeof(hash_t));
 	logger(LOG_INFO, "Gathering facts from '%s'", c->gatherers);
@@ -327,8 +581,27 @@ static inline int s_cfm_facts(client_t *c)
 	return 0;
 }
 
-static inline int s_cfm_getpolicy(client_t *c)
+static pdu_t* s_cfm_policy_pdu(client_t *c)
 {
+	pdu_t *pdu;
+
+	if (c->fact_delta) {
+		uint8_t *delta;
+		size_t len;
+		if (fact_delta(c->fact_token ? c->fact_base : NULL, c->facts, &delta, &len) != 0) {
+			logger(LOG_CRIT, "Failed to encode fact data");
+			return NULL;
+		}
+		logger(LOG_DEBUG, "sending %lu byte fact delta against version %s",
+			len, c->fact_token ? c->fact_token : "0");
+
+		pdu = pdu_make("POLICY", 1, c->fqdn);
+		pdu_extend(pdu, delta ? delta : (uint8_t*)"", len);
+		pdu_extendf(pdu, "%s", c->fact_token ? c->fact_token : "0");
+		free(delta);
+		return pdu;
+	}
+
 	FILE *io = tmpfile();
 	assert(io);
 
@@ -343,32 +616,65 @@ static inline int s_cfm_getpolicy(client_t *c)
 	if ((void *)factstr == MAP_FAILED) {
 		logger(LOG_CRIT, "Failed to mmap fact data");
 		fclose(io);
-		return 1;
+		return NULL;
 	}
 
-	pdu_t *pdu = pdu_make("POLICY", 2, c->fqdn, factstr);
-	pdu_t *reply = s_sendto(c->cfm_client, pdu, c->timeout);
-	pdu_free(pdu);
+	pdu = pdu_make("POLICY", 2, c->fqdn, factstr);
 
 	munmap(factstr, len);
 	fclose(io);
+	return pdu;
+}
+
+static inline int s_cfm_getpolicy(client_t *c)
+{
+	pdu_t *pdu, *reply;
+
+resync:
+	pdu = s_cfm_policy_pdu(c);
+	if (!pdu)
+		goto fail;
+
+	reply = s_sendto(c->cfm_client, pdu, c->timeout);
+	pdu_free(pdu);
 
 	if (!reply) {
 		logger(LOG_ERR, "POLICY failed: %s", zmq_strerror(errno));
-		return 1;
+		goto fail;
 	}
 	logger(LOG_DEBUG, "Received a '%s' PDU", pdu_type(reply));
+	if (strcmp(pdu_type(reply), "RESYNC") == 0 && c->fact_token) {
+		logger(LOG_INFO, "master does not know fact set version %s; sending all facts",
+			c->fact_token);
+		pdu_free(reply);
+		free(c->fact_token);
+		c->fact_token = NULL;
+		goto resync;
+	}
 	if (strcmp(pdu_type(reply), "ERROR") == 0) {
 		char *e = pdu_string(reply, 1);
 		logger(LOG_ERR, "protocol error: %s", e);
 		free(e);
 		pdu_free(reply);
-		return 1;
+		goto fail;
+	}
+	if (strcmp(pdu_type(reply), "POLICY") != 0) {
+		logger(LOG_ERR, "protocol violation: received a %s PDU (expected a POLICY)", pdu_type(reply));
+		pdu_free(reply);
+		goto fail;
 	}
 
 	c->code = pdu_segment(reply, 1, &c->codelen);
+	free(c->fact_token);
+	c->fact_token = c->fact_delta ? pdu_string(reply, 2) : NULL;
 	pdu_free(reply);
 	return 0;
+
+fail:
+	/* we can't know what the master saw; start over next time */
+	free(c->fact_token);
+	c->fact_token = NULL;
+	return 1;
 }
 
 static inline int s_cfm_cleanup(client_t *c)
@@ -386,16 +692,36 @@ static inline int s_cfm_cleanup(client_t *c)
 		char *e = pdu_string(reply, 1);
 		logger(LOG_ERR, "protocol error: %s", e);
 		free(e);
+	} else {
+		s_cfm_hint(c, reply, 1);
 	}
 	pdu_free(reply);
 	return 0;
 }
 
+/* without a hint from the master, run at a fixed offset (derived
+   from our FQDN) into each interval, so that hosts started at the
+   same time don't all keep checking in at the same time */
+static int64_t s_splay(client_t *c, int64_t now)
+{
+	uint32_t h = 5381;
+	const char *p;
+	for (p = c->fqdn; p && *p; p++)
+		h = h * 33 + (uint8_t)*p;
+
+	int64_t next = now - now % c->schedule.interval
+	             + h % (uint32_t)c->schedule.interval;
+	while (next < now + c->schedule.interval / 2)
+		next += c->schedule.interval;
+	return next;
+}
+
 static void s_cfm_run(client_t *c)
 {
 	stopwatch_t t;
 	int rc;
 	uint32_t count = 0;
+	unsigned long stat_hits = 0, stat_misses = 0;
 	uint32_t ms_connect    = 0,
 	         ms_hello      = 0,
 	         ms_preinit    = 0,
@@ -432,6 +758,7 @@ static void s_cfm_run(client_t *c)
 	c->cfm_client = NULL;
 	c->code = NULL;
 	c->codelen = 0;
+	c->schedule.hint = 0;
 
 	STOPWATCH(&t, ms_connect) { rc = s_cfm_connect(c); }
 
@@ -505,6 +832,8 @@ static void s_cfm_run(client_t *c)
 		assert(rc == 0);
 
 		hash_set(&vm.pragma, "diff.tool", c->difftool);
+		hash_set(&vm.pragma, "sha1db",    "on");
+		vm.aux.async.max = c->parallel;
 	}
 	logger(LOG_INFO, "PARSE took %lums", stopwatch_ms(&t));
 
@@ -534,6 +863,8 @@ static void s_cfm_run(client_t *c)
 		logger(LOG_INFO, "ENFORCE took %lums", stopwatch_ms(&t));
 
 		count = vm.topics;
+		stat_hits   = vm.aux.statcache.hits;
+		stat_misses = vm.aux.statcache.misses;
 
 		if (c->cfm_client) {
 			logger(LOG_INFO, "saving bytecode image at %s", c->cfm_last_exec);
@@ -580,6 +911,7 @@ shut_it_down:
 	                               ms_connect,      ms_hello,       ms_preinit,
 	                               ms_copydown,     ms_facts,       ms_getpolicy,
 	                               ms_parse,        ms_enforce,     ms_cleanup);
+	logger(LOG_NOTICE, "STATS(stat): hits=%lu, misses=%lu", stat_hits, stat_misses);
 
 	acl_write(c->acl, c->acl_file);
 
@@ -589,7 +921,14 @@ maybe_next_time:
 	if (c->mode == MODE_ONCE || c->mode == MODE_CODE)
 		return;
 
-	c->schedule.next_run = time_ms() + c->schedule.interval;
+	if (c->schedule.hint) {
+		c->schedule.next_run = time_ms() + c->schedule.hint;
+		logger(LOG_INFO, "Scheduled next configuration run at %s (as suggested by the master)",
+			time_strf(NULL, c->schedule.next_run / 1000));
+		return;
+	}
+
+	c->schedule.next_run = s_splay(c, time_ms());
 	logger(LOG_INFO, "Scheduled next configuration run at %s (every %li %s)",
 		time_strf(NULL, c->schedule.next_run / 1000),
 		c->schedule.interval / (c->schedule.interval > 120000 ? 60000 : 1000),
@@ -613,6 +952,7 @@ static inline void s_client_default_config(list_t *config, int init)
 	config_set(config, "statedir",        "/lib/clockwork/state");
 	config_set(config, "difftool",        "/usr/bin/diff -u");
 	config_set(config, "umask",           "0022");
+	config_set(config, "parallel",        "1");
 
 	if (init) {
 		log_open(config_get(config, "syslog.ident"), "stderr");
@@ -634,6 +974,7 @@ static inline void s_client_default_config(list_t *config, int init)
 	logger(LOG_DEBUG, "  statedir        %s", config_get(config, "statedir"));
 	logger(LOG_DEBUG, "  difftool        %s", config_get(config, "difftool"));
 	logger(LOG_DEBUG, "  umask           %s", config_get(config, "umask"));
+	logger(LOG_DEBUG, "  parallel        %s", config_get(config, "parallel"));
 }
 
 static void s_client_setup_logger(client_t *c, list_t *config)
@@ -764,6 +1105,7 @@ static void s_client_finish(client_t *c, list_t *config)
 	c->difftool  = strdup(config_get(config, "difftool"));
 	c->schedule.interval  = atoi(config_get(config, "interval"));
 	c->timeout            = atoi(config_get(config, "timeout"));
+	c->parallel           = atoi(config_get(config, "parallel"));
 	c->acl_default = strcmp(config_get(config, "acl.default"), "deny") == 0
 		? ACL_DENY : ACL_ALLOW;
 
@@ -780,6 +1122,12 @@ static void s_client_finish(client_t *c, list_t *config)
 		                    c->timeout, MINIMUM_TIMEOUT);
 		c->timeout = MINIMUM_TIMEOUT;
 	}
+	if (c->parallel < 1) {
+		logger(LOG_WARNING, "invalid parallel value %i detected; "
+		                    "running one resource at a time",
+		                    c->parallel);
+		c->parallel = 1;
+	}
 
 	c->schedule.interval *= 1000;
 	c->timeout           *= 1000;
@@ -801,6 +1149,10 @@ static void s_client_finish(client_t *c, list_t *config)
 	c->cfm_last_exec = string("%s/%s",
 		config_get(config, "statedir"), "policy.S");
 	logger(LOG_DEBUG, "will use last successfully executed policy file '%s'", c->cfm_last_exec);
+
+	c->cfm_masters = string("%s/%s",
+		config_get(config, "statedir"), "masters.S");
+	logger(LOG_DEBUG, "will use master health file '%s'", c->cfm_masters);
 }
 
 static void s_client_umask(client_t *c, list_t *config)
@@ -1040,6 +1392,7 @@ static inline client_t* s_client_new(int argc, char **argv)
 		printf("lockdir         %s\n", config_get(&config, "lockdir"));
 		printf("statedir        %s\n", config_get(&config, "statedir"));
 		printf("difftool        %s\n", config_get(&config, "difftool"));
+		printf("parallel        %s\n", config_get(&config, "parallel"));
 		exit(0);
 	}
 
@@ -1165,6 +1518,9 @@ static void s_client_free(client_t *c)
 
 	hash_done(c->facts, 1);
 	free(c->facts);
+	hash_done(c->fact_base, 1);
+	free(c->fact_base);
+	free(c->fact_token);
 
 	free(c->gatherers);
 	free(c->copydown);
@@ -1174,6 +1530,7 @@ static void s_client_free(client_t *c)
 	free(c->cfm_killswitch);
 	free(c->cfm_last_retr);
 	free(c->cfm_last_exec);
+	free(c->cfm_masters);
 
 	if (c->broadcast) {
 		logger(LOG_DEBUG, "shutting down mesh broadcast socket");
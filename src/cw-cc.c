@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <getopt.h>
 
 #include "../src/policy.h"
 #include "../src/spec/parser.h"
@@ -166,6 +167,8 @@ int main(int argc, char **argv)
 {
 	struct manifest *manifest;
 	int redundant, count, mem;
+	const char *output = NULL, *input = NULL;
+	int opt;
 
 	printf("cw-cc - A Clockwork Compiler\n" \
 	       "\n" \
@@ -173,15 +176,44 @@ int main(int argc, char **argv)
 	       "by the lex/yacc parser allowing you to verify correctness\n" \
 	       "\n");
 
-	if (argc < 2) {
-		fprintf(stderr, "USAGE: %s /path/to/manifest.pol\n", argv[0]);
+	while ((opt = getopt(argc, argv, "+o:i:")) != -1) {
+		switch (opt) {
+		case 'o': output = optarg; break;
+		case 'i': input  = optarg; break;
+		default:  exit(1);
+		}
+	}
+
+	if (input ? output != NULL : optind >= argc) {
+		fprintf(stderr, "USAGE: %s [-o manifest.cache] /path/to/manifest.pol\n"
+		                "       %s -i manifest.cache\n", argv[0], argv[0]);
 		exit(1);
 	}
 
-	manifest = parse_file(argv[1]);
-	if (!manifest) {
-		fprintf(stderr, "Failed to parse %s\n", argv[1]);
-		exit(2);
+	if (input) {
+		manifest = manifest_read(input);
+		if (!manifest) {
+			fprintf(stderr, "Failed to read precompiled manifest %s\n", input);
+			exit(2);
+		}
+
+		unsigned int i;
+		for (i = 0; i < manifest->sources->num; i++)
+			printf("source %s\n", manifest->sources->strings[i]);
+		printf("\n");
+
+	} else {
+		manifest = parse_file(argv[optind]);
+		if (!manifest) {
+			fprintf(stderr, "Failed to parse %s\n", argv[optind]);
+			exit(2);
+		}
+		optind++;
+
+		if (output && manifest_write(manifest, output) != 0) {
+			fprintf(stderr, "Failed to write precompiled manifest %s\n", output);
+			exit(2);
+		}
 	}
 
 	traverse(manifest->root, 0);
@@ -196,6 +228,8 @@ int main(int argc, char **argv)
 	printf("Redundant:   %u\n", redundant);
 	printf("%% Wasted:    %0.2f%%\n", redundant * 100. / count);
 	printf("Memory Used: %ub\n", mem);
+	printf("Unique:      %lu\n", (unsigned long)manifest->nodes_len);
+	printf("Arena Size:  %lub\n", (unsigned long)manifest_arena_size(manifest));
 	printf("\n");
 
 	mem = size_used_by_attr_names(manifest);
@@ -204,10 +238,10 @@ int main(int argc, char **argv)
 	printf("Tot Data1 Mem Usage: %ib\n", mem);
 	printf("\n");
 
-	if (argc > 2) {
+	if (optind < argc) {
 		int i;
 		struct stree *p;
-		for (i = 2; i < argc; i++) {
+		for (i = optind; i < argc; i++) {
 			printf("Checking policy '%s': ", argv[i]);
 			p = hash_get(manifest->policies, argv[i]);
 			printf("%p\n", p);
@@ -0,0 +1,324 @@
+/*
+  Copyright 2011-2015 James Hunt <james@jameshunt.us>
+
+  This file is part of Clockwork.
+
+  Clockwork is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Clockwork is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Clockwork.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "hostsdb.h"
+
+/* lines that aren't host entries (comments, blanks, and
+   anything we can't make sense of) are kept verbatim, as
+   are entries that end up the same as when they were read;
+   only entries that really changed get re-formatted when
+   the file is written back out. */
+
+static hostent_t* s_entry(hostsdb_t *db)
+{
+	hostent_t *ent = vmalloc(sizeof(hostent_t));
+	ent->db = db;
+	ent->aliases = strings_new(NULL);
+	list_init(&ent->l);
+	return ent;
+}
+
+static void s_entry_free(hostent_t *ent)
+{
+	if (!ent) return;
+	list_delete(&ent->l);
+	free(ent->raw);
+	free(ent->orig);
+	free(ent->address);
+	free(ent->hostname);
+	free(ent->comment);
+	strings_free(ent->aliases);
+	free(ent);
+}
+
+static char* s_format(hostent_t *ent)
+{
+	char *aliases = strings_join(ent->aliases, " ");
+	char *s = string("%s\t%s%s%s%s%s", ent->address, ent->hostname,
+		*aliases      ? " "  : "", aliases,
+		ent->comment  ? " #" : "", ent->comment ? ent->comment : "");
+	free(aliases);
+	return s;
+}
+
+/* returns the line to write for an entry (which the caller
+   must free), or NULL if the original line is still good */
+static char* s_line(hostent_t *ent)
+{
+	if (!ent->address)
+		return NULL;
+
+	char *line = s_format(ent);
+	if (ent->orig && strcmp(line, ent->orig) == 0) {
+		free(line);
+		return NULL;
+	}
+	return line;
+}
+
+static char* s_key(const char *address, const char *hostname)
+{
+	return string("%s %s", address, hostname);
+}
+
+static void s_index_free(hostsdb_t *db)
+{
+	if (!db->index) return;
+	hash_done(db->index, 0);
+	free(db->index);
+	db->index = NULL;
+}
+
+static void s_index(hostsdb_t *db)
+{
+	hostent_t *ent;
+
+	if (db->index)
+		return;
+
+	db->index = vmalloc(sizeof(hash_t));
+	for_each_object(ent, &db->entries, l) {
+		if (!ent->address)
+			continue;
+
+		/* first entry wins, same as the resolver */
+		char *key = s_key(ent->address, ent->hostname);
+		if (!hash_get(db->index, key))
+			hash_set(db->index, key, ent);
+		free(key);
+	}
+}
+
+static void s_parse(hostent_t *ent, char *line)
+{
+	char *p, *tok, *comment;
+
+	if ((comment = strchr(line, '#')) != NULL) {
+		*comment++ = '\0';
+		ent->comment = strdup(comment);
+	}
+
+	for (p = line; (tok = strtok(p, " \t")) != NULL; p = NULL) {
+		if (!ent->address)
+			ent->address = strdup(tok);
+		else if (!ent->hostname)
+			ent->hostname = strdup(tok);
+		else
+			strings_add(ent->aliases, tok);
+	}
+
+	/* an address with no hostname isn't an entry */
+	if (ent->address && !ent->hostname) {
+		free(ent->address);
+		ent->address = NULL;
+	}
+}
+
+hostsdb_t* hostsdb_read(const char *root)
+{
+	assert(root); // LCOV_EXCL_LINE
+
+	char *file = string("%s/hosts", root);
+	FILE *io = fopen(file, "r");
+	free(file);
+	if (!io)
+		return NULL;
+
+	hostsdb_t *db = vmalloc(sizeof(hostsdb_t));
+	db->root = strdup(root);
+	list_init(&db->entries);
+
+	char *line = NULL;
+	size_t n = 0;
+	ssize_t len;
+	while ((len = getline(&line, &n, io)) >= 0) {
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+
+		hostent_t *ent = s_entry(db);
+		ent->raw = strdup(line);
+		s_parse(ent, line);
+		if (ent->address)
+			ent->orig = s_format(ent);
+		list_push(&db->entries, &ent->l);
+	}
+	free(line);
+	fclose(io);
+
+	s_index(db);
+	db->dirty = 0;
+	return db;
+}
+
+int hostsdb_write(hostsdb_t *db)
+{
+	assert(db); // LCOV_EXCL_LINE
+
+	hostent_t *ent;
+	struct stat st;
+	char *file    = string("%s/hosts", db->root);
+	char *tmpfile = string("%s/.hosts.%x", db->root, rand());
+
+	FILE *io = fopen(tmpfile, "w");
+	if (!io)
+		goto bail;
+
+	/* keep the original permissions */
+	fchmod(fileno(io), stat(file, &st) == 0 ? st.st_mode & 07777 : 0644);
+
+	for_each_object(ent, &db->entries, l) {
+		char *line = s_line(ent);
+		fprintf(io, "%s\n", line ? line : ent->raw);
+		free(line);
+	}
+
+	if (fclose(io) != 0) {
+		unlink(tmpfile);
+		goto bail;
+	}
+	if (cw_frename(tmpfile, file) != 0) {
+		unlink(tmpfile);
+		goto bail;
+	}
+
+	/* what we just wrote is what's on disk now */
+	for_each_object(ent, &db->entries, l) {
+		char *line = s_line(ent);
+		if (!line)
+			continue;
+		free(ent->raw);
+		free(ent->orig);
+		ent->raw  = line;
+		ent->orig = strdup(line);
+	}
+
+	free(file);
+	free(tmpfile);
+	db->dirty = 0;
+	return 0;
+
+bail:
+	free(file);
+	free(tmpfile);
+	return -1;
+}
+
+int hostsdb_commit(hostsdb_t *db)
+{
+	assert(db); // LCOV_EXCL_LINE
+
+	if (db->dirty)
+		return hostsdb_write(db);
+
+	hostent_t *ent;
+	for_each_object(ent, &db->entries, l) {
+		char *line = s_line(ent);
+		if (line) {
+			free(line);
+			return hostsdb_write(db);
+		}
+	}
+	return 0;
+}
+
+void hostsdb_close(hostsdb_t *db)
+{
+	if (!db) return;
+
+	hostent_t *ent, *tmp;
+	for_each_object_safe(ent, tmp, &db->entries, l)
+		s_entry_free(ent);
+
+	s_index_free(db);
+	free(db->root);
+	free(db);
+}
+
+hostent_t* hostent_find(hostsdb_t *db, const char *address, const char *hostname)
+{
+	assert(db);       // LCOV_EXCL_LINE
+	assert(address);  // LCOV_EXCL_LINE
+	assert(hostname); // LCOV_EXCL_LINE
+
+	s_index(db);
+	char *key = s_key(address, hostname);
+	hostent_t *ent = hash_get(db->index, key);
+	free(key);
+	return ent;
+}
+
+hostent_t* hostent_add(hostsdb_t *db, const char *address, const char *hostname)
+{
+	assert(db);       // LCOV_EXCL_LINE
+	assert(address);  // LCOV_EXCL_LINE
+	assert(hostname); // LCOV_EXCL_LINE
+
+	hostent_t *ent = s_entry(db);
+	ent->address  = strdup(address);
+	ent->hostname = strdup(hostname);
+	list_push(&db->entries, &ent->l);
+	db->dirty = 1;
+
+	if (db->index) {
+		char *key = s_key(address, hostname);
+		if (!hash_get(db->index, key))
+			hash_set(db->index, key, ent);
+		free(key);
+	}
+	return ent;
+}
+
+void hostent_remove(hostent_t *ent)
+{
+	if (!ent) return;
+
+	/* a later duplicate may need to take its place */
+	s_index_free(ent->db);
+	ent->db->dirty = 1;
+	s_entry_free(ent);
+}
+
+int hostent_alias(hostent_t *ent, const char *alias)
+{
+	assert(ent);   // LCOV_EXCL_LINE
+	assert(alias); // LCOV_EXCL_LINE
+
+	strings_add(ent->aliases, alias);
+	return 0;
+}
+
+int hostent_unalias(hostent_t *ent)
+{
+	assert(ent); // LCOV_EXCL_LINE
+
+	if (ent->aliases->num == 0)
+		return 0;
+
+	strings_free(ent->aliases);
+	ent->aliases = strings_new(NULL);
+	return 0;
+}
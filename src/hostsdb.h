@@ -0,0 +1,60 @@
+/*
+  Copyright 2011-2015 James Hunt <james@jameshunt.us>
+
+  This file is part of Clockwork.
+
+  Clockwork is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Clockwork is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Clockwork.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HOSTSDB_H
+#define HOSTSDB_H
+
+#include "clockwork.h"
+
+typedef struct {
+	char   *root;
+	int     dirty;  /* entries added / removed since last written? */
+
+	list_t  entries; /* every line of the file, in order */
+
+	/* "address hostname" lookup index, built on first use */
+	hash_t *index;
+} hostsdb_t;
+
+typedef struct {
+	hostsdb_t *db;
+
+	char      *raw;       /* original line, as read */
+	char      *orig;      /* ... and its entry, as we would write it */
+	char      *address;   /* NULL for comments, blank lines, etc. */
+	char      *hostname;
+	strings_t *aliases;
+	char      *comment;   /* trailing '# ...', if any */
+
+	list_t     l;
+} hostent_t;
+
+hostsdb_t* hostsdb_read(const char *root);
+int hostsdb_write(hostsdb_t *db);
+int hostsdb_commit(hostsdb_t *db);
+void hostsdb_close(hostsdb_t *db);
+
+hostent_t* hostent_find(hostsdb_t *db, const char *address, const char *hostname);
+hostent_t* hostent_add(hostsdb_t *db, const char *address, const char *hostname);
+void hostent_remove(hostent_t *ent);
+
+int hostent_alias(hostent_t *ent, const char *alias);
+int hostent_unalias(hostent_t *ent);
+
+#endif
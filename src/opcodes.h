@@ -126,6 +126,23 @@
 #define OP_AUGEAS_EXISTS_P  0x7a  /* Check if a key exists (similar to augeas.find, without the heap allocation) */
 #define OP_SHA1             0x7b  /* Calculate the SHA1 checksum of an in-memory string */
 #define OP_SYSTEM           0x7c  /* execute a command, printing out stdout */
+#define OP_AUGEAS_LOAD      0x7d  /* load a file into augeas (once per run), using the named lens */
+#define OP_HOSTS_OPEN       0x7e  /* open the /etc/hosts database for reading or writing */
+#define OP_HOSTS_SAVE       0x7f  /* write the /etc/hosts database to disk, if it changed */
+#define OP_HOSTS_CLOSE      0x80  /* close the /etc/hosts database, discarding unsaved changes */
+#define OP_HOSTS_FIND       0x81  /* find a hosts entry by address and hostname */
+#define OP_HOSTS_NEW        0x82  /* add a new hosts entry (with no aliases) for an address and hostname */
+#define OP_HOSTS_DELETE     0x83  /* remove the current hosts entry from the (in-memory) database */
+#define OP_HOSTS_ALIAS      0x84  /* add an alias to the current hosts entry */
+#define OP_HOSTS_UNALIAS    0x85  /* remove all aliases from the current hosts entry */
+#define OP_PKG_VERSION      0x86  /* look up the installed version of a package, without asking localsys */
+#define OP_PKG_BEGIN        0x87  /* start queueing package installs / removals for the next pkg.flush */
+#define OP_PKG_INSTALL      0x88  /* queue a package install (name, version or "latest"); acc is non-zero if not queueing */
+#define OP_PKG_REMOVE       0x89  /* queue a package removal; acc is non-zero if not queueing */
+#define OP_PKG_FLUSH        0x8a  /* install / remove all queued packages in one go; acc is the number that failed */
+#define OP_ASYNC            0x8b  /* call a user-defined function in a worker VM (see pragma parallel), or in-line */
+#define OP_AWAIT            0x8c  /* wait for the worker running a function (if any), and get its return value */
+#define OP_AWAIT_ALL        0x8d  /* wait for all workers; acc is the sum of their return values */
 
 
 /** OPCODE MNEMONIC NAMES **/
@@ -255,6 +272,23 @@ static const char * OPCODES[] = {
 	"augeas.exists?",     /* OP_AUGEAS_EXISTS_P  122  0x7a */
 	"sha1",               /* OP_SHA1             123  0x7b */
 	"system",             /* OP_SYSTEM           124  0x7c */
+	"augeas.load",        /* OP_AUGEAS_LOAD      125  0x7d */
+	"hosts.open",         /* OP_HOSTS_OPEN       126  0x7e */
+	"hosts.save",         /* OP_HOSTS_SAVE       127  0x7f */
+	"hosts.close",        /* OP_HOSTS_CLOSE      128  0x80 */
+	"hosts.find",         /* OP_HOSTS_FIND       129  0x81 */
+	"hosts.new",          /* OP_HOSTS_NEW        130  0x82 */
+	"hosts.delete",       /* OP_HOSTS_DELETE     131  0x83 */
+	"hosts.alias",        /* OP_HOSTS_ALIAS      132  0x84 */
+	"hosts.unalias",      /* OP_HOSTS_UNALIAS    133  0x85 */
+	"pkg.version",        /* OP_PKG_VERSION      134  0x86 */
+	"pkg.begin",          /* OP_PKG_BEGIN        135  0x87 */
+	"pkg.install",        /* OP_PKG_INSTALL      136  0x88 */
+	"pkg.remove",         /* OP_PKG_REMOVE       137  0x89 */
+	"pkg.flush",          /* OP_PKG_FLUSH        138  0x8a */
+	"async",              /* OP_ASYNC            139  0x8b */
+	"await",              /* OP_AWAIT            140  0x8c */
+	"await.all",          /* OP_AWAIT_ALL        141  0x8d */
 	NULL,
 };
 
@@ -386,6 +420,23 @@ static const char * OPCODES[] = {
 #define T_OP_AUGEAS_EXISTS_P  0xbb  /* Check if a key exists (similar to augeas.find, without the heap allocation) */
 #define T_OP_SHA1             0xbc  /* Calculate the SHA1 checksum of an in-memory string */
 #define T_OP_SYSTEM           0xbd  /* execute a command, printing out stdout */
+#define T_OP_AUGEAS_LOAD      0xbe  /* load a file into augeas (once per run), using the named lens */
+#define T_OP_HOSTS_OPEN       0xbf  /* open the /etc/hosts database for reading or writing */
+#define T_OP_HOSTS_SAVE       0xc0  /* write the /etc/hosts database to disk, if it changed */
+#define T_OP_HOSTS_CLOSE      0xc1  /* close the /etc/hosts database, discarding unsaved changes */
+#define T_OP_HOSTS_FIND       0xc2  /* find a hosts entry by address and hostname */
+#define T_OP_HOSTS_NEW        0xc3  /* add a new hosts entry (with no aliases) for an address and hostname */
+#define T_OP_HOSTS_DELETE     0xc4  /* remove the current hosts entry from the (in-memory) database */
+#define T_OP_HOSTS_ALIAS      0xc5  /* add an alias to the current hosts entry */
+#define T_OP_HOSTS_UNALIAS    0xc6  /* remove all aliases from the current hosts entry */
+#define T_OP_PKG_VERSION      0xc7  /* look up the installed version of a package, without asking localsys */
+#define T_OP_PKG_BEGIN        0xc8  /* start queueing package installs / removals for the next pkg.flush */
+#define T_OP_PKG_INSTALL      0xc9  /* queue a package install (name, version or "latest"); acc is non-zero if not queueing */
+#define T_OP_PKG_REMOVE       0xca  /* queue a package removal; acc is non-zero if not queueing */
+#define T_OP_PKG_FLUSH        0xcb  /* install / remove all queued packages in one go; acc is the number that failed */
+#define T_OP_ASYNC            0xcc  /* call a user-defined function in a worker VM (see pragma parallel), or in-line */
+#define T_OP_AWAIT            0xcd  /* wait for the worker running a function (if any), and get its return value */
+#define T_OP_AWAIT_ALL        0xce  /* wait for all workers; acc is the sum of their return values */
 
 
 static const char * ASM[] = {
@@ -515,6 +566,23 @@ static const char * ASM[] = {
 	"augeas.exists?",     /* T_OP_AUGEAS_EXISTS_P  123  0x7b */
 	"sha1",               /* T_OP_SHA1             124  0x7c */
 	"system",             /* T_OP_SYSTEM           125  0x7d */
+	"augeas.load",        /* T_OP_AUGEAS_LOAD      126  0x7e */
+	"hosts.open",         /* T_OP_HOSTS_OPEN       127  0x7f */
+	"hosts.save",         /* T_OP_HOSTS_SAVE       128  0x80 */
+	"hosts.close",        /* T_OP_HOSTS_CLOSE      129  0x81 */
+	"hosts.find",         /* T_OP_HOSTS_FIND       130  0x82 */
+	"hosts.new",          /* T_OP_HOSTS_NEW        131  0x83 */
+	"hosts.delete",       /* T_OP_HOSTS_DELETE     132  0x84 */
+	"hosts.alias",        /* T_OP_HOSTS_ALIAS      133  0x85 */
+	"hosts.unalias",      /* T_OP_HOSTS_UNALIAS    134  0x86 */
+	"pkg.version",        /* T_OP_PKG_VERSION      135  0x87 */
+	"pkg.begin",          /* T_OP_PKG_BEGIN        136  0x88 */
+	"pkg.install",        /* T_OP_PKG_INSTALL      137  0x89 */
+	"pkg.remove",         /* T_OP_PKG_REMOVE       138  0x8a */
+	"pkg.flush",          /* T_OP_PKG_FLUSH        139  0x8b */
+	"async",              /* T_OP_ASYNC            140  0x8c */
+	"await",              /* T_OP_AWAIT            141  0x8d */
+	"await.all",          /* T_OP_AWAIT_ALL        142  0x8e */
 	NULL,
 };
 
@@ -681,6 +749,23 @@ static struct {
 	{ T_OP_AUGEAS_EXISTS_P, "augeas.exists? (%a|<string>)",                   OP_AUGEAS_EXISTS_P, { ARG_REGISTER|ARG_STRING,                ARG_NONE,                           } },
 	{ T_OP_SHA1,            "sha1 (%a|<string>) %b",                          OP_SHA1,            { ARG_REGISTER|ARG_STRING,                ARG_REGISTER,                       } },
 	{ T_OP_SYSTEM,          "system (%a|<string>)",                           OP_SYSTEM,          { ARG_REGISTER|ARG_STRING,                ARG_NONE,                           } },
+	{ T_OP_AUGEAS_LOAD,     "augeas.load (%a|<string>) (%b|<string>)",        OP_AUGEAS_LOAD,     { ARG_REGISTER|ARG_STRING,                ARG_REGISTER|ARG_STRING,            } },
+	{ T_OP_HOSTS_OPEN,      "hosts.open",                                     OP_HOSTS_OPEN,      { ARG_NONE,                               ARG_NONE,                           } },
+	{ T_OP_HOSTS_SAVE,      "hosts.save",                                     OP_HOSTS_SAVE,      { ARG_NONE,                               ARG_NONE,                           } },
+	{ T_OP_HOSTS_CLOSE,     "hosts.close",                                    OP_HOSTS_CLOSE,     { ARG_NONE,                               ARG_NONE,                           } },
+	{ T_OP_HOSTS_FIND,      "hosts.find (%a|<string>) (%b|<string>)",         OP_HOSTS_FIND,      { ARG_REGISTER|ARG_STRING,                ARG_REGISTER|ARG_STRING,            } },
+	{ T_OP_HOSTS_NEW,       "hosts.new (%a|<string>) (%b|<string>)",          OP_HOSTS_NEW,       { ARG_REGISTER|ARG_STRING,                ARG_REGISTER|ARG_STRING,            } },
+	{ T_OP_HOSTS_DELETE,    "hosts.delete",                                   OP_HOSTS_DELETE,    { ARG_NONE,                               ARG_NONE,                           } },
+	{ T_OP_HOSTS_ALIAS,     "hosts.alias (%a|<string>)",                      OP_HOSTS_ALIAS,     { ARG_REGISTER|ARG_STRING,                ARG_NONE,                           } },
+	{ T_OP_HOSTS_UNALIAS,   "hosts.unalias",                                  OP_HOSTS_UNALIAS,   { ARG_NONE,                               ARG_NONE,                           } },
+	{ T_OP_PKG_VERSION,     "pkg.version (%a|<string>) %b",                   OP_PKG_VERSION,     { ARG_REGISTER|ARG_STRING,                ARG_REGISTER,                       } },
+	{ T_OP_PKG_BEGIN,       "pkg.begin",                                      OP_PKG_BEGIN,       { ARG_NONE,                               ARG_NONE,                           } },
+	{ T_OP_PKG_INSTALL,     "pkg.install (%a|<string>) (%b|<string>)",        OP_PKG_INSTALL,     { ARG_REGISTER|ARG_STRING,                ARG_REGISTER|ARG_STRING,            } },
+	{ T_OP_PKG_REMOVE,      "pkg.remove (%a|<string>)",                       OP_PKG_REMOVE,      { ARG_REGISTER|ARG_STRING,                ARG_NONE,                           } },
+	{ T_OP_PKG_FLUSH,       "pkg.flush",                                      OP_PKG_FLUSH,       { ARG_NONE,                               ARG_NONE,                           } },
+	{ T_OP_ASYNC,           "async <function>",                               OP_ASYNC,           { ARG_FUNCTION,                           ARG_NONE,                           } },
+	{ T_OP_AWAIT,           "await <function>",                               OP_AWAIT,           { ARG_FUNCTION,                           ARG_NONE,                           } },
+	{ T_OP_AWAIT_ALL,       "await.all",                                      OP_AWAIT_ALL,       { ARG_NONE,                               ARG_NONE,                           } },
 	{ 0, 0, 0, { 0, 0 } },
 };
 
@@ -811,6 +896,23 @@ static void op_fs_mkparent     (vm_t*);
 static void op_augeas_exists_p (vm_t*);
 static void op_sha1            (vm_t*);
 static void op_system          (vm_t*);
+static void op_augeas_load     (vm_t*);
+static void op_hosts_open      (vm_t*);
+static void op_hosts_save      (vm_t*);
+static void op_hosts_close     (vm_t*);
+static void op_hosts_find      (vm_t*);
+static void op_hosts_new       (vm_t*);
+static void op_hosts_delete    (vm_t*);
+static void op_hosts_alias     (vm_t*);
+static void op_hosts_unalias   (vm_t*);
+static void op_pkg_version     (vm_t*);
+static void op_pkg_begin       (vm_t*);
+static void op_pkg_install     (vm_t*);
+static void op_pkg_remove      (vm_t*);
+static void op_pkg_flush       (vm_t*);
+static void op_async           (vm_t*);
+static void op_await           (vm_t*);
+static void op_await_all       (vm_t*);
 
 typedef void (*opcode_fn)(vm_t*);
 
@@ -943,6 +1045,23 @@ static struct {
 	{ OP_AUGEAS_EXISTS_P, op_augeas_exists_p, },
 	{ OP_SHA1,            op_sha1,            },
 	{ OP_SYSTEM,          op_system,          },
+	{ OP_AUGEAS_LOAD,     op_augeas_load,     },
+	{ OP_HOSTS_OPEN,      op_hosts_open,      },
+	{ OP_HOSTS_SAVE,      op_hosts_save,      },
+	{ OP_HOSTS_CLOSE,     op_hosts_close,     },
+	{ OP_HOSTS_FIND,      op_hosts_find,      },
+	{ OP_HOSTS_NEW,       op_hosts_new,       },
+	{ OP_HOSTS_DELETE,    op_hosts_delete,    },
+	{ OP_HOSTS_ALIAS,     op_hosts_alias,     },
+	{ OP_HOSTS_UNALIAS,   op_hosts_unalias,   },
+	{ OP_PKG_VERSION,     op_pkg_version,     },
+	{ OP_PKG_BEGIN,       op_pkg_begin,       },
+	{ OP_PKG_INSTALL,     op_pkg_install,     },
+	{ OP_PKG_REMOVE,      op_pkg_remove,      },
+	{ OP_PKG_FLUSH,       op_pkg_flush,       },
+	{ OP_ASYNC,           op_async,           },
+	{ OP_AWAIT,           op_await,           },
+	{ OP_AWAIT_ALL,       op_await_all,       },
 	{ 0, 0 },
 };
 #endif
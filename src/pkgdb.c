@@ -0,0 +1,167 @@
+/*
+  Copyright 2011-2015 James Hunt <james@jameshunt.us>
+
+  This file is part of Clockwork.
+
+  Clockwork is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Clockwork is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Clockwork.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "pkgdb.h"
+
+/* the package database is read once, and then only used to answer
+   "which version of X is installed?" -- anything it isn't sure about
+   (held / half-installed / broken packages) is left to cw-localsys,
+   so that the answers are exactly what `pkg-version` would give. */
+
+static void s_installed(pkgdb_t *db, const char *name, const char *version)
+{
+	/* multi-arch / multi-version: first installed one wins */
+	if (!hash_get(&db->versions, name))
+		hash_set(&db->versions, name, strdup(version));
+}
+
+static void s_unknown(pkgdb_t *db, const char *name)
+{
+	hash_set(&db->unknown, name, "?");
+}
+
+/* dpkg: one stanza per package, separated by blank lines; we only
+   care about the Package, Status and Version fields of each */
+static int s_read_dpkg(pkgdb_t *db, FILE *io)
+{
+	char *line = NULL, *name = NULL, *status = NULL, *version = NULL;
+	size_t n = 0;
+	ssize_t len;
+
+	for (;;) {
+		len = getline(&line, &n, io);
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+
+		if (len <= 0) {
+			/* end of stanza (or file) */
+			if (name && status) {
+				char want[32], flag[32], state[32];
+				if (sscanf(status, "%31s %31s %31s", want, flag, state) != 3)
+					s_unknown(db, name);
+				else if (strcmp(want, "install") == 0 && strcmp(state, "installed") == 0 && version)
+					s_installed(db, name, version);
+				else if (strcmp(state, "not-installed") != 0 && strcmp(state, "config-files") != 0)
+					s_unknown(db, name);
+			}
+			free(name);    name    = NULL;
+			free(status);  status  = NULL;
+			free(version); version = NULL;
+
+			if (len < 0)
+				break;
+			continue;
+		}
+
+		if (strncmp(line, "Package: ", 9) == 0) {
+			free(name); name = strdup(line + 9);
+		} else if (strncmp(line, "Status: ", 8) == 0) {
+			free(status); status = strdup(line + 8);
+		} else if (strncmp(line, "Version: ", 9) == 0) {
+			free(version); version = strdup(line + 9);
+		}
+	}
+
+	free(line);
+	return 0;
+}
+
+/* rpm: one `NAME VERSION` line per installed package */
+static int s_read_rpm(pkgdb_t *db, FILE *io)
+{
+	char line[1024], *version;
+	while (fgets(line, sizeof(line), io)) {
+		char *nl = strchr(line, '\n'); if (nl) *nl = '\0';
+		if ((version = strchr(line, ' ')) == NULL)
+			continue;
+		*version++ = '\0';
+		s_installed(db, line, version);
+	}
+	return 0;
+}
+
+pkgdb_t* pkgdb_read(const char *root)
+{
+	assert(root); // LCOV_EXCL_LINE
+
+	pkgdb_t *db = vmalloc(sizeof(pkgdb_t));
+	db->root = strdup(root);
+
+	char *file = string("%s/var/lib/dpkg/status", root);
+	FILE *io = fopen(file, "r");
+	free(file);
+	if (io) {
+		logger(LOG_DEBUG, "reading installed packages from dpkg status file");
+		s_read_dpkg(db, io);
+		fclose(io);
+		return db;
+	}
+
+	if (access("/bin/rpm", X_OK) == 0) {
+		logger(LOG_DEBUG, "taking a snapshot of installed packages from rpm");
+		runner_t runner = {
+			.in  = NULL,
+			.out = tmpfile(),
+			.err = tmpfile(),
+			.uid = geteuid(),
+			.gid = getegid(),
+		};
+		int rc = run2(&runner, "/bin/rpm", "--root", root,
+			"-qa", "--queryformat", "%{NAME} %{VERSION}\\n", NULL);
+		if (rc == 0) {
+			s_read_rpm(db, runner.out);
+		}
+		fclose(runner.out);
+		fclose(runner.err);
+		if (rc == 0)
+			return db;
+	}
+
+	pkgdb_close(db);
+	return NULL;
+}
+
+void pkgdb_close(pkgdb_t *db)
+{
+	if (!db) return;
+
+	hash_done(&db->versions, 1);
+	hash_done(&db->unknown, 0);
+	free(db->root);
+	free(db);
+}
+
+int pkgdb_version(pkgdb_t *db, const char *name, const char **version)
+{
+	assert(db);   // LCOV_EXCL_LINE
+	assert(name); // LCOV_EXCL_LINE
+
+	if ((*version = hash_get(&db->versions, name)) != NULL)
+		return PKGDB_INSTALLED;
+	if (hash_get(&db->unknown, name))
+		return PKGDB_UNKNOWN;
+	return PKGDB_MISSING;
+}
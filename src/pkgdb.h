@@ -0,0 +1,40 @@
+/*
+  Copyright 2011-2015 James Hunt <james@jameshunt.us>
+
+  This file is part of Clockwork.
+
+  Clockwork is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Clockwork is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Clockwork.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PKGDB_H
+#define PKGDB_H
+
+#include "clockwork.h"
+
+#define PKGDB_INSTALLED  0
+#define PKGDB_MISSING    1
+#define PKGDB_UNKNOWN    2  /* ask cw-localsys */
+
+typedef struct {
+	char   *root;
+	hash_t  versions; /* installed packages -> version */
+	hash_t  unknown;  /* packages in some other state  */
+} pkgdb_t;
+
+pkgdb_t* pkgdb_read(const char *root);
+void pkgdb_close(pkgdb_t *db);
+
+int pkgdb_version(pkgdb_t *db, const char *name, const char **version);
+
+#endif
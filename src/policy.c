@@ -19,15 +19,61 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <glob.h>
 #include <libgen.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
+#include <sys/utsname.h>
+#include <sys/sysinfo.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <uuid/uuid.h>
 
 #include "policy.h"
 #include "resource.h"
+#include "resources.h"
+
+/* resource attributes that policy_find_resource can look up directly */
+static const struct {
+	enum restype type;
+	const char  *attr;
+} ATTR_INDEXES[] = {
+	{ RES_USER,  "username" },
+	{ RES_USER,  "uid"      },
+	{ RES_GROUP, "name"     },
+	{ RES_GROUP, "gid"      },
+	{ RES_FILE,  "path"     },
+	{ RES_DIR,   "path"     },
+};
+#define NUM_ATTR_INDEXES (sizeof(ATTR_INDEXES) / sizeof(ATTR_INDEXES[0]))
+
+/* upper bound on policies kept by manifest_generate, per manifest */
+#define MAX_MEMOS 4096
+
+/* policies generated from one syntax tree root, by manifest_generate */
+struct memo_root {
+	int           cacheable;
+	unsigned int  nslots;
+	unsigned int *slots;     /* fact slots read by conditionals under root */
+	hash_t       *policies;  /* struct memo, keyed by those facts' values */
+};
+
+struct memo {
+	struct policy *policy;
+	unsigned int   nset;
+	unsigned int  *set;      /* fact slots set by includes under root */
+};
 
 struct scope {
 	int depth;
@@ -40,6 +86,9 @@ struct policy_generator {
 	hash_t        *facts;
 	enum restype   type;
 
+	const char **slots;      /* fact values, by slot (if compiled) */
+	char       **slot_names; /* fact names, by slot */
+
 	list_t scopes;
 	struct scope *scope;
 
@@ -80,43 +129,42 @@ static struct scope* pop_scope(list_t *list)
 	return list_object(list->next, struct scope, l);
 }
 
+/* nodes (and their strings) live in the manifest arena;
+   this only releases what was allocated outside of it */
 static void stree_free(struct stree *n)
 {
 	if (n) {
-		free(n->data1);
-		free(n->data2);
+#ifdef PCRE_STUDY_JIT_COMPILE
+		pcre_free_study(n->regex_extra);
+#else
+		pcre_free(n->regex_extra);
+#endif
+		pcre_free(n->regex);
 		free(n->nodes);
 	}
-	free(n);
 }
 
-static const void* s_eval_lookup(struct stree *node, hash_t *facts)
+static const void* s_eval_lookup(struct stree *node, struct policy_generator *pgen)
 {
-	assert(node);  // LCOV_EXCL_LINE
-	assert(facts); // LCOV_EXCL_LINE
+	assert(node);        // LCOV_EXCL_LINE
+	assert(pgen);        // LCOV_EXCL_LINE
+	assert(pgen->facts); // LCOV_EXCL_LINE
 
 	const char *x;
-	pcre *re;
-	const char *e_string;
-	int e_offset;
-	int opts;
 
 	switch (node->op) {
 	case EXPR_VAL:
 		return node->data1;
 
 	case EXPR_REGEX:
-		opts = 0;
-		if (strchr(node->data2, 'i')) opts |= PCRE_CASELESS;
-
-		re = pcre_compile(node->data1, opts, &e_string, &e_offset, NULL);
-		if (re) return re;
-
-		logger(LOG_WARNING, "regular expression syntax error: %s", e_string);
-		return NULL;
+		/* normally compiled at manifest load, by manifest_compile */
+		if (!node->regex && stree_compile(node) != 0)
+			return NULL;
+		return node;
 
 	case EXPR_FACT:
-		x = hash_get(facts, node->data1);
+		x = (pgen->slots && node->slot) ? pgen->slots[node->slot - 1]
+		                                : hash_get(pgen->facts, node->data1);
 		if (x) return x;
 		break;
 
@@ -127,45 +175,45 @@ static const void* s_eval_lookup(struct stree *node, hash_t *facts)
 	return "";
 }
 
-static int s_eval(struct stree *node, hash_t *facts)
+static int s_eval(struct stree *node, struct policy_generator *pgen)
 {
-	assert(node);  // LCOV_EXCL_LINE
-	assert(facts); // LCOV_EXCL_LINE
+	assert(node);        // LCOV_EXCL_LINE
+	assert(pgen);        // LCOV_EXCL_LINE
+	assert(pgen->facts); // LCOV_EXCL_LINE
 
 	const char *s1, *s2;
-	pcre *regex;
+	struct stree *re;
 
 	switch (node->op) {
 	case EXPR_NOOP:
-		return s_eval(node->nodes[0], facts);
+		return s_eval(node->nodes[0], pgen);
 
 	case EXPR_AND:
-		return s_eval(node->nodes[0], facts)
-		    && s_eval(node->nodes[1], facts);
+		return s_eval(node->nodes[0], pgen)
+		    && s_eval(node->nodes[1], pgen);
 
 	case EXPR_OR:
-		return s_eval(node->nodes[0], facts)
-		    || s_eval(node->nodes[1], facts);
+		return s_eval(node->nodes[0], pgen)
+		    || s_eval(node->nodes[1], pgen);
 
 	case EXPR_NOT:
-		return !s_eval(node->nodes[0], facts);
+		return !s_eval(node->nodes[0], pgen);
 
 	case EXPR_EQ:
 		if (!node->nodes[0] || !node->nodes[1]) {
 			logger(LOG_WARNING, "too few nodes for an EQ operation");
 			break;
 		}
-		s1 = (const char *)s_eval_lookup(node->nodes[0], facts);
-		s2 = (const char *)s_eval_lookup(node->nodes[1], facts);
+		s1 = (const char *)s_eval_lookup(node->nodes[0], pgen);
+		s2 = (const char *)s_eval_lookup(node->nodes[1], pgen);
 		return strcmp(s1, s2) == 0;
 
 	case EXPR_MATCH:
-		s1 = (const char *)s_eval_lookup(node->nodes[0], facts);
-		regex = (pcre*)s_eval_lookup(node->nodes[1], facts);
-		if (!regex) break;
+		s1 = (const char *)s_eval_lookup(node->nodes[0], pgen);
+		re = (struct stree*)s_eval_lookup(node->nodes[1], pgen);
+		if (!re || re->op != EXPR_REGEX) break;
 
-		int rc = pcre_exec(regex, NULL, s1, strlen(s1), 0, 0, NULL, 0);
-		pcre_free(regex);
+		int rc = pcre_exec(re->regex, re->regex_extra, s1, strlen(s1), 0, 0, NULL, 0);
 		return rc >= 0;
 
 	case EXPR_VAL:
@@ -184,12 +232,142 @@ static int s_eval(struct stree *node, hash_t *facts)
 	return 0;
 }
 
+/* length-prefixed, so that no two (a, b) pairs share a key */
+static char* s_dependency_key(const struct dependency *dep)
+{
+	return string("%lu:%s%s", (unsigned long)strlen(dep->a), dep->a, dep->b);
+}
+
+static int s_cmp_index(const void *a, const void *b)
+{
+	size_t x = *(const size_t*)a, y = *(const size_t*)b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static size_t s_index_of(hash_t *idx, const struct resource *r)
+{
+	return (uintptr_t)hash_get(idx, r->key) - 1;
+}
+
+/* index of the first still-unsorted resource that res[i] depends on */
+static size_t s_unsorted_dep(struct resource **res, size_t *indeg, hash_t *idx, size_t i)
+{
+	size_t j;
+	int d;
+
+	for (d = 0; d < res[i]->ndeps; d++) {
+		j = s_index_of(idx, res[i]->deps[d]);
+		if (indeg[j] != 0) return j;
+	}
+	return i; /* LCOV_EXCL_LINE */
+}
+
+static void s_report_cycle(struct resource **res, size_t *indeg, hash_t *idx, size_t n)
+{
+	size_t i, j;
+	char *seen;
+
+	/* every unsorted resource depends on at least one other unsorted
+	   resource, so following those edges has to loop back eventually */
+	for (i = 0; i < n && indeg[i] == 0; i++)
+		;
+	if (i == n) return;
+
+	seen = vcalloc(n, sizeof(char));
+	while (!seen[i]) {
+		seen[i] = 1;
+		i = s_unsorted_dep(res, indeg, idx, i);
+	}
+	free(seen);
+
+	strings_t *cycle = strings_new(NULL);
+	j = i;
+	do {
+		strings_add(cycle, res[j]->key);
+		j = s_unsorted_dep(res, indeg, idx, j);
+	} while (j != i);
+	strings_add(cycle, res[i]->key);
+
+	char *path = strings_join(cycle, " -> ");
+	logger(LOG_ERR, "Circular dependency detected: %s", path);
+	free(path);
+	strings_free(cycle);
+}
+
+/*
+  Re-order the resources of $pol so that each one comes after
+  all of the resources it depends on (Kahn's algorithm).
+
+  Resources that become ready at the same time keep their
+  relative order from the policy definition, so that the
+  ordering is stable across runs.  Resources caught up in a
+  dependency cycle are left at the end, in definition order.
+ */
+static void _policy_toposort(struct policy *pol)
+{
+	struct resource *r, **res;
+	size_t i, j, n = 0, head, tail, mark;
+	size_t *indeg, *queue;
+	int d;
+	hash_t idx;
+
+	memset(&idx, 0, sizeof(idx));
+	for_each_resource(r, pol)
+		n++;
+	if (n == 0) return;
+
+	res   = vcalloc(n, sizeof(struct resource*));
+	indeg = vcalloc(n, sizeof(size_t));
+	queue = vcalloc(n, sizeof(size_t));
+
+	/* in-degree is the number of unmet dependencies */
+	i = 0;
+	for_each_resource(r, pol) {
+		res[i] = r;
+		indeg[i] = r->ndeps;
+		hash_set(&idx, r->key, (void*)(uintptr_t)(++i));
+	}
+
+	head = tail = 0;
+	for (i = 0; i < n; i++)
+		if (indeg[i] == 0)
+			queue[tail++] = i;
+
+	while (head < tail) {
+		i = queue[head++];
+		mark = tail;
+		for (d = 0; d < res[i]->ndependents; d++) {
+			j = s_index_of(&idx, res[i]->dependents[d]);
+			if (--indeg[j] == 0)
+				queue[tail++] = j;
+		}
+
+		if (tail - mark > 1)
+			qsort(queue + mark, tail - mark, sizeof(size_t), s_cmp_index);
+	}
+
+	list_init(&pol->resources);
+	for (i = 0; i < tail; i++)
+		list_push(&pol->resources, &res[queue[i]]->l);
+
+	if (tail < n) {
+		s_report_cycle(res, indeg, &idx, n);
+		for (i = 0; i < n; i++)
+			if (indeg[i] != 0)
+				list_push(&pol->resources, &res[i]->l);
+	}
+
+	hash_done(&idx, 0);
+	free(res);
+	free(indeg);
+	free(queue);
+}
+
 static int _policy_normalize(struct policy *pol, hash_t *facts)
 {
 	assert(pol); // LCOV_EXCL_LINE
 
-	LIST(deps);
-	struct resource *r1, *r2, *tmp;
+	struct resource *r1, *r2;
 	struct dependency *dep, *d_tmp;
 
 	for_each_resource(r1, pol) {
@@ -206,14 +384,14 @@ static int _policy_normalize(struct policy *pol, hash_t *facts)
 		dep->resource_a = r1 = hash_get(pol->index, dep->a);
 		dep->resource_b = r2 = hash_get(pol->index, dep->b);
 
-		if (!r1) {
-			logger(LOG_ERR, "Failed dependency for unknown resource %s", dep->a);
-			list_delete(&dep->l);
-			dependency_free(dep);
-			continue;
-		}
-		if (!r2) {
-			logger(LOG_ERR, "Failed dependency on unknown resource %s", dep->b);
+		if (!r1 || !r2) {
+			if (!r1) logger(LOG_ERR, "Failed dependency for unknown resource %s", dep->a);
+			else     logger(LOG_ERR, "Failed dependency on unknown resource %s", dep->b);
+
+			char *key = s_dependency_key(dep);
+			hash_set(pol->deps, key, NULL);
+			free(key);
+
 			list_delete(&dep->l);
 			dependency_free(dep);
 			continue;
@@ -222,45 +400,75 @@ static int _policy_normalize(struct policy *pol, hash_t *facts)
 		resource_add_dependency(r1, r2);
 	}
 
-	/* get the one with no deps */
-	for_each_resource_safe(r1, tmp, pol) {
-		if (r1->ndeps == 0) {
-			logger(LOG_DEBUG, "%s has no deps // appending", r1->key);
-			list_delete(&r1->l);
-			list_push(&deps, &r1->l);
-		}
-	}
+	/* order resources so that dependencies come first */
+	_policy_toposort(pol);
 
-	for_each_object(r1, &deps, l) {
-		for_each_resource_safe(r2, tmp, pol) {
-			if (resource_depends_on(r2, r1) == 0) {
-				resource_drop_dependency(r2, r1);
-				if (r2->ndeps == 0) {
-					logger(LOG_DEBUG, "%s has no _outstanding_ deps // appending", r2->key);
-					list_delete(&r2->l);
-					list_push(&deps, &r2->l);
-				}
-			}
-		}
+	return 0;
+}
+
+#define ARENA_CHUNK 65536
+#define ARENA_ALIGN sizeof(void*)
+
+struct arena {
+	struct arena *next;
+	size_t size, used;
+	char data[];
+};
+
+/* zeroed, pointer-aligned storage from arena $a */
+static void* s_arena_alloc(struct arena **a, size_t n)
+{
+	struct arena *chunk;
+
+	n = (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (!*a || (*a)->size - (*a)->used < n) {
+		size_t size = n > ARENA_CHUNK ? n : ARENA_CHUNK;
+		chunk = vmalloc(sizeof(struct arena) + size);
+		chunk->size = size;
+		chunk->next = *a;
+		*a = chunk;
 	}
 
-	if (!list_isempty(&pol->resources)) {
-		logger(LOG_ERR, "Circular dependency detected!");
-		return 0;
+	void *p = (*a)->data + (*a)->used;
+	(*a)->used += n;
+	return p;
+}
+
+static void s_arena_free(struct arena *a)
+{
+	struct arena *next;
+	for (; a; a = next) {
+		next = a->next;
+		free(a);
 	}
-	list_replace(&deps, &pol->resources);
+}
 
-	return 0;
+static int s_interned(struct manifest *m, const char *s)
+{
+	return s && hash_get(m->strings, s) == s;
 }
 
-/**
-  Create a new manifest.
+/* swap heap string $s (which we own) for the interned copy */
+static char* s_intern(struct manifest *m, char *s)
+{
+	char *p;
 
-  **Note:** The pointer returned must be freed via @manifest_free.
+	if (!s || s_interned(m, s))
+		return s;
 
-  On success, returns a new manifest structure.  On failure, returns NULL.
- */
-struct manifest* manifest_new(void)
+	p = hash_get(m->strings, s);
+	if (!p) {
+		size_t n = strlen(s) + 1;
+		p = s_arena_alloc(&m->arena, n);
+		memcpy(p, s, n);
+		hash_set(m->strings, p, p);
+	}
+	free(s);
+	return p;
+}
+
+/* an empty manifest, without even a root node */
+static struct manifest* s_manifest_alloc(void)
 {
 	struct manifest *m;
 
@@ -271,27 +479,112 @@ struct manifest* manifest_new(void)
 	m->nodes = NULL;
 	m->nodes_len = 0;
 
+	m->arena   = NULL;
+	m->strings = vmalloc(sizeof(hash_t));
+	m->shared  = vmalloc(sizeof(hash_t));
+
+	m->slots = vmalloc(sizeof(hash_t));
+	m->slot_names = NULL;
+	m->nslots = 0;
+
+	m->memos = vmalloc(sizeof(hash_t));
+	m->nmemos = 0;
+
+	m->sources = NULL;
+	m->image = NULL;
+	m->image_len = 0;
+
+	m->refs = 1;
+	return m;
+}
+
+/**
+  Create a new manifest.
+
+  **Note:** The pointer returned must be freed via @manifest_free.
+
+  On success, returns a new manifest structure.  On failure, returns NULL.
+ */
+struct manifest* manifest_new(void)
+{
+	struct manifest *m = s_manifest_alloc();
 	m->root = manifest_new_stree(m, PROG, NULL, NULL);
+	return m;
+}
 
+/**
+  Take another reference to manifest $m.
+
+  Manifests start out with a single reference, held by whoever
+  created them.  Each call to this function must be balanced by a
+  call to @manifest_free, and $m is only really freed once the last
+  reference is dropped.  This lets clockd hand out a new manifest
+  on reload while clients that are still using the old one finish
+  up against it.
+
+  Returns $m.
+ */
+struct manifest* manifest_retain(struct manifest *m)
+{
+	if (m) m->refs++;
 	return m;
 }
 
 /**
-  Free manifest $m.
+  Drop a reference to manifest $m, and free it if that was the last.
  */
 void manifest_free(struct manifest *m)
 {
 	size_t i;
 
+	if (m && --m->refs > 0)
+		return;
+
 	if (m) {
-		for (i = 0; i < m->nodes_len; i++) { stree_free(m->nodes[i]); }
+		for (i = 0; i < m->nodes_len; i++) {
+			/* strings that were never interned are still ours */
+			if (!s_interned(m, m->nodes[i]->data1)) free(m->nodes[i]->data1);
+			if (!s_interned(m, m->nodes[i]->data2)) free(m->nodes[i]->data2);
+			stree_free(m->nodes[i]);
+		}
 		free(m->nodes);
 
+		char *k1, *k2;
+		struct memo_root *mr;
+		struct memo *memo;
+		for_each_key_value(m->memos, k1, mr) {
+			for_each_key_value(mr->policies, k2, memo) {
+				policy_free_all(memo->policy);
+				free(memo->set);
+				free(memo);
+			}
+			hash_done(mr->policies, 0);
+			free(mr->policies);
+			free(mr->slots);
+			free(mr);
+		}
+		hash_done(m->memos, 0);
+		free(m->memos);
+
 		hash_done(m->policies, 0);
 		hash_done(m->hosts,    0);
+		hash_done(m->slots,    0);
+		hash_done(m->strings,  0);
+		hash_done(m->shared,   0);
 
 		free(m->policies);
 		free(m->hosts);
+		free(m->slots);
+		free(m->strings);
+		free(m->shared);
+
+		s_arena_free(m->arena);
+		if (m->sources) strings_free(m->sources);
+		if (m->image)   munmap(m->image, m->image_len);
+
+		unsigned int j;
+		for (j = 0; j < m->nslots; j++) { free(m->slot_names[j]); }
+		free(m->slot_names);
 	}
 	free(m);
 }
@@ -365,6 +658,180 @@ int manifest_validate(struct manifest *m)
 	return 0;
 }
 
+/**
+  Compile the regular expression for an EXPR_REGEX $node.
+
+  The pattern (data1) is compiled with the options (data2) given
+  in the manifest, and studied (JIT-compiled, if the local PCRE
+  supports it).  The results are attached to $node, and reused
+  for every evaluation, until the node is freed.
+
+  Compiling an already-compiled node, or a node that is not an
+  EXPR_REGEX, is a no-op.
+
+  On success, returns 0.  On failure, logs the syntax error and
+  returns non-zero.
+ */
+int stree_compile(struct stree *node)
+{
+	assert(node); // LCOV_EXCL_LINE
+
+	const char *e_string;
+	int e_offset, opts = 0;
+
+	if (node->op != EXPR_REGEX || node->regex)
+		return 0;
+
+	if (node->data2 && strchr(node->data2, 'i')) opts |= PCRE_CASELESS;
+
+	node->regex = pcre_compile(node->data1, opts, &e_string, &e_offset, NULL);
+	if (!node->regex) {
+		logger(LOG_ERR, "regular expression syntax error in /%s/ at offset %i: %s",
+			node->data1, e_offset, e_string);
+		return 1;
+	}
+
+#ifdef PCRE_STUDY_JIT_COMPILE
+	node->regex_extra = pcre_study(node->regex, PCRE_STUDY_JIT_COMPILE, &e_string);
+#else
+	node->regex_extra = pcre_study(node->regex, 0, &e_string);
+#endif
+	/* study failures are not fatal; we just don't get the speedup */
+	return 0;
+}
+
+static char *policy_fact_name(const char *policy)
+{
+	strings_t *parts = strings_split(policy, strlen(policy), "::", SPLIT_NORMAL);
+	if (!parts)
+		return NULL;
+
+	char *dotted = strings_join(parts, ".");
+	strings_free(parts);
+	if (!dotted)
+		return NULL;
+
+	char *key = string("sys.policy.%s", dotted);
+	free(dotted);
+	return key;
+}
+
+static unsigned int s_slot(struct manifest *m, const char *name)
+{
+	unsigned int slot = (uintptr_t)hash_get(m->slots, name);
+	if (slot) return slot;
+
+	m->slot_names = realloc(m->slot_names, (m->nslots + 1) * sizeof(char*));
+	m->slot_names[m->nslots] = cw_strdup(name);
+	slot = ++m->nslots;
+
+	hash_set(m->slots, name, (void*)(uintptr_t)slot);
+	return slot;
+}
+
+static void s_memo_slots(struct stree *node, char *seen, struct memo_root *mr)
+{
+	unsigned int i;
+
+	if (!node) return;
+	if (node->op == EXPR_FACT) {
+		if (!node->slot) {
+			mr->cacheable = 0;
+		} else if (!seen[node->slot]) {
+			seen[node->slot] = 1;
+			mr->slots = realloc(mr->slots, (mr->nslots + 1) * sizeof(unsigned int));
+			mr->slots[mr->nslots++] = node->slot;
+		}
+	}
+
+	for (i = 0; i < node->size; i++)
+		s_memo_slots(node->nodes[i], seen, mr);
+}
+
+/* find (or work out) which facts the policy under $root depends on */
+static struct memo_root* s_memo_root(struct manifest *m, struct stree *root)
+{
+	struct memo_root *mr;
+	char key[32], *seen;
+
+	snprintf(key, sizeof(key), "%p", (void*)root);
+	if ((mr = hash_get(m->memos, key)) != NULL)
+		return mr;
+
+	mr = vmalloc(sizeof(struct memo_root));
+	mr->cacheable = 1;
+	mr->policies  = vmalloc(sizeof(hash_t));
+
+	seen = vcalloc(m->nslots + 1, sizeof(char));
+	s_memo_slots(root, seen, mr);
+	free(seen);
+
+	hash_set(m->memos, key, mr);
+	return mr;
+}
+
+/**
+  Compile manifest $m, for faster policy generation.
+
+  All regular expressions are compiled, so that syntax errors are
+  caught up front, and policy generation doesn't need to compile
+  the same patterns for every host.
+
+  Every distinct fact name referenced by a conditional (or set by
+  an `include`) is also assigned a numeric slot, so that
+  @manifest_generate can look facts up by index, instead of
+  hashing the same names over and over for each host.
+
+  Finally, each host definition (and the fallback) is checked to
+  see which facts, if any, its conditionals depend on.  Hosts whose
+  policies are fact-independent only ever have to be generated
+  once; see @manifest_generate.
+
+  On success, returns 0.  On failure, returns non-zero.
+ */
+int manifest_compile(struct manifest *m)
+{
+	assert(m); // LCOV_EXCL_LINE
+
+	size_t i;
+	int rc = 0;
+	char *fact;
+
+	for (i = 0; i < m->nodes_len; i++) {
+		if (stree_compile(m->nodes[i]) != 0)
+			rc = 1;
+
+		switch (m->nodes[i]->op) {
+		case EXPR_FACT:
+			m->nodes[i]->slot = s_slot(m, m->nodes[i]->data1);
+			break;
+
+		case INCLUDE:
+			fact = policy_fact_name(m->nodes[i]->data1);
+			if (fact) {
+				m->nodes[i]->slot = s_slot(m, fact);
+				free(fact);
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	char *_;
+	struct stree *host;
+	unsigned int invariant = 0;
+	for_each_key_value(m->hosts, _, host)
+		if (s_memo_root(m, host)->cacheable && s_memo_root(m, host)->nslots == 0)
+			invariant++;
+	if (m->fallback)
+		s_memo_root(m, m->fallback);
+	logger(LOG_DEBUG, "%u host definition(s) are fact-independent", invariant);
+
+	return rc;
+}
+
 /**
   Create a new syntax tree node for $m.
 
@@ -388,41 +855,480 @@ int manifest_validate(struct manifest *m)
 
   On failure, returns NULL.
  */
-struct stree* manifest_new_stree(struct manifest *m, enum oper op, char *data1, char *data2)
+static struct stree* s_new_stree(struct manifest *m, enum oper op, char *data1, char *data2)
 {
 	struct stree *stree;
 	struct stree **list;
 
-	stree = vmalloc(sizeof(struct stree));
-	if (!stree) {
-		return NULL;
-	}
-	list = realloc(m->nodes, sizeof(struct stree*) * (m->nodes_len + 1));
-	if (!list) {
-		free(stree);
-		free(m->nodes);
-		m->nodes = NULL;
-		return NULL;
+	/* grow the node list by doubling */
+	if ((m->nodes_len & (m->nodes_len - 1)) == 0) {
+		list = realloc(m->nodes, sizeof(struct stree*) * (m->nodes_len ? m->nodes_len * 2 : 1));
+		if (!list) {
+			free(m->nodes);
+			m->nodes = NULL;
+			return NULL;
+		}
+		m->nodes = list;
 	}
 
+	stree = s_arena_alloc(&m->arena, sizeof(struct stree));
 	stree->op = op;
 	stree->data1 = data1;
 	stree->data2 = data2;
 
-	list[m->nodes_len++] = stree;
-	m->nodes = list;
+	m->nodes[m->nodes_len++] = stree;
+	return stree;
+}
+
+/* ATTR and EXPR_* leaves are never modified once created,
+   so structurally identical ones can be shared (hash-consed) */
+static int s_shareable(enum oper op)
+{
+	return op == ATTR || op == EXPR_VAL || op == EXPR_FACT || op == EXPR_REGEX;
+}
+
+struct stree* manifest_new_stree(struct manifest *m, enum oper op, char *data1, char *data2)
+{
+	struct stree *stree;
+	char *key = NULL;
+
+	data1 = s_intern(m, data1);
+	data2 = s_intern(m, data2);
+
+	if (s_shareable(op)) {
+		key = string("%u:%p:%p", op, data1, data2);
+		if ((stree = hash_get(m->shared, key)) != NULL) {
+			free(key);
+			return stree;
+		}
+	}
 
+	stree = s_new_stree(m, op, data1, data2);
+	if (key) {
+		if (stree) hash_set(m->shared, key, stree);
+		free(key);
+	}
 	return stree;
 }
 
 struct stree* manifest_new_stree_expr(struct manifest *m, enum oper op, struct stree *a, struct stree *b)
 {
-	struct stree *n = manifest_new_stree(m, op, NULL, NULL);
-	if (a) stree_add(n, a);
-	if (b) stree_add(n, b);
+	struct stree *n;
+	char *key;
+
+	key = string("%u:%p:%p", op, a, b);
+	if ((n = hash_get(m->shared, key)) != NULL) {
+		free(key);
+		return n;
+	}
+
+	n = s_new_stree(m, op, NULL, NULL);
+	if (n) {
+		if (a) stree_add(n, a);
+		if (b) stree_add(n, b);
+		hash_set(m->shared, key, n);
+	}
+	free(key);
 	return n;
 }
 
+/**
+  Intern the strings of every node in $m.
+
+  @manifest_new_stree interns the strings it is given, but the
+  parser fills in some node data (policy and host names, resource
+  types and identifiers) after the fact.  This moves those strings
+  into the manifest arena too, so that each distinct string is
+  stored once, and @manifest_free can release them all at once.
+
+  On success, returns 0.  On failure, returns non-zero.
+ */
+int manifest_intern(struct manifest *m)
+{
+	assert(m); // LCOV_EXCL_LINE
+
+	size_t i;
+	for (i = 0; i < m->nodes_len; i++) {
+		m->nodes[i]->data1 = s_intern(m, m->nodes[i]->data1);
+		m->nodes[i]->data2 = s_intern(m, m->nodes[i]->data2);
+	}
+	return 0;
+}
+
+/**
+  Return the number of bytes allocated to $m's arena, which
+  holds all of its syntax tree nodes and interned strings.
+ */
+size_t manifest_arena_size(const struct manifest *m)
+{
+	assert(m); // LCOV_EXCL_LINE
+
+	size_t n = 0;
+	struct arena *a;
+	for (a = m->arena; a; a = a->next)
+		n += a->used;
+	return n;
+}
+
+/*
+  Precompiled manifest images.
+
+  An image is a flat, position-independent copy of a parsed manifest:
+  a fixed header, then the source list, policy and host tables, the
+  syntax tree nodes, a table of child node indices and, finally, a
+  string table holding every (NUL-terminated) string exactly once.
+
+  Strings are referenced by their offset into the string table, plus
+  one (0 is NULL); nodes by their index, plus one where they may be
+  absent.  All integers are 32-bit, in host byte order; the endian
+  marker makes sure that an image is only ever read by the kind of
+  host that wrote it.
+ */
+#define IMAGE_MAGIC   "CWMANIF1"
+#define IMAGE_ENDIAN  0x01020304
+#define IMAGE_VERSION 1
+
+struct image_header {
+	char     magic[8];
+	uint32_t endian;
+	uint32_t version;
+
+	uint32_t nsources;  /* source strings */
+	uint32_t npolicies; /* (name, node) pairs */
+	uint32_t nhosts;    /* (name, node) pairs */
+	uint32_t nnodes;    /* image_node structures */
+	uint32_t nkids;     /* child node indices */
+	uint32_t nstrings;  /* bytes of string table */
+
+	uint32_t root;      /* node index + 1, or 0 */
+	uint32_t fallback;  /* node index + 1, or 0 */
+};
+
+struct image_node {
+	uint32_t op;
+	uint32_t data1;     /* string offset + 1, or 0 */
+	uint32_t data2;     /* string offset + 1, or 0 */
+	uint32_t size;      /* number of children */
+	uint32_t kids;      /* index of first child, in the kids table */
+};
+
+struct image_strtab {
+	char   *data;
+	size_t  len;
+	hash_t *offsets;    /* offset + 1, keyed by string */
+};
+
+static uint32_t s_image_string(struct image_strtab *st, const char *s)
+{
+	uintptr_t off;
+	size_t n;
+
+	if (!s) return 0;
+	if ((off = (uintptr_t)hash_get(st->offsets, s)) != 0)
+		return off;
+
+	n = strlen(s) + 1;
+	st->data = realloc(st->data, st->len + n);
+	memcpy(st->data + st->len, s, n);
+	off = st->len + 1;
+	st->len += n;
+
+	hash_set(st->offsets, s, (void*)off);
+	return off;
+}
+
+static uint32_t s_image_node(hash_t *index, const struct stree *node)
+{
+	char key[32];
+
+	if (!node) return 0;
+	snprintf(key, sizeof(key), "%p", (void*)node);
+	return (uintptr_t)hash_get(index, key);
+}
+
+static uint32_t* s_image_names(hash_t *h, uint32_t *n, struct image_strtab *st, hash_t *index)
+{
+	char *name;
+	struct stree *node;
+	uint32_t *pairs = NULL;
+
+	*n = 0;
+	for_each_key_value(h, name, node) {
+		pairs = realloc(pairs, (*n + 1) * 2 * sizeof(uint32_t));
+		pairs[*n * 2]     = s_image_string(st, name);
+		pairs[*n * 2 + 1] = s_image_node(index, node) - 1;
+		(*n)++;
+	}
+	return pairs;
+}
+
+/**
+  Write a precompiled image of manifest $m to $path.
+
+  The image can be loaded back with @manifest_read, which is much
+  faster than parsing (and expanding, and compiling) the original
+  policy files again.  The list of sources (and their checksums)
+  that $m was parsed from goes along with it, so that callers can
+  tell whether or not an image is still current.
+
+  The image is written to a temporary file alongside $path, and
+  then renamed into place, so that readers never see a partial
+  image.
+
+  On success, returns 0.  On failure, returns non-zero.
+ */
+int manifest_write(struct manifest *m, const char *path)
+{
+	assert(m);    // LCOV_EXCL_LINE
+	assert(path); // LCOV_EXCL_LINE
+
+	struct image_header hdr;
+	struct image_node *nodes;
+	struct image_strtab st;
+	uint32_t *sources, *policies, *hosts, *kids;
+	hash_t *index;
+	char key[32], *tmp;
+	size_t i, j, nkids;
+	FILE *io;
+	int rc = 1;
+
+	index = vmalloc(sizeof(hash_t));
+	st.data = NULL;
+	st.len = 0;
+	st.offsets = vmalloc(sizeof(hash_t));
+
+	for (i = 0, nkids = 0; i < m->nodes_len; i++) {
+		snprintf(key, sizeof(key), "%p", (void*)m->nodes[i]);
+		hash_set(index, key, (void*)(uintptr_t)(i + 1));
+		nkids += m->nodes[i]->size;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic));
+	hdr.endian   = IMAGE_ENDIAN;
+	hdr.version  = IMAGE_VERSION;
+	hdr.nnodes   = m->nodes_len;
+	hdr.nkids    = nkids;
+	hdr.root     = s_image_node(index, m->root);
+	hdr.fallback = s_image_node(index, m->fallback);
+
+	hdr.nsources = m->sources ? m->sources->num : 0;
+	sources = vcalloc(hdr.nsources + 1, sizeof(uint32_t));
+	for (i = 0; i < hdr.nsources; i++)
+		sources[i] = s_image_string(&st, m->sources->strings[i]);
+
+	policies = s_image_names(m->policies, &hdr.npolicies, &st, index);
+	hosts    = s_image_names(m->hosts,    &hdr.nhosts,    &st, index);
+
+	nodes = vcalloc(m->nodes_len + 1, sizeof(struct image_node));
+	kids  = vcalloc(nkids + 1, sizeof(uint32_t));
+	for (i = 0, nkids = 0; i < m->nodes_len; i++) {
+		nodes[i].op    = m->nodes[i]->op;
+		nodes[i].data1 = s_image_string(&st, m->nodes[i]->data1);
+		nodes[i].data2 = s_image_string(&st, m->nodes[i]->data2);
+		nodes[i].size  = m->nodes[i]->size;
+		nodes[i].kids  = nkids;
+
+		for (j = 0; j < m->nodes[i]->size; j++) {
+			uint32_t k = s_image_node(index, m->nodes[i]->nodes[j]);
+			if (!k) {
+				logger(LOG_ERR, "syntax tree node %p is not part of the manifest",
+					(void*)m->nodes[i]->nodes[j]);
+				goto done;
+			}
+			kids[nkids++] = k - 1;
+		}
+	}
+	hdr.nstrings = st.len;
+
+	tmp = string("%s.%u.tmp", path, getpid());
+	io = fopen(tmp, "w");
+	if (!io) {
+		logger(LOG_ERR, "Failed to open %s for writing: %s", tmp, strerror(errno));
+		free(tmp);
+		goto done;
+	}
+
+	if (fwrite(&hdr,     sizeof(hdr),                    1,            io) != 1
+	 || fwrite(sources,  sizeof(uint32_t),               hdr.nsources, io) != hdr.nsources
+	 || fwrite(policies, 2 * sizeof(uint32_t),           hdr.npolicies,io) != hdr.npolicies
+	 || fwrite(hosts,    2 * sizeof(uint32_t),           hdr.nhosts,   io) != hdr.nhosts
+	 || fwrite(nodes,    sizeof(struct image_node),      hdr.nnodes,   io) != hdr.nnodes
+	 || fwrite(kids,     sizeof(uint32_t),               hdr.nkids,    io) != hdr.nkids
+	 || fwrite(st.data,  1,                              hdr.nstrings, io) != hdr.nstrings) {
+		logger(LOG_ERR, "Failed to write manifest image to %s: %s", tmp, strerror(errno));
+		fclose(io);
+		unlink(tmp);
+		free(tmp);
+		goto done;
+	}
+
+	if (fclose(io) != 0 || rename(tmp, path) != 0) {
+		logger(LOG_ERR, "Failed to write manifest image to %s: %s", path, strerror(errno));
+		unlink(tmp);
+		free(tmp);
+		goto done;
+	}
+	free(tmp);
+	rc = 0;
+
+done:
+	hash_done(index, 0);
+	hash_done(st.offsets, 0);
+	free(index);
+	free(st.offsets);
+	free(st.data);
+	free(sources);
+	free(policies);
+	free(hosts);
+	free(nodes);
+	free(kids);
+	return rc;
+}
+
+/* bounds-check string reference $ref, and return the string */
+static int s_image_ref(const char *strings, uint32_t nstrings, uint32_t ref, char **s)
+{
+	if (ref > nstrings) return 1;
+	*s = ref ? (char*)strings + ref - 1 : NULL;
+	return 0;
+}
+
+/**
+  Load a precompiled manifest image from $path.
+
+  The image (written by @manifest_write) is mapped into memory, and
+  the strings of the returned manifest point directly into it; only
+  the syntax tree nodes themselves need to be allocated.  The image
+  stays mapped until the manifest is freed.
+
+  The manifest is compiled (see @manifest_compile) before it is
+  returned, just like one returned from `parse_file`.  Whether or
+  not it is still current is up to the caller to decide, from the
+  list of sources, and their checksums.
+
+  On success, returns the manifest.  On failure (including a
+  missing, truncated or corrupt image), returns NULL.
+ */
+struct manifest* manifest_read(const char *path)
+{
+	assert(path); // LCOV_EXCL_LINE
+
+	struct manifest *m = NULL;
+	struct image_header *hdr;
+	struct image_node *nodes;
+	struct stat st;
+	uint32_t *sources, *policies, *hosts, *kids;
+	const char *strings;
+	uint64_t len;
+	char *s1, *s2;
+	void *image;
+	size_t i, j;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct image_header)) {
+		close(fd);
+		return NULL;
+	}
+
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED)
+		return NULL;
+
+	hdr = image;
+	if (memcmp(hdr->magic, IMAGE_MAGIC, sizeof(hdr->magic)) != 0
+	 || hdr->endian != IMAGE_ENDIAN || hdr->version != IMAGE_VERSION)
+		goto bad;
+
+	len = sizeof(struct image_header)
+	    + (uint64_t)hdr->nsources * sizeof(uint32_t)
+	    + (uint64_t)hdr->npolicies * 2 * sizeof(uint32_t)
+	    + (uint64_t)hdr->nhosts    * 2 * sizeof(uint32_t)
+	    + (uint64_t)hdr->nnodes * sizeof(struct image_node)
+	    + (uint64_t)hdr->nkids  * sizeof(uint32_t)
+	    + hdr->nstrings;
+	if (len != (uint64_t)st.st_size
+	 || hdr->root > hdr->nnodes || hdr->fallback > hdr->nnodes)
+		goto bad;
+
+	sources  = (uint32_t*)(hdr + 1);
+	policies = sources  + hdr->nsources;
+	hosts    = policies + hdr->npolicies * 2;
+	nodes    = (struct image_node*)(hosts + hdr->nhosts * 2);
+	kids     = (uint32_t*)(nodes + hdr->nnodes);
+	strings  = (const char*)(kids + hdr->nkids);
+
+	/* every string must be terminated within the table */
+	if (hdr->nstrings && strings[hdr->nstrings - 1] != '\0')
+		goto bad;
+
+	m = s_manifest_alloc();
+	m->image = image;
+	m->image_len = st.st_size;
+
+	for (i = 0; i < hdr->nnodes; i++) {
+		if (nodes[i].op > LOCAL_REVDEP
+		 || (uint64_t)nodes[i].kids + nodes[i].size > hdr->nkids
+		 || s_image_ref(strings, hdr->nstrings, nodes[i].data1, &s1) != 0
+		 || s_image_ref(strings, hdr->nstrings, nodes[i].data2, &s2) != 0)
+			goto bad;
+
+		/* strings in the image are already unique */
+		if (s1) hash_set(m->strings, s1, s1);
+		if (s2) hash_set(m->strings, s2, s2);
+		if (!s_new_stree(m, nodes[i].op, s1, s2))
+			goto bad;
+	}
+
+	for (i = 0; i < hdr->nnodes; i++) {
+		if (!nodes[i].size) continue;
+
+		m->nodes[i]->nodes = vcalloc(nodes[i].size, sizeof(struct stree*));
+		m->nodes[i]->size  = nodes[i].size;
+		for (j = 0; j < nodes[i].size; j++) {
+			uint32_t k = kids[nodes[i].kids + j];
+			if (k >= hdr->nnodes)
+				goto bad;
+			m->nodes[i]->nodes[j] = m->nodes[k];
+		}
+	}
+
+	m->root     = hdr->root     ? m->nodes[hdr->root - 1]     : NULL;
+	m->fallback = hdr->fallback ? m->nodes[hdr->fallback - 1] : NULL;
+
+	for (i = 0; i < hdr->npolicies + hdr->nhosts; i++) {
+		uint32_t *pair = i < hdr->npolicies ? policies + i * 2
+		                                    : hosts + (i - hdr->npolicies) * 2;
+		if (s_image_ref(strings, hdr->nstrings, pair[0], &s1) != 0 || !s1
+		 || pair[1] >= hdr->nnodes)
+			goto bad;
+		hash_set(i < hdr->npolicies ? m->policies : m->hosts, s1, m->nodes[pair[1]]);
+	}
+
+	m->sources = strings_new(NULL);
+	for (i = 0; i < hdr->nsources; i++) {
+		if (s_image_ref(strings, hdr->nstrings, sources[i], &s1) != 0 || !s1)
+			goto bad;
+		strings_add(m->sources, s1);
+	}
+
+	if (manifest_compile(m) != 0)
+		goto bad;
+
+	return m;
+
+bad:
+	logger(LOG_WARNING, "Ignoring corrupt manifest image %s", path);
+	if (m) manifest_free(m);
+	else   munmap(image, st.st_size);
+	return NULL;
+}
+
 /**
   Add one $child to $parent.
 
@@ -578,20 +1484,223 @@ int fact_cat_read(const char *file, hash_t *facts)
 		perror(file);
 		return -1;
 	}
-	if (fact_read(input, facts) == NULL) {
-		return -1;
+	if (fact_read(input, facts) == NULL) {
+		return -1;
+	}
+	return 0;
+}
+
+void fact_clean(hash_t *facts)
+{
+	/* unset all of the 'reserved' fact trees */
+	char *k, *v;
+	for_each_key_value(facts, k, v) {
+		if (strncmp(k, "sys.policy.", 11) == 0)
+			free(hash_set(facts, k, NULL));
+	}
+}
+
+static void s_fact(hash_t *facts, const char *name, const char *value)
+{
+	free(hash_set(facts, name, cw_strdup(value)));
+}
+
+static void s_factf(hash_t *facts, const char *name, const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	s_fact(facts, name, buf);
+}
+
+static void s_fact_cpus(hash_t *facts)
+{
+	char line[512], *p;
+	FILE *io;
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > 0)
+		s_factf(facts, "sys.cpu.count", "%li", n);
+
+	io = fopen("/proc/cpuinfo", "r");
+	if (!io)
+		return;
+
+	while (fgets(line, sizeof(line), io)) {
+		if (strncmp(line, "model name", 10) != 0)
+			continue;
+		if (!(p = strchr(line, ':')))
+			continue;
+
+		for (p++; *p == ' ' || *p == '\t'; p++)
+			;
+		p[strcspn(p, "\n")] = '\0';
+		s_fact(facts, "sys.cpu.model", p);
+		break;
+	}
+	fclose(io);
+}
+
+static void s_fact_interfaces(hash_t *facts)
+{
+	struct ifaddrs *ifa, *i;
+	strings_t *names;
+	char addr[INET6_ADDRSTRLEN], key[128], *list;
+	void *in;
+
+	if (getifaddrs(&ifa) != 0)
+		return;
+
+	hash_t seen; memset(&seen, 0, sizeof(seen));
+	names = strings_new(NULL);
+	for (i = ifa; i; i = i->ifa_next) {
+		if (!i->ifa_addr || (i->ifa_flags & IFF_LOOPBACK))
+			continue;
+
+		if (i->ifa_addr->sa_family == AF_INET) {
+			in = &((struct sockaddr_in*)i->ifa_addr)->sin_addr;
+			snprintf(key, sizeof(key), "sys.net.%s.ipv4", i->ifa_name);
+
+		} else if (i->ifa_addr->sa_family == AF_INET6) {
+			in = &((struct sockaddr_in6*)i->ifa_addr)->sin6_addr;
+			snprintf(key, sizeof(key), "sys.net.%s.ipv6", i->ifa_name);
+
+		} else {
+			continue;
+		}
+
+		/* only the first address of each family, per interface */
+		if (hash_get(&seen, key))
+			continue;
+		if (!inet_ntop(i->ifa_addr->sa_family, in, addr, sizeof(addr)))
+			continue;
+
+		s_fact(facts, key, addr);
+		hash_set(&seen, key, "1");
+		if (!hash_get(&seen, i->ifa_name)) {
+			hash_set(&seen, i->ifa_name, "1");
+			strings_add(names, i->ifa_name);
+		}
+	}
+	freeifaddrs(ifa);
+	hash_done(&seen, 0);
+
+	strings_sort(names, STRINGS_ASC);
+	list = strings_join(names, " ");
+	s_fact(facts, "sys.net.interfaces", list);
+	free(list);
+	strings_free(names);
+}
+
+/* same as `cw uuid`: read the host's UUID, or generate
+   (and save) one if this host doesn't have one yet */
+static int s_uuid(char *s)
+{
+	uuid_t uuid;
+	FILE *io = fopen(CW_SYSCONF_DIR "/.uuid", "r");
+	if (io) {
+		int ok = fgets(s, 37, io) != NULL;
+		fclose(io);
+		if (!ok)
+			return -1;
+		s[strcspn(s, "\n")] = '\0';
+		return 0;
+	}
+	if (errno != ENOENT)
+		return -1;
+
+	io = fopen(CW_SYSCONF_DIR "/.uuid", "w");
+	if (!io) {
+		logger(LOG_WARNING, "Failed to save host UUID to %s: %s",
+			CW_SYSCONF_DIR "/.uuid", strerror(errno));
+		return -1;
+	}
+	uuid_generate(uuid);
+	uuid_unparse_lower(uuid, s);
+	fprintf(io, "%s\n", s);
+	fclose(io);
+	return 0;
+}
+
+/**
+  Gather the core sys.* facts about the local system into $facts.
+
+  This replaces the fork/exec of a gatherer script (and several
+  uname / hostname / hostid processes) with a handful of system
+  calls and /proc reads.  Fact names match those of the original
+  gather.d/core script, so existing manifests keep working:
+
+    sys.platform, sys.arch, sys.hostname, sys.domain, sys.fqdn,
+    sys.kernel.version, sys.kernel.major, sys.kernel.minor,
+    sys.hostid and sys.uuid
+
+  In addition, the following facts are collected:
+
+    sys.cpu.count, sys.cpu.model, sys.mem.total, sys.mem.free,
+    sys.swap.total, sys.uptime, sys.net.interfaces, and
+    sys.net.IFACE.ipv4 / sys.net.IFACE.ipv6 for each interface.
+
+  Memory sizes are given in kilobytes; uptime in seconds.
+
+  `fact_gather` calls this before running any gatherer scripts,
+  so a script can still override any of the core facts.
+
+  On success, returns 0.  On failure, returns non-zero.
+ */
+int fact_core(hash_t *facts)
+{
+	assert(facts); // LCOV_EXCL_LINE
+
+	struct utsname u;
+	struct sysinfo si;
+	char buf[256], *p;
+
+	if (uname(&u) != 0) {
+		logger(LOG_ERR, "Failed to gather core facts: uname: %s", strerror(errno));
+		return -1;
+	}
+
+	s_fact(facts, "sys.platform",       u.sysname);
+	s_fact(facts, "sys.arch",           u.machine);
+	s_fact(facts, "sys.hostname",       u.nodename);
+	s_fact(facts, "sys.kernel.version", u.release);
+
+	/* sys.kernel.minor is the release up to the first '-' (2.6.32),
+	   and sys.kernel.major is the first two components (2.6) */
+	snprintf(buf, sizeof(buf), "%s", u.release);
+	buf[strcspn(buf, "-")] = '\0';
+	s_fact(facts, "sys.kernel.minor", buf);
+	if ((p = strchr(buf, '.')) != NULL && (p = strchr(p + 1, '.')) != NULL)
+		*p = '\0';
+	s_fact(facts, "sys.kernel.major", buf);
+
+	p = fqdn();
+	if (p) {
+		s_fact(facts, "sys.fqdn",   p);
+		s_fact(facts, "sys.domain", strchr(p, '.') ? strchr(p, '.') + 1 : "");
+		free(p);
 	}
-	return 0;
-}
 
-void fact_clean(hash_t *facts)
-{
-	/* unset all of the 'reserved' fact trees */
-	char *k, *v;
-	for_each_key_value(facts, k, v) {
-		if (strncmp(k, "sys.policy.", 11) == 0)
-			free(hash_set(facts, k, NULL));
+	s_factf(facts, "sys.hostid", "%08lx", (unsigned long)gethostid() & 0xffffffffUL);
+
+	if (s_uuid(buf) == 0)
+		s_fact(facts, "sys.uuid", buf);
+
+	if (sysinfo(&si) == 0) {
+		s_factf(facts, "sys.mem.total",  "%llu", (unsigned long long)si.totalram  * si.mem_unit / 1024);
+		s_factf(facts, "sys.mem.free",   "%llu", (unsigned long long)si.freeram   * si.mem_unit / 1024);
+		s_factf(facts, "sys.swap.total", "%llu", (unsigned long long)si.totalswap * si.mem_unit / 1024);
+		s_factf(facts, "sys.uptime",     "%li",  si.uptime);
 	}
+
+	s_fact_cpus(facts);
+	s_fact_interfaces(facts);
+	return 0;
 }
 
 int fact_gather(const char *paths, hash_t *facts)
@@ -599,6 +1708,8 @@ int fact_gather(const char *paths, hash_t *facts)
 	glob_t scripts;
 	size_t i;
 
+	fact_core(facts);
+
 	switch(glob(paths, GLOB_MARK, NULL, &scripts)) {
 	case GLOB_NOMATCH:
 		globfree(&scripts);
@@ -721,6 +1832,183 @@ int fact_write(FILE *io, hash_t *facts)
 	return 0;
 }
 
+#define FACT_DELTA_SET   's'
+#define FACT_DELTA_UNSET 'u'
+
+static void s_delta_put(uint8_t **buf, size_t *len, size_t *cap, const void *data, size_t n)
+{
+	if (*len + n > *cap) {
+		while (*len + n > *cap)
+			*cap = *cap ? *cap * 2 : 4096;
+		*buf = realloc(*buf, *cap);
+		assert(*buf); // LCOV_EXCL_LINE
+	}
+	memcpy(*buf + *len, data, n);
+	*len += n;
+}
+
+static void s_delta_record(uint8_t **buf, size_t *len, size_t *cap, uint8_t op, const char *k, const char *v)
+{
+	uint16_t klen = htons(strlen(k));
+	uint32_t vlen;
+
+	s_delta_put(buf, len, cap, &op, 1);
+	s_delta_put(buf, len, cap, &klen, sizeof(klen));
+	s_delta_put(buf, len, cap, k, ntohs(klen));
+	if (op == FACT_DELTA_SET) {
+		vlen = htonl(strlen(v));
+		s_delta_put(buf, len, cap, &vlen, sizeof(vlen));
+		s_delta_put(buf, len, cap, v, ntohl(vlen));
+	}
+}
+
+/**
+  Encode the differences between $base and $facts.
+
+  The delta is a compact, length-prefixed binary encoding, suitable
+  for sending over the wire in place of the full `fact_write` text.
+  Each record is a single opcode byte, a 16-bit (network order) key
+  length and the key itself.  Records that set a fact ('s') are
+  followed by a 32-bit (network order) value length and the value.
+  Records that remove a fact ('u') carry no value.
+
+  If $base is NULL, every fact in $facts is encoded.
+
+  The encoded delta is allocated and stored in $buf, and its length
+  in $len.  An empty delta (no differences) yields a NULL $buf and
+  a $len of 0.  Callers must free $buf.
+
+  On success, returns 0.  On failure, returns non-zero.
+ */
+int fact_delta(hash_t *base, hash_t *facts, uint8_t **buf, size_t *len)
+{
+	assert(facts); // LCOV_EXCL_LINE
+	assert(buf); // LCOV_EXCL_LINE
+	assert(len); // LCOV_EXCL_LINE
+
+	char *k, *v, *old;
+	size_t cap = 0;
+
+	*buf = NULL;
+	*len = 0;
+
+	for_each_key_value(facts, k, v) {
+		if (!v)
+			continue;
+		if (strlen(k) > 0xffff || strlen(v) > 0xffffffffUL) {
+			free(*buf);
+			*buf = NULL;
+			*len = 0;
+			return -1;
+		}
+		old = base ? hash_get(base, k) : NULL;
+		if (old && strcmp(old, v) == 0)
+			continue;
+		s_delta_record(buf, len, &cap, FACT_DELTA_SET, k, v);
+	}
+
+	if (base) {
+		for_each_key_value(base, k, v) {
+			if (v && !hash_get(facts, k))
+				s_delta_record(buf, len, &cap, FACT_DELTA_UNSET, k, NULL);
+		}
+	}
+
+	return 0;
+}
+
+/**
+  Walk the records of a delta (from `fact_delta`).
+
+  For each record in the $len bytes of $buf, $fn is called with the
+  fact name, the new value (or NULL, if the fact was removed), and
+  the caller-supplied $udata.  Names and values are only valid for the
+  duration of the call.  If $fn returns non-zero, the walk stops.
+
+  On success, returns 0.  On failure (a malformed delta, or a non-zero
+  return from $fn), returns non-zero.
+ */
+int fact_delta_walk(const uint8_t *buf, size_t len, fact_delta_fn fn, void *udata)
+{
+	assert(buf || len == 0); // LCOV_EXCL_LINE
+	assert(fn); // LCOV_EXCL_LINE
+
+	const uint8_t *end = buf + len;
+	uint16_t klen;
+	uint32_t vlen;
+	uint8_t op;
+	char *k, *v;
+	int rc;
+
+	while (buf < end) {
+		if (end - buf < 3)
+			return -1;
+
+		op = *buf++;
+		memcpy(&klen, buf, sizeof(klen)); buf += sizeof(klen);
+		klen = ntohs(klen);
+		if (end - buf < klen)
+			return -1;
+		k = vmalloc(klen + 1);
+		memcpy(k, buf, klen); buf += klen;
+
+		switch (op) {
+		case FACT_DELTA_SET:
+			if (end - buf < sizeof(vlen)) {
+				free(k);
+				return -1;
+			}
+			memcpy(&vlen, buf, sizeof(vlen)); buf += sizeof(vlen);
+			vlen = ntohl(vlen);
+			if (end - buf < vlen) {
+				free(k);
+				return -1;
+			}
+			v = vmalloc(vlen + 1);
+			memcpy(v, buf, vlen); buf += vlen;
+			rc = fn(k, v, udata);
+			free(v);
+			break;
+
+		case FACT_DELTA_UNSET:
+			rc = fn(k, NULL, udata);
+			break;
+
+		default:
+			free(k);
+			return -1;
+		}
+		free(k);
+
+		if (rc != 0)
+			return rc;
+	}
+
+	return 0;
+}
+
+static int s_patch_fact(const char *k, const char *v, void *facts)
+{
+	free(hash_set((hash_t*)facts, k, cw_strdup(v)));
+	return 0;
+}
+
+/**
+  Apply a delta (from `fact_delta`) to $facts.
+
+  Facts set by the delta are added to (or overwritten in) $facts, and
+  facts removed by the delta are removed from $facts.
+
+  If the delta is malformed, $facts may have been partially updated.
+
+  On success, returns 0.  On failure, returns non-zero.
+ */
+int fact_patch(hash_t *facts, const uint8_t *buf, size_t len)
+{
+	assert(facts); // LCOV_EXCL_LINE
+	return fact_delta_walk(buf, len, s_patch_fact, facts);
+}
+
 static struct resource * _policy_find_resource(struct policy_generator *pgen, const char *type, const char *id)
 {
 	assert(pgen); // LCOV_EXCL_LINE
@@ -763,22 +2051,6 @@ static struct resource * _policy_make_resource(struct policy_generator *pgen, co
 	return res;
 }
 
-static char *policy_fact_name(const char *policy)
-{
-	strings_t *parts = strings_split(policy, strlen(policy), "::", SPLIT_NORMAL);
-	if (!parts)
-		return NULL;
-
-	char *dotted = strings_join(parts, ".");
-	strings_free(parts);
-	if (!dotted)
-		return NULL;
-
-	char *key = string("sys.policy.%s", dotted);
-	free(dotted);
-	return key;
-}
-
 static int _policy_generate(struct stree *node, struct policy_generator *pgen, int depth)
 {
 	unsigned int i;
@@ -792,7 +2064,7 @@ again:
 
 	switch(node->op) {
 	case IF:
-		if (s_eval(node->nodes[0], pgen->facts)) {
+		if (s_eval(node->nodes[0], pgen)) {
 			node = node->nodes[1];
 		} else {
 			node = node->nodes[2];
@@ -927,6 +2199,12 @@ again:
 		break;
 
 	case INCLUDE:
+		if (pgen->slots && node->slot) {
+			fact = pgen->slot_names[node->slot - 1];
+			hash_set(pgen->facts, fact, strdup("enforced"));
+			pgen->slots[node->slot - 1] = hash_get(pgen->facts, fact);
+			break;
+		}
 		fact = policy_fact_name(node->data1);
 		if (fact) {
 			hash_set(pgen->facts, fact, strdup("enforced"));
@@ -963,24 +2241,17 @@ again:
 	return 0;
 }
 
-/**
-  Apply $facts to a syntax tree to create a policy.
-
-  This function is crucial to Clockwork's master daemon.
-  It turns the abstract syntax tree $root into a full policy
-  object by evaluating all conditional constructs against $facts.
-
-  **Note:** the policy returned must be freed with @policy_free.
-
-  On success, returns a new policy object.  On failure, returns NULL.
- */
-struct policy* policy_generate(struct stree *root, hash_t *facts)
+/* evaluate $root against $facts, and normalize the result.
+   If $slots is given, conditionals read fact values from it (by
+   the slot numbers assigned to $slot_names), instead of $facts. */
+static struct policy* s_generate(struct stree *root, hash_t *facts,
+                                 const char **slots, char **slot_names)
 {
-	assert(root); // LCOV_EXCL_LINE
-
 	struct policy_generator pgen;
 
 	pgen.facts = facts;
+	pgen.slots = slots;
+	pgen.slot_names = slot_names;
 	pgen.policy = policy_new(root->data1);
 
 	/* set up scopes for default values */
@@ -1002,6 +2273,154 @@ struct policy* policy_generate(struct stree *root, hash_t *facts)
 	return pgen.policy;
 }
 
+/**
+  Apply $facts to a syntax tree to create a policy.
+
+  This function is crucial to Clockwork's master daemon.
+  It turns the abstract syntax tree $root into a full policy
+  object by evaluating all conditional constructs against $facts.
+
+  **Note:** the policy returned must be freed with @policy_free.
+
+  On success, returns a new policy object.  On failure, returns NULL.
+ */
+struct policy* policy_generate(struct stree *root, hash_t *facts)
+{
+	assert(root); // LCOV_EXCL_LINE
+	return s_generate(root, facts, NULL, NULL);
+}
+
+/* the values of the facts that $mr depends on, as a hash key */
+static char* s_memo_key(struct memo_root *mr, const char **slots)
+{
+	unsigned int i;
+	size_t n = 16;
+	char *key, *p;
+
+	for (i = 0; i < mr->nslots; i++)
+		n += slots[mr->slots[i] - 1] ? strlen(slots[mr->slots[i] - 1]) + 24 : 2;
+
+	p = key = vmalloc(n);
+	p += sprintf(p, "%u|", mr->nslots);
+	for (i = 0; i < mr->nslots; i++) {
+		const char *v = slots[mr->slots[i] - 1];
+		p += v ? sprintf(p, "%lu:%s,", (unsigned long)strlen(v), v)
+		       : sprintf(p, "-,");
+	}
+	return key;
+}
+
+/**
+  Apply $facts to $root, a syntax tree from compiled manifest $m.
+
+  This works just like @policy_generate, except that $facts are
+  projected into the fact slots assigned by @manifest_compile
+  up front, once, and conditionals read their values by slot
+  number, rather than by hash lookup.
+
+  The policy generated for $root depends only on the values of the
+  (few) facts that its conditionals test, so it is kept, keyed by
+  those values, and handed out again to every host that agrees on
+  them.  For policies with no conditionals at all, that means every
+  host gets the same policy, and it is generated just once.  Facts
+  set by `include` statements are still set in $facts every time.
+
+  **Note:** the policy returned may be shared, and must be treated
+  as read-only.  It must be freed with @policy_free (or
+  @policy_free_all).
+
+  On success, returns a policy object.  On failure, returns NULL.
+ */
+struct policy* manifest_generate(struct manifest *m, struct stree *root, hash_t *facts)
+{
+	assert(m);     // LCOV_EXCL_LINE
+	assert(root);  // LCOV_EXCL_LINE
+	assert(facts); // LCOV_EXCL_LINE
+
+	struct policy *pol;
+	const char **slots;
+	unsigned int i;
+
+	slots = vcalloc(m->nslots + 1, sizeof(char*));
+	for (i = 0; i < m->nslots; i++)
+		slots[i] = hash_get(facts, m->slot_names[i]);
+
+	pol = manifest_generate_slots(m, root, slots, facts);
+	free(slots);
+	return pol;
+}
+
+/**
+  Apply fact values $slots to $root, a syntax tree from compiled
+  manifest $m.
+
+  This is @manifest_generate, for callers that keep their facts in
+  something other than a hash, and have already projected them
+  into the fact slots of $m: $slots holds the value of the fact
+  named by `$m->slot_names[i]` at index i (or NULL, if unset).
+
+  Facts set by `include` statements are set in $facts (which can
+  start out empty), and in $slots.
+
+  **Note:** the policy returned may be shared, and must be treated
+  as read-only.  It must be freed with @policy_free (or
+  @policy_free_all).
+
+  On success, returns a policy object.  On failure, returns NULL.
+ */
+struct policy* manifest_generate_slots(struct manifest *m, struct stree *root,
+                                       const char **slots, hash_t *facts)
+{
+	assert(m);     // LCOV_EXCL_LINE
+	assert(root);  // LCOV_EXCL_LINE
+	assert(slots); // LCOV_EXCL_LINE
+	assert(facts); // LCOV_EXCL_LINE
+
+	struct policy *pol;
+	struct memo_root *mr;
+	struct memo *memo;
+	const char **before;
+	char *key = NULL;
+	unsigned int i;
+
+	mr = s_memo_root(m, root);
+	if (mr->cacheable) {
+		key = s_memo_key(mr, slots);
+		if ((memo = hash_get(mr->policies, key)) != NULL) {
+			for (i = 0; i < memo->nset; i++) {
+				hash_set(facts, m->slot_names[memo->set[i] - 1], strdup("enforced"));
+				slots[memo->set[i] - 1] = hash_get(facts, m->slot_names[memo->set[i] - 1]);
+			}
+
+			free(key);
+			return policy_retain(memo->policy);
+		}
+	}
+
+	before = vcalloc(m->nslots + 1, sizeof(char*));
+	memcpy(before, slots, m->nslots * sizeof(char*));
+
+	pol = s_generate(root, facts, slots, m->slot_names);
+	if (pol && key && m->nmemos < MAX_MEMOS) {
+		memo = vmalloc(sizeof(struct memo));
+		memo->policy = policy_retain(pol);
+
+		/* remember which facts the includes set */
+		for (i = 0; i < m->nslots; i++) {
+			if (slots[i] == before[i]) continue;
+			memo->set = realloc(memo->set, (memo->nset + 1) * sizeof(unsigned int));
+			memo->set[memo->nset++] = i + 1;
+		}
+
+		hash_set(mr->policies, key, memo);
+		m->nmemos++;
+	}
+
+	free(before);
+	free(key);
+	return pol;
+}
+
 /**
   Create a new, empty policy.
 
@@ -1024,7 +2443,26 @@ struct policy* policy_new(const char *name)
 	list_init(&pol->acl);
 	pol->index = vmalloc(sizeof(hash_t));
 	pol->cache = vmalloc(sizeof(hash_t));
+	pol->deps  = vmalloc(sizeof(hash_t));
+	pol->attrs = vcalloc(NUM_ATTR_INDEXES, sizeof(hash_t));
+	pol->indexed = 0;
+
+	pol->refs = 1;
+	return pol;
+}
+
+/**
+  Take another reference to policy $pol.
+
+  Each call must be balanced by a call to @policy_free (or
+  @policy_free_all); $pol is only freed once the last reference
+  to it has been dropped.
 
+  Returns $pol.
+ */
+struct policy* policy_retain(struct policy *pol)
+{
+	if (pol) pol->refs++;
 	return pol;
 }
 
@@ -1033,15 +2471,29 @@ struct policy* policy_new(const char *name)
 
   This function does not free the resources that $pol
   references.  For that behavior, see @policy_free_all.
+
+  If other references to $pol are still held (see
+  @policy_retain), this just drops one of them.
  */
 void policy_free(struct policy *pol)
 {
+	if (pol && --pol->refs > 0)
+		return;
+
 	if (pol) {
 		hash_done(pol->index, 0);
 		hash_done(pol->cache, 0);
+		hash_done(pol->deps,  0);
 		free(pol->index);
 		free(pol->cache);
+		free(pol->deps);
+
+		int i;
+		for (i = 0; i < NUM_ATTR_INDEXES; i++)
+			hash_done(&pol->attrs[i], 0);
+		free(pol->attrs);
 		free(pol->name);
+		free(pol->code);
 	}
 	free(pol);
 }
@@ -1055,6 +2507,11 @@ void policy_free_all(struct policy *pol)
 	struct dependency *d, *d_tmp;
 	acl_t *a, *a_tmp;
 
+	if (pol && pol->refs > 1) {
+		pol->refs--;
+		return;
+	}
+
 	if (pol) {
 		for_each_resource_safe(r, r_tmp, pol) { resource_free(r); }
 		for_each_dependency_safe(d, d_tmp, pol) { dependency_free(d); }
@@ -1063,6 +2520,47 @@ void policy_free_all(struct policy *pol)
 	policy_free(pol);
 }
 
+static const char* s_attr_value(const struct resource *r, int i, char *buf, size_t len)
+{
+	const struct res_user  *ru = r->resource;
+	const struct res_group *rg = r->resource;
+
+	switch (i) {
+	case 0: return ru->name;
+	case 1: snprintf(buf, len, "%u", ru->uid); return buf;
+	case 2: return rg->name;
+	case 3: snprintf(buf, len, "%u", rg->gid); return buf;
+	case 4: return ((const struct res_file*)(r->resource))->path;
+	case 5: return ((const struct res_dir*)(r->resource))->path;
+	}
+	return NULL; /* LCOV_EXCL_LINE */
+}
+
+/* (re-)build the attribute indexes; the first resource defined wins */
+static void s_index_attrs(struct policy *pol)
+{
+	struct resource *r;
+	const char *v;
+	char buf[32];
+	int i;
+
+	for (i = 0; i < NUM_ATTR_INDEXES; i++) {
+		hash_done(&pol->attrs[i], 0);
+		memset(&pol->attrs[i], 0, sizeof(hash_t));
+	}
+
+	for_each_resource(r, pol) {
+		for (i = 0; i < NUM_ATTR_INDEXES; i++) {
+			if (ATTR_INDEXES[i].type != r->type)
+				continue;
+			v = s_attr_value(r, i, buf, sizeof(buf));
+			if (v && !hash_get(&pol->attrs[i], v))
+				hash_set(&pol->attrs[i], v, r);
+		}
+	}
+	pol->indexed = 1;
+}
+
 /**
   Add resource $res to $pol.
 
@@ -1076,6 +2574,10 @@ int policy_add_resource(struct policy *pol, struct resource *res)
 	list_push(&pol->resources, &res->l);
 	logger(LOG_DEBUG, "Adding resource %s to policy", res->key);
 	hash_set(pol->index, res->key, res);
+
+	/* attributes are usually set after the resource is added,
+	   so the attribute indexes are (re-)built on next lookup */
+	pol->indexed = 0;
 	return 0;
 }
 
@@ -1102,6 +2604,15 @@ int policy_add_resource(struct policy *pol, struct resource *res)
 struct resource* policy_find_resource(struct policy *pol, enum restype type, const char *attr, const char *value)
 {
 	struct resource *r;
+	int i;
+
+	for (i = 0; i < NUM_ATTR_INDEXES; i++) {
+		if (ATTR_INDEXES[i].type == type && strcmp(ATTR_INDEXES[i].attr, attr) == 0) {
+			if (!pol->indexed)
+				s_index_attrs(pol);
+			return hash_get(&pol->attrs[i], value);
+		}
+	}
 
 	logger(LOG_DEBUG, "Looking for resource %u matching %s => '%s'", type, attr, value);
 	char *needle = string("%i:%s=%s", (int)type, attr, value);
@@ -1138,20 +2649,129 @@ int policy_add_dependency(struct policy *pol, struct dependency *dep)
 	assert(pol); // LCOV_EXCL_LINE
 	assert(dep); // LCOV_EXCL_LINE
 
-	struct dependency *d;
-	for_each_dependency(d, pol) {
-		if (strcmp(d->a, dep->a) == 0
-		 && strcmp(d->b, dep->b) == 0) {
-			logger(LOG_DEBUG, "Already have a dependency of %s -> %s", dep->a, dep->b);
-			return -1; /* duplicate */
-		}
+	char *key = s_dependency_key(dep);
+	if (hash_get(pol->deps, key)) {
+		logger(LOG_DEBUG, "Already have a dependency of %s -> %s", dep->a, dep->b);
+		free(key);
+		return -1; /* duplicate */
 	}
 	logger(LOG_DEBUG, "Adding dependency of %s -> %s", dep->a, dep->b);
 	list_push(&pol->dependencies, &dep->l);
+	hash_set(pol->deps, key, dep);
+	free(key);
 
 	return 0;
 }
 
+/* some resources share a session (an open authdb, or the hosts
+   database) that has to be written back out once they're all done */
+static const char* s_session(const struct resource *r)
+{
+	switch (r->type) {
+	case RES_USER:
+	case RES_GROUP: return "authdb";
+	case RES_HOST:    return "hosts";
+	case RES_PACKAGE: return "package";
+	default:          return NULL;
+	}
+}
+
+static void s_gencode_session_save(FILE *io, const char *session)
+{
+	if (strcmp(session, "authdb") == 0)
+		fprintf(io, "  ;; write out user / group changes\n");
+	else if (strcmp(session, "package") == 0)
+		fprintf(io, "  ;; install / remove queued packages\n");
+	else
+		fprintf(io, "  ;; write out %s changes\n", session);
+
+	fprintf(io, "  try util.%s.save\n"
+	            "  acc %%p\n"
+	            "  add %%o %%p\n", session);
+}
+
+/* resources that can be handed off to a worker VM, and run
+   alongside others; anything that works on state shared with
+   the main VM (the authdb, the hosts database, the package
+   queue, or the connection to the master) has to run in it. */
+static int s_async(const struct resource *r)
+{
+	if (s_session(r))
+		return 0;
+	if (r->type == RES_FILE && ENFORCED((struct res_file*)(r->resource), RES_FILE_SHA1))
+		return 0;
+	return 1;
+}
+
+static void s_gencode_main(const struct policy *pol, FILE *io, int parallel)
+{
+	/* user and group resources share one open authdb, and host
+	   resources share one hosts database; each is only written out
+	   after the last of a run of them, so that the files behind
+	   them get rewritten once (and only if they changed), not
+	   once per resource.  anything that comes after (i.e. a
+	   dependent resource) sees the changes on disk.
+
+	   package resources work the same way, except that they can
+	   depend on each other; the package queue is also flushed
+	   before any package that depends on one still queued.
+
+	   in parallel mode, resources that can run in a worker are
+	   started with async, and each resource first waits for any
+	   of the ones it depends on that are still running. */
+	struct resource *r;
+	const char *session = NULL;
+	hash_t pending, running;
+	memset(&pending, 0, sizeof(pending));
+	memset(&running, 0, sizeof(running));
+	for_each_resource(r, pol) {
+		const char *next = s_session(r);
+		int i, flush = session && (!next || strcmp(session, next) != 0);
+		for (i = 0; !flush && i < r->ndeps; i++)
+			flush = hash_get(&pending, r->deps[i]->key) != NULL;
+
+		if (flush) {
+			s_gencode_session_save(io, session);
+			hash_done(&pending, 0);
+			memset(&pending, 0, sizeof(pending));
+		}
+		session = next;
+		if (session && strcmp(session, "package") == 0)
+			hash_set(&pending, r->key, r);
+
+		for (i = 0; i < r->ndeps; i++) {
+			if (!hash_get(&running, r->deps[i]->key))
+				continue;
+			fprintf(io, "  await res:%08x\n"
+			            "  acc %%p\n"
+			            "  add %%o %%p\n", r->deps[i]->serial);
+			hash_set(&running, r->deps[i]->key, NULL);
+		}
+
+		if (parallel && s_async(r)) {
+			fprintf(io, "  topic \"%s\"\n"
+			            "  async res:%08x\n"
+			            "  acc %%p\n"
+			            "  add %%o %%p\n", r->key, r->serial);
+			hash_set(&running, r->key, r);
+
+		} else {
+			fprintf(io, "  topic \"%s\"\n"
+			            "  try res:%08x\n"
+			            "  acc %%p\n"
+			            "  add %%o %%p\n", r->key, r->serial);
+		}
+	}
+	if (session)
+		s_gencode_session_save(io, session);
+	if (parallel)
+		fprintf(io, "  await.all\n"
+		            "  acc %%p\n"
+		            "  add %%o %%p\n");
+	hash_done(&pending, 0);
+	hash_done(&running, 0);
+}
+
 int policy_gencode(const struct policy *pol, FILE *io)
 {
 	fprintf(io, "#include stdlib\n");
@@ -1161,7 +2781,6 @@ int policy_gencode(const struct policy *pol, FILE *io)
 		acl_gencode(a, io);
 
 	struct resource *r;
-	struct dependency *d;
 	for_each_resource(r, pol) {
 		fprintf(io, "fn res:%08x\n"
 		            "  unflag \"changed\"\n"
@@ -1169,15 +2788,10 @@ int policy_gencode(const struct policy *pol, FILE *io)
 		            "  flagged? \"changed\"\n"
 		            "  jz +1 retv 0\n", r->serial, r->serial);
 
-		int n = 0;
-		for_each_dependency(d, pol)
-			if (r == d->resource_b)
-				n++;
-
-		if (n) {
-			for_each_dependency(d, pol)
-				if (r == d->resource_b)
-					fprintf(io, "  flag \"%s\"\n", d->resource_a->key);
+		if (r->ndependents) {
+			int i;
+			for (i = 0; i < r->ndependents; i++)
+				fprintf(io, "  flag \"%s\"\n", r->dependents[i]->key);
 
 		} else {
 			fprintf(io, "  ;; no dependencies\n");
@@ -1189,13 +2803,26 @@ int policy_gencode(const struct policy *pol, FILE *io)
 		fprintf(io, "\n");
 	}
 
+	int n = 0;
+	for_each_resource(r, pol)
+		if (s_async(r)) n++;
+
 	fprintf(io, "fn main\n"
 	            "  set %%o 0\n");
-	for_each_resource(r, pol)
-		fprintf(io, "  topic \"%s\"\n"
-		            "  try res:%08x\n"
-		            "  acc %%p\n"
-		            "  add %%o %%p\n", r->key, r->serial);
+	if (n < 2) {
+		s_gencode_main(pol, io, 0);
+		fprintf(io, "  retv 0\n");
+		return 0;
+	}
+
+	/* runtimes that can't run resources in parallel
+	   get the plain, one-at-a-time version */
+	fprintf(io, "  runtime %%p lt %%p 20150501 jz serial\n");
+	s_gencode_main(pol, io, 1);
+	fprintf(io, "  retv 0\n"
+	            "\n"
+	            "serial:\n");
+	s_gencode_main(pol, io, 0);
 	fprintf(io, "  retv 0\n");
 	return 0;
 }
@@ -71,8 +71,15 @@ struct stree {
 
 	unsigned int   size;  /* how many child nodes? */
 	struct stree **nodes; /* array of child nodes */
+
+	pcre       *regex;       /* compiled EXPR_REGEX pattern */
+	pcre_extra *regex_extra; /* study data (and JIT code) for regex */
+
+	unsigned int slot;       /* fact slot (EXPR_FACT / INCLUDE), 1-based */
 };
 
+struct arena;
+
 /**
   Manifest of all known Host and Policy Definitions
 
@@ -90,6 +97,23 @@ struct manifest {
 	size_t nodes_len;       /* number of nodes */
 
 	struct stree *root;     /* root node of the whole syntax tree */
+
+	struct arena *arena;    /* storage for nodes and interned strings */
+	hash_t *strings;        /* interned data1 / data2 strings */
+	hash_t *shared;         /* hash-consed ATTR and EXPR_* nodes */
+
+	hash_t *slots;          /* fact slot numbers, hashed by fact name */
+	char  **slot_names;     /* fact names, indexed by slot number - 1 */
+	unsigned int nslots;    /* number of fact slots assigned */
+
+	hash_t *memos;          /* generated policies, by root (see @manifest_generate) */
+	unsigned int nmemos;    /* number of generated policies kept */
+
+	strings_t *sources;     /* "SHA1 TYPE PATH" of every file / glob parsed */
+	void  *image;           /* mmap'd precompiled image (see @manifest_read) */
+	size_t image_len;       /* size of image, in bytes */
+
+	unsigned int refs;      /* references held (see @manifest_retain) */
 };
 
 /**
@@ -114,6 +138,15 @@ struct policy {
 
 	hash_t *index;       /* resources, keyed by "TYPE:pkey" */
 	hash_t *cache;       /* search cache, keyed by "TYPE:attr=val" */
+	hash_t *deps;        /* dependencies, keyed by (a, b) pair */
+
+	hash_t *attrs;       /* typed attribute indexes (policy_find_resource) */
+	int indexed;         /* are the attribute indexes up-to-date? */
+
+	unsigned int refs;   /* references held (see @policy_retain) */
+
+	uint8_t *code;       /* compiled Pendulum bytecode, if cached */
+	size_t   code_len;   /* length of code, in bytes */
 };
 
 /* Iterate over a policy's resources */
@@ -134,9 +167,19 @@ struct policy {
 /* Iterate (safely) over a policy ACL */
 #define for_each_acl_safe(a,t,pol) for_each_object_safe((a), (t), &((pol)->acl), l)
 
+/* Callback for fact_delta_walk (value is NULL for removed facts) */
+typedef int (*fact_delta_fn)(const char *name, const char *value, void *udata);
+
 struct manifest* manifest_new(void);
+struct manifest* manifest_retain(struct manifest *m);
 void manifest_free(struct manifest *m);
 int manifest_validate(struct manifest *m);
+int manifest_compile(struct manifest *m);
+int manifest_intern(struct manifest *m);
+size_t manifest_arena_size(const struct manifest *m);
+int manifest_write(struct manifest *m, const char *path);
+struct manifest* manifest_read(const char *path);
+int stree_compile(struct stree *node);
 
 struct stree* manifest_new_stree(struct manifest *m, enum oper op, char *data1, char *data2);
 struct stree* manifest_new_stree_expr(struct manifest *m, enum oper op, struct stree *a, struct stree *b);
@@ -146,14 +189,21 @@ int stree_compare(const struct stree *a, const struct stree *b);
 hash_t* fact_read(FILE *io, hash_t *facts);
 hash_t* fact_read_string(const char *s, hash_t *facts);
 int fact_write(FILE *io, hash_t *facts);
+int fact_delta(hash_t *base, hash_t *facts, uint8_t **buf, size_t *len);
+int fact_patch(hash_t *facts, const uint8_t *buf, size_t len);
+int fact_delta_walk(const uint8_t *buf, size_t len, fact_delta_fn fn, void *udata);
 int fact_parse(const char *line, hash_t *hash);
 int fact_exec_read(const char *script, hash_t *facts);
 int fact_cat_read(const char *file, hash_t *facts);
+int fact_core(hash_t *facts);
 int fact_gather(const char *paths, hash_t *facts);
 void fact_clean(hash_t *facts);
 
 struct policy* policy_generate(struct stree *root, hash_t *facts);
+struct policy* manifest_generate(struct manifest *m, struct stree *root, hash_t *facts);
+struct policy* manifest_generate_slots(struct manifest *m, struct stree *root, const char **slots, hash_t *facts);
 struct policy* policy_new(const char *name);
+struct policy* policy_retain(struct policy *pol);
 void policy_free(struct policy *pol);
 void policy_free_all(struct policy *pol);
 int policy_add_resource(struct policy *pol, struct resource *res);
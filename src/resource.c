@@ -122,6 +122,8 @@ struct resource* resource_new(const char *type, const char *key)
 	r->key = (*(resource_types[r->type].key_callback))(r->resource);
 	r->ndeps = 0;
 	r->deps = NULL;
+	r->ndependents = 0;
+	r->dependents = NULL;
 	r->serial = NEXT_SERIAL++;
 	return r;
 }
@@ -140,6 +142,8 @@ struct resource* resource_clone(const struct resource *orig, const char *key)
 	r->key = (*(resource_types[r->type].key_callback))(r->resource);
 	r->ndeps = 0;
 	r->deps = NULL;
+	r->ndependents = 0;
+	r->dependents = NULL;
 	r->serial = NEXT_SERIAL++;
 	return r;
 }
@@ -155,6 +159,8 @@ void resource_free(struct resource *r)
 	if (r) {
 		(*(resource_types[r->type].free_callback))(r->resource);
 		free(r->key);
+		free(r->deps);
+		free(r->dependents);
 	}
 	free(r);
 }
@@ -246,11 +252,12 @@ int resource_set(struct resource *r, const char *attr, const char *value)
 
   Mainly intended for use by the Policy implementation, this
   function appends a dependent resource ($dep) to another
-  resource's ($r) list of dependencies.
+  resource's ($r) list of dependencies, and $r to the list of
+  resources that depend on $dep.
 
-  Policy uses this list later (via @resource_depends_on and
-  @resource_drop_dependency) to re-order its list of resources
-  so that it performs fixups in the appropriate order.
+  Policy uses these lists later to re-order its list of resources
+  so that it performs fixups in the appropriate order, and to
+  generate the code that flags dependents when $dep changes.
 
   On success, returns 0.  On failure, returns non-zero.
  */
@@ -261,6 +268,9 @@ int resource_add_dependency(struct resource *r, struct resource *dep)
 
 	r->deps = realloc(r->deps, sizeof(struct resource*) * (r->ndeps+1));
 	r->deps[r->ndeps++] = dep;
+
+	dep->dependents = realloc(dep->dependents, sizeof(struct resource*) * (dep->ndependents+1));
+	dep->dependents[dep->ndependents++] = r;
 	return 0;
 }
 
@@ -281,6 +291,20 @@ int resource_drop_dependency(struct resource *r, struct resource *dep)
 	assert(dep); // LCOV_EXCL_LINE
 
 	int i, j;
+	for (i = 0; i < dep->ndependents; i++) {
+		if (dep->dependents[i] == r) {
+			for (j = i+1; j < dep->ndependents; j++) {
+				dep->dependents[i++] = dep->dependents[j];
+			}
+			dep->ndependents--;
+			if (dep->ndependents == 0) {
+				free(dep->dependents);
+				dep->dependents = NULL;
+			}
+			break;
+		}
+	}
+
 	for (i = 0; i < r->ndeps; i++) {
 		if (r->deps[i] == dep) {
 			for (j = i+1; j < r->ndeps; j++) {
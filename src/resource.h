@@ -58,6 +58,8 @@ struct resource {
 
 	struct resource **deps;  /* other resources this one depends on */
 	int ndeps;               /* how many dependencies are there? */
+	struct resource **dependents; /* other resources that depend on this one */
+	int ndependents;              /* how many dependents are there? */
 	unsigned int serial;
 
 	list_t l;
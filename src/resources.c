@@ -312,8 +312,7 @@ int res_user_gencode(const void *res, FILE *io)
 	            "  set %%a \"%s\"\n", r->name);
 
 	if (ENFORCED(r, RES_USER_ABSENT)) {
-		fprintf(io, "  call res.user.absent\n"
-		            "  call util.authdb.save\n");
+		fprintf(io, "  call res.user.absent\n");
 		return 0;
 	}
 
@@ -396,7 +395,6 @@ int res_user_gencode(const void *res, FILE *io)
 		            "    user.get \"gid\" %%d\n"
 		            "    call res.user.mkhome\n", r->skel);
 
-	fprintf(io, "  call util.authdb.save\n");
 	return 0;
 }
 
@@ -1122,8 +1120,7 @@ int res_group_gencode(const void *res, FILE *io)
 	            "  set %%a \"%s\"\n", r->name);
 
 	if (ENFORCED(r, RES_GROUP_ABSENT)) {
-		fprintf(io, "  call res.group.absent\n"
-		            "  call util.authdb.save\n");
+		fprintf(io, "  call res.group.absent\n");
 		return 0;
 	}
 
@@ -1164,7 +1161,6 @@ int res_group_gencode(const void *res, FILE *io)
 			            "    call res.group.member\n", r->adm_rm->strings[i]);
 
 	}
-	fprintf(io, "  call util.authdb.save\n");
 	return 0;
 }
 
@@ -1369,7 +1365,8 @@ int res_package_gencode(const void *res, FILE *io)
 	struct res_package *r = (struct res_package*)(res);
 	assert(r); // LCOV_EXCL_LINE
 
-	fprintf(io, "  set %%a \"%s\"\n", r->name);
+	fprintf(io, "  call util.package.begin\n"
+	            "  set %%a \"%s\"\n", r->name);
 	if (ENFORCED(r, RES_PACKAGE_ABSENT)) {
 		fprintf(io, "  call res.package.absent\n");
 		return 0;
@@ -1675,7 +1672,8 @@ int res_host_gencode(const void *res, FILE *io)
 	struct res_host *r = (struct res_host*)(res);
 	assert(r); // LCOV_EXCL_LINE
 
-	fprintf(io, "  set %%a \"%s\"\n"
+	fprintf(io, "  call util.hosts.open\n"
+	            "  set %%a \"%s\"\n"
 	            "  set %%b \"%s\"\n", r->ip, r->hostname);
 
 	if (ENFORCED(r, RES_HOST_ABSENT)) {
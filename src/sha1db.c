@@ -0,0 +1,227 @@
+/*
+  Copyright 2011-2015 James Hunt <james@jameshunt.us>
+
+  This file is part of Clockwork.
+
+  Clockwork is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Clockwork is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Clockwork.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "sha1db.h"
+
+/* checksums are remembered per inode, along with the size and
+   (nanosecond) modification / change times the file had when it
+   was hashed; if any of those differ, the file is hashed again.
+   files changed during the second they were hashed in are never
+   remembered, since a second change in that same second might
+   not show up in timestamps on filesystems with coarser clocks.
+   only checksums that were asked for get written back out, so
+   files that are no longer managed eventually drop out. */
+
+typedef struct {
+	unsigned long long dev;
+	unsigned long long ino;
+	long long          size;
+	long long          mtime; /* in nanoseconds */
+	long long          ctime; /* in nanoseconds */
+	char               hex[41];
+	int                used;  /* looked up / hashed this time around? */
+} sha1ent_t;
+
+static char* s_key(unsigned long long dev, unsigned long long ino)
+{
+	return string("%llu:%llu", dev, ino);
+}
+
+static long long s_ns(const struct timespec *ts)
+{
+	return (long long)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static void s_fill(sha1ent_t *ent, const struct stat *st)
+{
+	ent->dev   = st->st_dev;
+	ent->ino   = st->st_ino;
+	ent->size  = st->st_size;
+	ent->mtime = s_ns(&st->st_mtim);
+	ent->ctime = s_ns(&st->st_ctim);
+}
+
+static int s_same(const sha1ent_t *ent, const struct stat *st)
+{
+	return ent->dev   == (unsigned long long)st->st_dev
+	    && ent->ino   == (unsigned long long)st->st_ino
+	    && ent->size  == (long long)st->st_size
+	    && ent->mtime == s_ns(&st->st_mtim)
+	    && ent->ctime == s_ns(&st->st_ctim);
+}
+
+sha1db_t* sha1db_read(const char *file)
+{
+	assert(file); // LCOV_EXCL_LINE
+
+	sha1db_t *db = vmalloc(sizeof(sha1db_t));
+	db->file = strdup(file);
+
+	/* no index (yet) just means hashing everything */
+	FILE *io = fopen(file, "r");
+	if (!io)
+		return db;
+
+	char line[256];
+	while (fgets(line, sizeof(line), io)) {
+		sha1ent_t ent;
+		memset(&ent, 0, sizeof(ent));
+		if (sscanf(line, "%llu %llu %lld %lld %lld %40s",
+				&ent.dev, &ent.ino, &ent.size, &ent.mtime, &ent.ctime, ent.hex) != 6
+		 || strlen(ent.hex) != 40)
+			continue;
+
+		char *key = s_key(ent.dev, ent.ino);
+		if (!hash_get(&db->entries, key)) {
+			sha1ent_t *copy = vmalloc(sizeof(sha1ent_t));
+			memcpy(copy, &ent, sizeof(sha1ent_t));
+			hash_set(&db->entries, key, copy);
+		}
+		free(key);
+	}
+	fclose(io);
+
+	db->dirty = 0;
+	return db;
+}
+
+int sha1db_write(sha1db_t *db)
+{
+	assert(db); // LCOV_EXCL_LINE
+
+	char *key;
+	sha1ent_t *ent;
+	char *tmpfile = string("%s.%x", db->file, rand());
+
+	FILE *io = fopen(tmpfile, "w");
+	if (!io)
+		goto bail;
+
+	fchmod(fileno(io), 0600);
+	for_each_key_value(&db->entries, key, ent) {
+		if (ent->used)
+			fprintf(io, "%llu %llu %lld %lld %lld %s\n",
+				ent->dev, ent->ino, ent->size, ent->mtime, ent->ctime, ent->hex);
+	}
+
+	if (fclose(io) != 0) {
+		unlink(tmpfile);
+		goto bail;
+	}
+	if (cw_frename(tmpfile, db->file) != 0) {
+		unlink(tmpfile);
+		goto bail;
+	}
+
+	free(tmpfile);
+	db->dirty = 0;
+	return 0;
+
+bail:
+	free(tmpfile);
+	return -1;
+}
+
+int sha1db_commit(sha1db_t *db)
+{
+	assert(db); // LCOV_EXCL_LINE
+
+	if (db->dirty)
+		return sha1db_write(db);
+
+	char *key;
+	sha1ent_t *ent;
+	for_each_key_value(&db->entries, key, ent) {
+		if (!ent->used)
+			return sha1db_write(db);
+	}
+	return 0;
+}
+
+void sha1db_close(sha1db_t *db)
+{
+	if (!db) return;
+
+	hash_done(&db->entries, 1);
+	free(db->file);
+	free(db);
+}
+
+int sha1db_file(sha1db_t *db, sha1_t *sha1, const char *path)
+{
+	assert(db);   // LCOV_EXCL_LINE
+	assert(sha1); // LCOV_EXCL_LINE
+	assert(path); // LCOV_EXCL_LINE
+
+	struct stat before, after;
+	if (stat(path, &before) != 0)
+		return -1;
+
+	char *key = s_key(before.st_dev, before.st_ino);
+	sha1ent_t *ent = hash_get(&db->entries, key);
+	if (ent && s_same(ent, &before)) {
+		ent->used = 1;
+		sha1_init(sha1, ent->hex);
+		free(key);
+		return 0;
+	}
+
+	time_t start = time(NULL);
+	int rc = sha1_file(sha1, path);
+	if (rc != 0) {
+		free(key);
+		return rc;
+	}
+
+	/* only remember checksums of files that sat still while
+	   we read them, and weren't touched in the same second */
+	if (stat(path, &after) == 0
+	 && after.st_dev == before.st_dev && after.st_ino == before.st_ino
+	 && after.st_size == before.st_size
+	 && s_ns(&after.st_mtim) == s_ns(&before.st_mtim)
+	 && s_ns(&after.st_ctim) == s_ns(&before.st_ctim)
+	 && before.st_mtime < start && before.st_ctime < start) {
+		if (!ent) {
+			ent = vmalloc(sizeof(sha1ent_t));
+			hash_set(&db->entries, key, ent);
+		}
+		s_fill(ent, &before);
+		memcpy(ent->hex, sha1->hex, sizeof(ent->hex));
+		ent->hex[40] = '\0';
+		ent->used = 1;
+		db->dirty = 1;
+
+	} else if (ent) {
+		/* out of date, and we can't replace it */
+		ent->used = 0;
+	}
+
+	free(key);
+	return 0;
+}
@@ -0,0 +1,38 @@
+/*
+  Copyright 2011-2015 James Hunt <james@jameshunt.us>
+
+  This file is part of Clockwork.
+
+  Clockwork is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Clockwork is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Clockwork.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SHA1DB_H
+#define SHA1DB_H
+
+#include "clockwork.h"
+
+typedef struct {
+	char   *file;
+	int     dirty;   /* checksums added / dropped since last written? */
+	hash_t  entries; /* "dev:inode" -> last known checksum */
+} sha1db_t;
+
+sha1db_t* sha1db_read(const char *file);
+int sha1db_write(sha1db_t *db);
+int sha1db_commit(sha1db_t *db);
+void sha1db_close(sha1db_t *db);
+
+int sha1db_file(sha1db_t *db, sha1_t *sha1, const char *path);
+
+#endif
@@ -27,6 +27,18 @@
 
 /** STATIC functions used only by other, non-static functions in this file **/
 
+/* note a source of the manifest (a file, or the expansion of a glob),
+   so that a precompiled manifest can tell when it has gone stale */
+static void lexer_track_source(spec_parser_context *ctx, char type, const char *path, int rc, sha1_t *sha1)
+{
+	if (!ctx->sources) return;
+
+	/* a source we couldn't checksum can never be proven current */
+	char *s = string("%s %c %s", rc == 0 ? sha1->hex : "-", type, path);
+	strings_add(ctx->sources, s);
+	free(s);
+}
+
 static FILE* lexer_open(const char *path, spec_parser_context *ctx)
 {
 	FILE *io;
@@ -98,6 +110,11 @@ static void lexer_process_file(const char *path, spec_parser_context *ctx)
 		return; /* bail; lexer_check_file already printed warnings */
 	}
 
+	if (ctx->sources) {
+		sha1_t sha1;
+		lexer_track_source(ctx, 'f', path, sha1_file(&sha1, path), &sha1);
+	}
+
 	buf = yy_create_buffer(io, YY_BUF_SIZE, ctx->scanner);
 	yypush_buffer_state(buf, ctx->scanner);
 
@@ -144,6 +161,25 @@ void spec_parser_error(void *user, const char *fmt, ...)
 	ctx->errors++;
 }
 
+/**
+  Checksum the list of $paths that a glob expanded to.
+
+  $paths is NULL-terminated, as in glob_t's gl_pathv.  A NULL $paths
+  represents a glob that matched nothing.
+
+  On success, returns 0.  On failure, returns non-zero.
+ */
+int spec_glob_sha1(sha1_t *sha1, char **paths)
+{
+	strings_t *list = strings_new(paths);
+	char *s = strings_join(list, "\n");
+	int rc = sha1_data(sha1, s, strlen(s));
+
+	strings_free(list);
+	free(s);
+	return rc;
+}
+
 void spec_parser_warning(void *user, const char *fmt, ...)
 {
 	char buf[256];
@@ -175,6 +211,12 @@ void lexer_include_file(const char *path, spec_parser_context *ctx)
 	}
 
 	rc = glob(full_path, GLOB_MARK, NULL, &expansion);
+	if (ctx->sources && strpbrk(full_path, "*?[")) {
+		/* files added to (or removed from) a glob change the manifest */
+		sha1_t sha1;
+		lexer_track_source(ctx, 'g', full_path,
+			spec_glob_sha1(&sha1, rc == 0 ? expansion.gl_pathv : NULL), &sha1);
+	}
 	free(full_path);
 
 	switch (rc) {
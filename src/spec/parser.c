@@ -18,6 +18,8 @@
  */
 
 #include <stdio.h>
+#include <string.h>
+#include <glob.h>
 #include <sys/stat.h>
 
 #include "private.h"
@@ -62,6 +64,7 @@ struct manifest* parse_file(const char *path)
 	ctx.file = NULL;
 	ctx.warnings = ctx.errors = 0;
 	ctx.files = strings_new(NULL);
+	ctx.sources = strings_new(NULL);
 	list_init(&ctx.fseen);
 
 	yylex_init_extra(&ctx, &ctx.scanner);
@@ -77,14 +80,120 @@ struct manifest* parse_file(const char *path)
 	}
 
 	if (ctx.errors > 0) {
+		strings_free(ctx.sources);
 		return NULL;
 	}
 
+	manifest->sources = ctx.sources;
+	manifest_intern(manifest);
+
 	if (_manifest_expand(manifest) != 0) {
 		manifest_free(manifest);
 		return NULL;
 	}
 
+	if (manifest_compile(manifest) != 0) {
+		manifest_free(manifest);
+		return NULL;
+	}
+
 	return manifest;
 }
 
+/* split source "SHA1 TYPE PATH" into its parts */
+static int _source_parse(const char *source, char *hex, size_t len, char *type, const char **path)
+{
+	const char *sp = strchr(source, ' ');
+	if (!sp || sp - source != len - 1 || sp[1] == '\0' || sp[2] != ' ')
+		return 1;
+
+	memcpy(hex, source, len - 1);
+	hex[len - 1] = '\0';
+	*type = sp[1];
+	*path = sp + 3;
+	return 0;
+}
+
+/* does the source "SHA1 TYPE PATH" still have the same checksum? */
+static int _source_current(const char *source)
+{
+	sha1_t sha1;
+	char hex[sizeof(sha1.hex)], type;
+	const char *path;
+	glob_t expansion;
+	int rc;
+
+	if (_source_parse(source, hex, sizeof(hex), &type, &path) != 0)
+		return 0;
+
+	switch (type) {
+	case 'f':
+		rc = sha1_file(&sha1, path);
+		break;
+
+	case 'g':
+		switch (glob(path, GLOB_MARK, NULL, &expansion)) {
+		case 0:
+			rc = spec_glob_sha1(&sha1, expansion.gl_pathv);
+			globfree(&expansion);
+			break;
+		case GLOB_NOMATCH:
+			rc = spec_glob_sha1(&sha1, NULL);
+			break;
+		default:
+			return 0;
+		}
+		break;
+
+	default:
+		return 0;
+	}
+
+	return rc == 0 && strcmp(hex, sha1.hex) == 0;
+}
+
+int parse_current(struct manifest *m, const char *path)
+{
+	sha1_t sha1;
+	char hex[sizeof(sha1.hex)], type;
+	const char *top;
+	size_t i;
+
+	if (!m->sources || m->sources->num == 0)
+		return 0;
+
+	/* the first source is always the top-level file */
+	if (_source_parse(m->sources->strings[0], hex, sizeof(hex), &type, &top) != 0
+	 || type != 'f' || strcmp(top, path) != 0)
+		return 0;
+
+	for (i = 0; i < m->sources->num; i++)
+		if (!_source_current(m->sources->strings[i]))
+			return 0;
+
+	return 1;
+}
+
+struct manifest* parse_cached(const char *path, const char *cache)
+{
+	struct manifest *manifest;
+
+	if (!cache || !*cache)
+		return parse_file(path);
+
+	manifest = manifest_read(cache);
+	if (manifest) {
+		if (parse_current(manifest, path)) {
+			logger(LOG_INFO, "Loaded precompiled manifest %s", cache);
+			return manifest;
+		}
+		logger(LOG_INFO, "Precompiled manifest %s is out of date", cache);
+		manifest_free(manifest);
+	}
+
+	manifest = parse_file(path);
+	if (manifest && manifest_write(manifest, cache) != 0)
+		logger(LOG_WARNING, "Unable to save precompiled manifest to %s", cache);
+
+	return manifest;
+}
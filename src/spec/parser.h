@@ -24,4 +24,14 @@
    AST_OP_PROG node that contains all policy definitions */
 struct manifest* parse_file(const char *path);
 
+/* Like parse_file, but load a precompiled manifest image
+   from $cache instead, if none of the files it was parsed
+   from have changed since.  Otherwise, parse $path and
+   (re-)write the image to $cache for next time. */
+struct manifest* parse_cached(const char *path, const char *cache);
+
+/* Returns non-zero if manifest $m was parsed from $path, and
+   none of the files that went into it have changed since. */
+int parse_current(struct manifest *m, const char *path);
+
 #endif
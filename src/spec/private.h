@@ -88,6 +88,7 @@ typedef struct {
 	const char        *file;     /* Name of the current file being parsed */
 	strings_t         *files;    /* "Stack" of file names processed so far */
 	list_t             fseen;    /* List of device ID / inode pairs already include'd */
+	strings_t         *sources;  /* "SHA1 TYPE PATH" of every file / glob read */
 
 	struct manifest *root;
 } spec_parser_context;
@@ -138,6 +139,7 @@ int yyparse(spec_parser_context*);
 /* Defined in lexer.l */
 void spec_parser_error(void *ctx, const char *fmt, ...);
 void spec_parser_warning(void *ctx, const char *fmt, ...);
+int spec_glob_sha1(sha1_t *sha1, char **paths);
 #define yyerror spec_parser_error
 
 void lexer_include_file(const char *path, spec_parser_context*);
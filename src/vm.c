@@ -28,8 +28,11 @@
 #include <sys/types.h>
 #include <sys/sysmacros.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <dirent.h>
+#include <poll.h>
 
 #define OPCODES_INTERPRETER
 #include <augeas.h>
@@ -769,6 +772,136 @@ static void op_swap(vm_t *vm)
 	REG1(vm) ^= REG2(vm);
 }
 
+/* rather than fork a shell (and cw, and cw-localsys) for every
+   localsys call, keep one `localsys.cmd serve` helper running for
+   the whole run, and talk to it over a pair of pipes, one request
+   (and one response) per line.  see cw-localsys(8) */
+static void s_localsys_stop(vm_t *vm)
+{
+	if (!vm->aux.localsys.pid)
+		return;
+
+	/* closing its stdin tells the helper to exit */
+	fclose(vm->aux.localsys.in);
+	fclose(vm->aux.localsys.out);
+	waitpid(vm->aux.localsys.pid, NULL, 0);
+
+	vm->aux.localsys.pid = 0;
+	vm->aux.localsys.in  = NULL;
+	vm->aux.localsys.out = NULL;
+}
+
+static int s_localsys_start(vm_t *vm)
+{
+	int in[2], out[2];
+	if (pipe(in) != 0)
+		return -1;
+	if (pipe(out) != 0) {
+		close(in[0]); close(in[1]);
+		return -1;
+	}
+
+	char *cmd = string("%s serve", hash_get(&vm->pragma, "localsys.cmd"));
+	pid_t pid = fork();
+	switch (pid) {
+	case -1:
+		free(cmd);
+		close(in[0]);  close(in[1]);
+		close(out[0]); close(out[1]);
+		return -1;
+
+	case 0: /* in child */
+		close(in[1]);
+		close(out[0]);
+		dup2(in[0],  0); close(in[0]);
+		dup2(out[1], 1); close(out[1]);
+		close(2); open("/dev/null", O_WRONLY);
+
+		execl("/bin/sh", "sh", "-c", cmd, NULL);
+		exit(127); /* if execl returns, we failed */
+
+	default: /* in parent */
+		free(cmd);
+		close(in[0]);
+		close(out[1]);
+		fcntl(in[1],  F_SETFD, FD_CLOEXEC);
+		fcntl(out[0], F_SETFD, FD_CLOEXEC);
+
+		vm->aux.localsys.pid = pid;
+		vm->aux.localsys.in  = fdopen(in[1],  "w");
+		vm->aux.localsys.out = fdopen(out[0], "r");
+	}
+
+	char line[64];
+	if (!fgets(line, sizeof(line), vm->aux.localsys.out)
+	 || strcmp(line, "ready\n") != 0) {
+		logger(LOG_INFO, "localsys helper failed to start; falling back to running commands one at a time");
+		s_localsys_stop(vm);
+		return -1;
+	}
+	return 0;
+}
+
+/* returns the exit code of the request, with the first line of
+   its output in `line`, or -1 if the helper couldn't be asked.
+   once the request has been sent, it may well have been carried
+   out, so it must not be run again; if the reply doesn't make
+   sense after that, the request is answered as if cw-localsys
+   hadn't understood it (exit code 125, which no caller takes
+   for an answer), and the helper, which we can no longer trust
+   to be in step with us, is put out of its misery */
+static int s_localsys_ask(vm_t *vm, const char *request, char *line, size_t len)
+{
+	if (vm->aux.localsys.broken || strchr(request, '\n'))
+		return -1;
+
+	if (!vm->aux.localsys.pid && s_localsys_start(vm) != 0) {
+		vm->aux.localsys.broken = 1;
+		return -1;
+	}
+
+	/* don't let a dead helper take us down with it */
+	void (*sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+	int ok = fprintf(vm->aux.localsys.in, "%s\n", request) > 0
+	      && fflush(vm->aux.localsys.in) == 0;
+	signal(SIGPIPE, sigpipe);
+
+	if (!ok) {
+		logger(LOG_WARNING, "localsys helper went away; falling back to running commands one at a time");
+		s_localsys_stop(vm);
+		vm->aux.localsys.broken = 1;
+		return -1;
+	}
+
+	char *rest;
+	long rc = -1;
+	if (fgets(line, len, vm->aux.localsys.out)) {
+		/* skip the rest of overly long replies, to stay in step */
+		size_t n = strlen(line);
+		int c = '\n';
+		if (n > 0 && line[n - 1] != '\n')
+			while ((c = fgetc(vm->aux.localsys.out)) != EOF && c != '\n')
+				;
+
+		rc = strtol(line, &rest, 10);
+		if (c != '\n' || rest == line || *rest != ' ' || rc < 0)
+			rc = -1;
+		else
+			memmove(line, rest + 1, strlen(rest + 1) + 1);
+	}
+
+	if (rc < 0) {
+		logger(LOG_WARNING, "%s: no sensible reply from localsys helper for `%s'; "
+		                    "running commands one at a time from now on",
+			(vm->topic ? vm->topic : "(no topic)"), request);
+		s_localsys_stop(vm);
+		vm->aux.localsys.broken = 1;
+		line[0] = '\0';
+		return 125;
+	}
+	return (int)rc;
+}
+
 static void op_pragma(vm_t *vm)
 {
 	ARG2("pragma");
@@ -786,6 +919,21 @@ static void op_pragma(vm_t *vm)
 
 	} else if (strcmp(v, "timeout") == 0) {
 		vm->aux.timeout = VAL2(vm);
+
+	} else if (strcmp(v, "parallel") == 0) {
+		vm->aux.async.max = VAL2(vm);
+
+	} else if (strcmp(v, "localsys.cmd") == 0) {
+		/* custom localsys commands may not know how to serve;
+		   run them one-shot unless told otherwise (below).
+		   they are also the authority on what is installed */
+		s_localsys_stop(vm);
+		hash_set(&vm->pragma, "localsys.serve", "off");
+		hash_set(&vm->pragma, "pkgdb", "off");
+
+	} else if (strcmp(v, "localsys.serve") == 0) {
+		s_localsys_stop(vm);
+		vm->aux.localsys.broken = 0;
 	}
 }
 
@@ -856,6 +1004,195 @@ static void op_mod(vm_t *vm)
 	REG1(vm) %= VAL2(vm);
 }
 
+/* the stat cache remembers what lstat() said about each path
+   (including failures), so that the dozen-odd fs.* checks a file
+   resource makes only hit the filesystem once.  anything that
+   changes a path forgets it (and its parent directory, whose
+   mtime and link count change with it); anything that could
+   change paths we don't know about (exec, localsys, renames,
+   removals, changes made through symlinks, etc.) forgets
+   everything. */
+
+typedef struct {
+	int         err;  /* errno from lstat(), or 0 */
+	struct stat st;
+} statent_t;
+
+static int s_lstat(vm_t *vm, const char *path)
+{
+	statent_t *ent = hash_get(&vm->aux.statcache.paths, path);
+	if (ent) {
+		vm->aux.statcache.hits++;
+	} else {
+		vm->aux.statcache.misses++;
+		ent = vmalloc(sizeof(statent_t));
+		ent->err = lstat(path, &ent->st) == 0 ? 0 : errno;
+		hash_set(&vm->aux.statcache.paths, path, ent);
+	}
+
+	if (ent->err) {
+		errno = ent->err;
+		return -1;
+	}
+	memcpy(&vm->aux.stat, &ent->st, sizeof(struct stat));
+	return 0;
+}
+
+static void s_stat_forget(vm_t *vm, const char *path)
+{
+	free(hash_set(&vm->aux.statcache.paths, path, NULL));
+
+	char *parent = strdup(path);
+	char *slash = strrchr(parent, '/');
+	if (slash && slash != parent) {
+		*slash = '\0';
+		free(hash_set(&vm->aux.statcache.paths, parent, NULL));
+	} else if (slash) {
+		free(hash_set(&vm->aux.statcache.paths, "/", NULL));
+	}
+	free(parent);
+}
+
+static void s_stat_flush(vm_t *vm)
+{
+	hash_done(&vm->aux.statcache.paths, 1);
+	memset(&vm->aux.statcache.paths, 0, sizeof(hash_t));
+}
+
+/* for changes made through calls that follow symlinks (chmod(),
+   open(), etc.); if $path is a symlink, whatever it points at is
+   what changes, and that could be anywhere */
+static void s_stat_forget_target(vm_t *vm, const char *path)
+{
+	struct stat st;
+	if (lstat(path, &st) == 0 && S_ISLNK(st.st_mode))
+		s_stat_flush(vm);
+	else
+		s_stat_forget(vm, path);
+}
+
+/* workers are forked copies of the VM that each run one function
+   (i.e. a resource) to completion, while the parent VM gets on with
+   the next one.  when the function returns, the worker hands back
+   any flags it raised (so that dependent resources get notified)
+   over a pipe, and exits with the function's return value. */
+
+static void s_worker_exit(vm_t *vm)
+{
+	FILE *io = fdopen(vm->aux.async.fd, "w");
+	if (io) {
+		int i;
+		for (i = 0; i < vm->aux.async.raised->num; i++)
+			fprintf(io, "%s\n", vm->aux.async.raised->strings[i]);
+		fclose(io);
+	}
+
+	s_localsys_stop(vm);
+	fflush(NULL);
+	_exit(vm->acc > 255 ? 255 : vm->acc);
+}
+
+static int s_worker_reap(vm_t *vm, worker_t *w)
+{
+	char flag[8192];
+	FILE *io = fdopen(w->fd, "r");
+	if (io) {
+		while (fgets(flag, sizeof(flag), io)) {
+			char *nl = strchr(flag, '\n'); if (nl) *nl = '\0';
+			if (*flag)
+				hash_set(&vm->flags, flag, "Y");
+		}
+		fclose(io);
+	} else {
+		close(w->fd);
+	}
+
+	/* we have no idea what the worker changed */
+	s_stat_flush(vm);
+
+	int status, rc = 1;
+	if (waitpid(w->pid, &status, 0) == w->pid && WIFEXITED(status))
+		rc = WEXITSTATUS(status);
+
+	list_delete(&w->l);
+	free(w);
+	return rc;
+}
+
+/* block until one of the workers finishes */
+static worker_t* s_worker_next(vm_t *vm)
+{
+	worker_t *w, *done = NULL;
+	size_t i = 0, n = list_len(&vm->aux.async.workers);
+	struct pollfd *fds = vcalloc(n, sizeof(struct pollfd));
+
+	for_each_object(w, &vm->aux.async.workers, l) {
+		fds[i].fd = w->fd;
+		fds[i].events = POLLIN;
+		i++;
+	}
+	while (poll(fds, n, -1) < 0 && errno == EINTR)
+		;
+
+	i = 0;
+	for_each_object(w, &vm->aux.async.workers, l) {
+		if (fds[i++].revents) {
+			done = w;
+			break;
+		}
+	}
+	free(fds);
+	return done ? done : list_head(&vm->aux.async.workers, worker_t, l);
+}
+
+static void s_worker_start(vm_t *vm)
+{
+	int fds[2];
+	if (pipe(fds) != 0)
+		return;
+
+	fflush(NULL);
+	pid_t pid = fork();
+	switch (pid) {
+	case -1:
+		close(fds[0]);
+		close(fds[1]);
+		return;
+
+	case 0: /* in worker */
+		close(fds[0]);
+		fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+		vm->aux.async.ret    = vm->pc;
+		vm->aux.async.fd     = fds[1];
+		vm->aux.async.raised = strings_new(NULL);
+		list_init(&vm->aux.async.workers); /* not ours to reap */
+
+		/* the parent's localsys helper, package queue and
+		   connection to the master are no use to us */
+		if (vm->aux.localsys.pid) {
+			fclose(vm->aux.localsys.in);
+			fclose(vm->aux.localsys.out);
+			vm->aux.localsys.pid = 0;
+		}
+		list_init(&vm->aux.pkgq);
+		memset(&vm->aux.pkgheld, 0, sizeof(hash_t));
+		vm->aux.pkgbatch = 0;
+		vm->aux.remote = NULL;
+		return;
+
+	default: /* in parent */
+		close(fds[1]);
+		fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+		worker_t *w = vmalloc(sizeof(worker_t));
+		w->pid = pid;
+		w->fn  = vm->oper1;
+		w->fd  = fds[0];
+		list_push(&vm->aux.async.workers, &w->l);
+		return;
+	}
+}
+
 static void op_call(vm_t *vm)
 {
 	ARG1("call");
@@ -882,6 +1219,56 @@ static void op_try(vm_t *vm)
 	vm->pc = vm->oper1;
 }
 
+static void op_async(vm_t *vm)
+{
+	ARG1("async");
+	if (!is_address(vm->f1))
+		B_ERR("async requires an address for operand 1");
+
+	/* workers don't start workers of their own */
+	if (vm->aux.async.max > 1 && !vm->aux.async.ret) {
+		while (list_len(&vm->aux.async.workers) >= (size_t)vm->aux.async.max)
+			vm->aux.async.failed += s_worker_reap(vm, s_worker_next(vm));
+
+		size_t n = list_len(&vm->aux.async.workers);
+		s_worker_start(vm);
+		if (list_len(&vm->aux.async.workers) > n) {
+			vm->acc = 0;
+			return;
+		}
+		/* in the worker (or couldn't fork one); run it here */
+	}
+
+	op_try(vm);
+}
+
+static void op_await(vm_t *vm)
+{
+	ARG1("await");
+	if (!is_address(vm->f1))
+		B_ERR("await requires an address for operand 1");
+
+	worker_t *w;
+	vm->acc = 0;
+	for_each_object(w, &vm->aux.async.workers, l) {
+		if (w->fn == vm->oper1) {
+			vm->acc = s_worker_reap(vm, w);
+			return;
+		}
+	}
+}
+
+static void op_await_all(vm_t *vm)
+{
+	ARG0("await.all");
+
+	worker_t *w, *tmp;
+	vm->acc = vm->aux.async.failed;
+	for_each_object_safe(w, tmp, &vm->aux.async.workers, l)
+		vm->acc += s_worker_reap(vm, w);
+	vm->aux.async.failed = 0;
+}
+
 static void op_ret(vm_t *vm)
 {
 	if (vm->f1) {
@@ -901,6 +1288,9 @@ static void op_ret(vm_t *vm)
 	if (vm->tryc == vm->pc)
 		vm->tryc = s_pop(vm, &vm->tstack);
 	s_restore_state(vm);
+
+	if (vm->aux.async.ret && vm->pc == vm->aux.async.ret)
+		s_worker_exit(vm);
 }
 
 static void op_bail(vm_t *vm)
@@ -920,6 +1310,9 @@ static void op_bail(vm_t *vm)
 	}
 
 	vm->tryc = s_pop(vm, &vm->tstack);
+
+	if (vm->aux.async.ret && vm->pc == vm->aux.async.ret)
+		s_worker_exit(vm);
 }
 
 static void op_eq(vm_t *vm)
@@ -1014,6 +1407,32 @@ static void op_syslog(vm_t *vm)
 static void op_flag(vm_t *vm)
 {
 	ARG1("flag");
+
+	if (vm->aux.async.raised)
+		strings_add(vm->aux.async.raised, STR1(vm));
+
+	/* flags raised on behalf of a queued package operation are
+	   taken back if it fails (see op_pkg_flush), unless something
+	   else raised them too: another queued operation that didn't
+	   fail, another resource, or whatever raised them beforehand */
+	if (!list_isempty(&vm->aux.pkgq)) {
+		pkgop_t *op, *tail = list_object(vm->aux.pkgq.prev, pkgop_t, l);
+		if (vm->topic && tail->topic && strcmp(tail->topic, vm->topic) == 0) {
+			if (hash_get(&vm->flags, STR1(vm))) {
+				int queued = 0;
+				for_each_object(op, &vm->aux.pkgq, l)
+					if (strings_search(op->flags, STR1(vm)) == 0)
+						queued = 1;
+				if (!queued)
+					hash_set(&vm->aux.pkgheld, STR1(vm), "Y");
+			}
+			if (strings_search(tail->flags, STR1(vm)) != 0)
+				strings_add(tail->flags, STR1(vm));
+
+		} else {
+			hash_set(&vm->aux.pkgheld, STR1(vm), "Y");
+		}
+	}
 	hash_set(&vm->flags, STR1(vm), "Y");
 }
 
@@ -1032,14 +1451,14 @@ static void op_flagged_p(vm_t *vm)
 static void op_fs_stat(vm_t *vm)
 {
 	ARG1("fs.stat");
-	vm->acc = lstat(STR1(vm), &vm->aux.stat);
+	vm->acc = s_lstat(vm, STR1(vm));
 }
 
 static void op_fs_type(vm_t *vm)
 {
 	ARG2("fs.type");
 	REGISTER2("fs.type");
-	vm->acc = lstat(STR1(vm), &vm->aux.stat);
+	vm->acc = s_lstat(vm, STR1(vm));
 	if (vm->acc != 0) {
 		REG2(vm) = vm_heap_strdup(vm, "non-existent file");
 	} else if (S_ISREG(vm->aux.stat.st_mode)) {
@@ -1064,49 +1483,49 @@ static void op_fs_type(vm_t *vm)
 static void op_fs_file_p(vm_t *vm)
 {
 	ARG1("fs.file?");
-	vm->acc = lstat(STR1(vm), &vm->aux.stat);
+	vm->acc = s_lstat(vm, STR1(vm));
 	if (vm->acc == 0) vm->acc = S_ISREG(vm->aux.stat.st_mode) ? 0 : 1;
 }
 
 static void op_fs_symlink_p(vm_t *vm)
 {
 	ARG1("fs.symlink?");
-	vm->acc = lstat(STR1(vm), &vm->aux.stat);
+	vm->acc = s_lstat(vm, STR1(vm));
 	if (vm->acc == 0) vm->acc = S_ISLNK(vm->aux.stat.st_mode) ? 0 : 1;
 }
 
 static void op_fs_dir_p(vm_t *vm)
 {
 	ARG1("fs.dir?");
-	vm->acc = lstat(STR1(vm), &vm->aux.stat);
+	vm->acc = s_lstat(vm, STR1(vm));
 	if (vm->acc == 0) vm->acc = S_ISDIR(vm->aux.stat.st_mode) ? 0 : 1;
 }
 
 static void op_fs_chardev_p(vm_t *vm)
 {
 	ARG1("fs.chardev?");
-	vm->acc = lstat(STR1(vm), &vm->aux.stat);
+	vm->acc = s_lstat(vm, STR1(vm));
 	if (vm->acc == 0) vm->acc = S_ISCHR(vm->aux.stat.st_mode) ? 0 : 1;
 }
 
 static void op_fs_blockdev_p(vm_t *vm)
 {
 	ARG1("fs.blockdev?");
-	vm->acc = lstat(STR1(vm), &vm->aux.stat);
+	vm->acc = s_lstat(vm, STR1(vm));
 	if (vm->acc == 0) vm->acc = S_ISBLK(vm->aux.stat.st_mode) ? 0 : 1;
 }
 
 static void op_fs_fifo_p(vm_t *vm)
 {
 	ARG1("fs.fifo?");
-	vm->acc = lstat(STR1(vm), &vm->aux.stat);
+	vm->acc = s_lstat(vm, STR1(vm));
 	if (vm->acc == 0) vm->acc = S_ISFIFO(vm->aux.stat.st_mode) ? 0 : 1;
 }
 
 static void op_fs_socket_p(vm_t *vm)
 {
 	ARG1("fs.socket?");
-	vm->acc = lstat(STR1(vm), &vm->aux.stat);
+	vm->acc = s_lstat(vm, STR1(vm));
 	if (vm->acc == 0) vm->acc = S_ISSOCK(vm->aux.stat.st_mode) ? 0 : 1;
 }
 
@@ -1115,7 +1534,7 @@ static void op_fs_readlink(vm_t *vm)
 	ARG2("fs.readlink");
 	REGISTER2("fs.readlink");
 
-	vm->acc = lstat(STR1(vm), &vm->aux.stat);
+	vm->acc = s_lstat(vm, STR1(vm));
 	if (vm->acc != 0) return;
 
 	vm->acc = S_ISLNK(vm->aux.stat.st_mode) ? 0 : 1;
@@ -1138,7 +1557,7 @@ static void op_fs_dev(vm_t *vm)
 	ARG2("fs.dev");
 	REGISTER2("fs.dev");
 
-	vm->acc = lstat(STR1(vm), &vm->aux.stat);
+	vm->acc = s_lstat(vm, STR1(vm));
 	if (vm->acc == 0) REG2(vm) = vm->aux.stat.st_dev;
 }
 
@@ -1147,7 +1566,7 @@ static void op_fs_inode(vm_t *vm)
 	ARG2("fs.inode");
 	REGISTER2("fs.inode");
 
-	vm->acc = lstat(STR1(vm), &vm->aux.stat);
+	vm->acc = s_lstat(vm, STR1(vm));
 	if (vm->acc == 0) REG2(vm) = vm->aux.stat.st_ino;
 }
 
@@ -1156,7 +1575,7 @@ static void op_fs_mode(vm_t *vm)
 	ARG2("fs.mode");
 	REGISTER2("fs.mode");
 
-	vm->acc = lstat(STR1(vm), &vm->aux.stat);
+	vm->acc = s_lstat(vm, STR1(vm));
 	if (vm->acc == 0) REG2(vm) = vm->aux.stat.st_mode & 07777;
 }
 
@@ -1165,7 +1584,7 @@ static void op_fs_nlink(vm_t *vm)
 	ARG2("fs.nlink");
 	REGISTER2("fs.nlink");
 
-	vm->acc = lstat(STR1(vm), &vm->aux.stat);
+	vm->acc = s_lstat(vm, STR1(vm));
 	if (vm->acc == 0) REG2(vm) = vm->aux.stat.st_nlink;
 }
 
@@ -1174,7 +1593,7 @@ static void op_fs_uid(vm_t *vm)
 	ARG2("fs.uid");
 	REGISTER2("fs.uid");
 
-	vm->acc = lstat(STR1(vm), &vm->aux.stat);
+	vm->acc = s_lstat(vm, STR1(vm));
 	if (vm->acc == 0) REG2(vm) = vm->aux.stat.st_uid;
 }
 
@@ -1183,7 +1602,7 @@ static void op_fs_gid(vm_t *vm)
 	ARG2("fs.gid");
 	REGISTER2("fs.gid");
 
-	vm->acc = lstat(STR1(vm), &vm->aux.stat);
+	vm->acc = s_lstat(vm, STR1(vm));
 	if (vm->acc == 0) REG2(vm) = vm->aux.stat.st_gid;
 }
 
@@ -1192,7 +1611,7 @@ static void op_fs_major(vm_t *vm)
 	ARG2("fs.major");
 	REGISTER2("fs.major");
 
-	vm->acc = lstat(STR1(vm), &vm->aux.stat);
+	vm->acc = s_lstat(vm, STR1(vm));
 	if (vm->acc == 0) REG2(vm) = major(vm->aux.stat.st_rdev);
 }
 
@@ -1201,7 +1620,7 @@ static void op_fs_minor(vm_t *vm)
 	ARG2("fs.minor");
 	REGISTER2("fs.minor");
 
-	vm->acc = lstat(STR1(vm), &vm->aux.stat);
+	vm->acc = s_lstat(vm, STR1(vm));
 	if (vm->acc == 0) REG2(vm) = minor(vm->aux.stat.st_rdev);
 }
 
@@ -1210,7 +1629,7 @@ static void op_fs_size(vm_t *vm)
 	ARG2("fs.size");
 	REGISTER2("fs.size");
 
-	vm->acc = lstat(STR1(vm), &vm->aux.stat);
+	vm->acc = s_lstat(vm, STR1(vm));
 	if (vm->acc == 0) REG2(vm) = vm->aux.stat.st_size;
 }
 
@@ -1219,7 +1638,7 @@ static void op_fs_atime(vm_t *vm)
 	ARG2("fs.atime");
 	REGISTER2("fs.atime");
 
-	vm->acc = lstat(STR1(vm), &vm->aux.stat);
+	vm->acc = s_lstat(vm, STR1(vm));
 	if (vm->acc == 0) REG2(vm) = vm->aux.stat.st_atime;
 }
 
@@ -1228,7 +1647,7 @@ static void op_fs_mtime(vm_t *vm)
 	ARG2("fs.mtime");
 	REGISTER2("fs.mtime");
 
-	vm->acc = lstat(STR1(vm), &vm->aux.stat);
+	vm->acc = s_lstat(vm, STR1(vm));
 	if (vm->acc == 0) REG2(vm) = vm->aux.stat.st_mtime;
 }
 
@@ -1237,32 +1656,35 @@ static void op_fs_ctime(vm_t *vm)
 	ARG2("fs.ctime");
 	REGISTER2("fs.ctime");
 
-	vm->acc = lstat(STR1(vm), &vm->aux.stat);
+	vm->acc = s_lstat(vm, STR1(vm));
 	if (vm->acc == 0) REG2(vm) = vm->aux.stat.st_ctime;
 }
 
 static void op_fs_touch(vm_t *vm)
 {
 	ARG1("fs.touch");
+	s_stat_forget_target(vm, STR1(vm));
 	vm->acc = close(open(STR1(vm), O_CREAT, 0666));
 }
 
 static void op_fs_mkdir(vm_t *vm)
 {
 	ARG1("fs.mkdir");
+	s_stat_forget(vm, STR1(vm));
 	vm->acc = mkdir(STR1(vm), 0777);
 }
 
 static void op_fs_symlink(vm_t *vm)
 {
 	ARG2("fs.symlink");
+	s_stat_flush(vm);
 	vm->acc = symlink(STR1(vm), STR2(vm));
 }
 
 static void op_fs_link(vm_t *vm)
 {
 	ARG2("fs.link");
-	vm->acc = lstat(STR1(vm), &vm->aux.stat);
+	vm->acc = s_lstat(vm, STR1(vm));
 	if (vm->acc != 0) return;
 
 	if (S_ISDIR(vm->aux.stat.st_mode)) {
@@ -1271,48 +1693,57 @@ static void op_fs_link(vm_t *vm)
 		return;
 	}
 
+	s_stat_forget(vm, STR1(vm));
+	s_stat_forget(vm, STR2(vm));
 	vm->acc = link(STR1(vm), STR2(vm));
 }
 
 static void op_fs_unlink(vm_t *vm)
 {
 	ARG1("fs.unlink");
+	s_stat_flush(vm);
 	vm->acc = unlink(STR1(vm));
 }
 
 static void op_fs_rmdir(vm_t *vm)
 {
 	ARG1("fs.rmdir");
+	s_stat_flush(vm);
 	vm->acc = rmdir(STR1(vm));
 }
 
 static void op_fs_rename(vm_t *vm)
 {
 	ARG2("fs.rename");
+	s_stat_flush(vm);
 	vm->acc = rename(STR1(vm), STR2(vm));
 }
 
 static void op_fs_copy(vm_t *vm)
 {
 	ARG2("fs.copy");
+	s_stat_forget_target(vm, STR2(vm));
 	vm->acc = s_copy(STR1(vm), STR2(vm));
 }
 
 static void op_fs_chown(vm_t *vm)
 {
 	ARG2("fs.chown");
+	s_stat_forget(vm, STR1(vm));
 	vm->acc = lchown(STR1(vm), VAL2(vm), -1);
 }
 
 static void op_fs_chgrp(vm_t *vm)
 {
 	ARG2("fs.chgrp");
+	s_stat_forget(vm, STR1(vm));
 	vm->acc = lchown(STR1(vm), -1, VAL2(vm));
 }
 
 static void op_fs_chmod(vm_t *vm)
 {
 	ARG2("fs.chmod");
+	s_stat_forget_target(vm, STR1(vm));
 	vm->acc = chmod(STR1(vm), VAL2(vm) & 07777);
 }
 
@@ -1322,7 +1753,13 @@ static void op_fs_sha1(vm_t *vm)
 	REGISTER2("fs.cw_sha1");
 
 	sha1_t sha1;
-	vm->acc = sha1_file(&sha1, STR1(vm));
+	if (strcmp(hash_get(&vm->pragma, "sha1db"), "on") == 0) {
+		if (!vm->aux.sha1db)
+			vm->aux.sha1db = sha1db_read(hash_get(&vm->pragma, "sha1db.file"));
+		vm->acc = sha1db_file(vm->aux.sha1db, &sha1, STR1(vm));
+	} else {
+		vm->acc = sha1_file(&sha1, STR1(vm));
+	}
 	REG2(vm) = vm_heap_strdup(vm, sha1.hex);
 }
 
@@ -1340,6 +1777,7 @@ static void op_fs_get(vm_t *vm)
 static void op_fs_put(vm_t *vm)
 {
 	ARG2("fs.put");
+	s_stat_forget_target(vm, STR1(vm));
 	vm->acc = s_fs_put(STR1(vm), STR2(vm));
 }
 
@@ -1411,15 +1849,18 @@ static void op_authdb_open(vm_t *vm)
 {
 	ARG0("authdb.open");
 
-	authdb_close(vm->aux.authdb);
-	vm->aux.authdb = authdb_read(hash_get(&vm->pragma, "authdb.root"), AUTHDB_ALL);
+	/* the databases stay open (and changes accumulate)
+	   until the next authdb.close, or the end of the run */
+	if (!vm->aux.authdb)
+		vm->aux.authdb = authdb_read(hash_get(&vm->pragma, "authdb.root"), AUTHDB_ALL);
 	vm->acc = vm->aux.authdb != NULL ? 0 : 1;
 }
 
 static void op_authdb_save(vm_t *vm)
 {
 	ARG0("authdb.save");
-	vm->acc = authdb_write(vm->aux.authdb);
+	s_stat_flush(vm);
+	vm->acc = vm->aux.authdb ? authdb_commit(vm->aux.authdb) : 1;
 }
 
 static void op_authdb_close(vm_t *vm)
@@ -1522,6 +1963,23 @@ static void op_user_get(vm_t *vm)
 	}
 }
 
+/* update a user / group attribute, noting which of the databases
+   will need to be rewritten if (and only if) it actually changed */
+static void s_authdb_str(authdb_t *db, int dbs, char **field, const char *value)
+{
+	if (*field && strcmp(*field, value) == 0)
+		return;
+	free(*field);
+	*field = strdup(value);
+	db->dirty |= dbs;
+}
+#define s_authdb_num(db,dbs,field,value) do { \
+	if ((field) != (value)) { \
+		(field) = (value); \
+		(db)->dirty |= (dbs); \
+	} \
+} while (0)
+
 static void op_user_set(vm_t *vm)
 {
 	ARG2("user.set");
@@ -1532,54 +1990,49 @@ static void op_user_set(vm_t *vm)
 
 	vm->acc = 0;
 	const char *v = STR1(vm);
+	user_t *u = vm->aux.user;
 
 	if (strcmp(v, "uid") == 0) {
-		vm->aux.user->uid = VAL2(vm);
+		user_set_uid(u, VAL2(vm));
 
 	} else if (strcmp(v, "gid") == 0) {
-		vm->aux.user->gid = VAL2(vm);
+		s_authdb_num(u->db, AUTHDB_PASSWD, u->gid, VAL2(vm));
 
 	} else if (strcmp(v, "username") == 0) {
-		free(vm->aux.user->name);
-		vm->aux.user->name = strdup(STR2(vm));
+		user_set_name(u, STR2(vm));
 
 	} else if (strcmp(v, "comment") == 0) {
-		free(vm->aux.user->comment);
-		vm->aux.user->comment = strdup(STR2(vm));
+		s_authdb_str(u->db, AUTHDB_PASSWD, &u->comment, STR2(vm));
 
 	} else if (strcmp(v, "home") == 0) {
-		free(vm->aux.user->home);
-		vm->aux.user->home = strdup(STR2(vm));
+		s_authdb_str(u->db, AUTHDB_PASSWD, &u->home, STR2(vm));
 
 	} else if (strcmp(v, "shell") == 0) {
-		free(vm->aux.user->shell);
-		vm->aux.user->shell = strdup(STR2(vm));
+		s_authdb_str(u->db, AUTHDB_PASSWD, &u->shell, STR2(vm));
 
 	} else if (strcmp(v, "password") == 0) {
-		free(vm->aux.user->clear_pass);
-		vm->aux.user->clear_pass = strdup(STR2(vm));
+		s_authdb_str(u->db, AUTHDB_PASSWD, &u->clear_pass, STR2(vm));
 
 	} else if (strcmp(v, "pwhash") == 0) {
-		free(vm->aux.user->crypt_pass);
-		vm->aux.user->crypt_pass = strdup(STR2(vm));
+		s_authdb_str(u->db, AUTHDB_SHADOW, &u->crypt_pass, STR2(vm));
 
 	} else if (strcmp(v, "changed") == 0) {
-		vm->aux.user->creds.last_changed = VAL2(vm);
+		s_authdb_num(u->db, AUTHDB_SHADOW, u->creds.last_changed, VAL2(vm));
 
 	} else if (strcmp(v, "pwmin") == 0) {
-		vm->aux.user->creds.min_days = VAL2(vm);
+		s_authdb_num(u->db, AUTHDB_SHADOW, u->creds.min_days, VAL2(vm));
 
 	} else if (strcmp(v, "pwmax") == 0) {
-		vm->aux.user->creds.max_days = VAL2(vm);
+		s_authdb_num(u->db, AUTHDB_SHADOW, u->creds.max_days, VAL2(vm));
 
 	} else if (strcmp(v, "pwwarn") == 0) {
-		vm->aux.user->creds.warn_days = VAL2(vm);
+		s_authdb_num(u->db, AUTHDB_SHADOW, u->creds.warn_days, VAL2(vm));
 
 	} else if (strcmp(v, "inact") == 0) {
-		vm->aux.user->creds.grace_period = VAL2(vm);
+		s_authdb_num(u->db, AUTHDB_SHADOW, u->creds.grace_period, VAL2(vm));
 
 	} else if (strcmp(v, "expiry") == 0) {
-		vm->aux.user->creds.expiration = VAL2(vm);
+		s_authdb_num(u->db, AUTHDB_SHADOW, u->creds.expiration, VAL2(vm));
 
 	} else {
 		vm->acc = 1;
@@ -1654,21 +2107,19 @@ static void op_group_set(vm_t *vm)
 
 	vm->acc = 0;
 	const char *v = STR1(vm);
+	group_t *g = vm->aux.group;
 
 	if (strcmp(v, "gid") == 0) {
-		vm->aux.group->gid = VAL2(vm);
+		group_set_gid(g, VAL2(vm));
 
 	} else if (strcmp(v, "name") == 0) {
-		free(vm->aux.group->name);
-		vm->aux.group->name = strdup(STR2(vm));
+		group_set_name(g, STR2(vm));
 
 	} else if (strcmp(v, "password") == 0) {
-		free(vm->aux.group->clear_pass);
-		vm->aux.group->clear_pass = strdup(STR2(vm));
+		s_authdb_str(g->db, AUTHDB_GROUP, &g->clear_pass, STR2(vm));
 
 	} else if (strcmp(v, "pwhash") == 0) {
-		free(vm->aux.group->crypt_pass);
-		vm->aux.group->crypt_pass = strdup(STR2(vm));
+		s_authdb_str(g->db, AUTHDB_GSHADOW, &g->crypt_pass, STR2(vm));
 
 	} else {
 		vm->acc = 1;
@@ -1741,33 +2192,157 @@ static void op_group_kick(vm_t *vm)
 		user_find(vm->aux.authdb, STR2(vm), NO_UID));
 }
 
-static void op_augeas_init(vm_t *vm)
+static void op_hosts_open(vm_t *vm)
 {
-	ARG0("augeas.init");
-	vm->aux.augeas = aug_init(
-		hash_get(&vm->pragma, "augeas.root"),
-		hash_get(&vm->pragma, "augeas.libs"),
-		AUG_NO_STDINC|AUG_NO_LOAD|AUG_NO_MODL_AUTOLOAD);
+	ARG0("hosts.open");
 
-	if (!vm->aux.augeas) {
+	/* like the authdb, /etc/hosts stays open (and
+	   changes accumulate) until the next hosts.close */
+	if (!vm->aux.hostsdb)
+		vm->aux.hostsdb = hostsdb_read(hash_get(&vm->pragma, "hosts.root"));
+	vm->acc = vm->aux.hostsdb != NULL ? 0 : 1;
+}
+
+static void op_hosts_save(vm_t *vm)
+{
+	ARG0("hosts.save");
+	s_stat_flush(vm);
+	vm->acc = vm->aux.hostsdb ? hostsdb_commit(vm->aux.hostsdb) : 1;
+}
+
+static void op_hosts_close(vm_t *vm)
+{
+	ARG0("hosts.close");
+	hostsdb_close(vm->aux.hostsdb);
+	vm->aux.hostsdb = NULL;
+	vm->aux.hostent = NULL;
+	vm->acc = 0;
+}
+
+static void op_hosts_find(vm_t *vm)
+{
+	ARG2("hosts.find");
+	if (!vm->aux.hostsdb) {
 		vm->acc = 1;
 		return;
 	}
+	vm->aux.hostent = hostent_find(vm->aux.hostsdb, STR1(vm), STR2(vm));
+	vm->acc = vm->aux.hostent ? 0 : 1;
+}
 
-	if (aug_set(vm->aux.augeas, "/augeas/load/Hosts/lens", "Hosts.lns") < 0
-	 || aug_set(vm->aux.augeas, "/augeas/load/Hosts/incl", "/etc/hosts") < 0
-	 || aug_load(vm->aux.augeas) != 0) {
+static void op_hosts_new(vm_t *vm)
+{
+	ARG2("hosts.new");
+	if (!vm->aux.hostsdb) {
 		vm->acc = 1;
-	} else {
-		vm->acc = 0;
+		return;
 	}
+	vm->aux.hostent = hostent_add(vm->aux.hostsdb, STR1(vm), STR2(vm));
+	vm->acc = vm->aux.hostent ? 0 : 1;
 }
 
-static void op_augeas_done(vm_t *vm)
+static void op_hosts_delete(vm_t *vm)
+{
+	ARG0("hosts.delete");
+	if (!vm->aux.hostent) {
+		vm->acc = 1;
+		return;
+	}
+	hostent_remove(vm->aux.hostent);
+	vm->aux.hostent = NULL;
+	vm->acc = 0;
+}
+
+static void op_hosts_alias(vm_t *vm)
+{
+	ARG1("hosts.alias");
+	if (!vm->aux.hostent) {
+		vm->acc = 1;
+		return;
+	}
+	vm->acc = hostent_alias(vm->aux.hostent, STR1(vm));
+}
+
+static void op_hosts_unalias(vm_t *vm)
+{
+	ARG0("hosts.unalias");
+	if (!vm->aux.hostent) {
+		vm->acc = 1;
+		return;
+	}
+	vm->acc = hostent_unalias(vm->aux.hostent);
+}
+
+/* the Augeas handle is created on first use, and then kept (along
+   with every file loaded into it) until augeas.done, or the end of
+   the run, so that lenses are only compiled and files only parsed
+   once, no matter how many resources look at them. */
+static void s_augeas_close(vm_t *vm)
 {
-	ARG0("augeas.done");
 	aug_close(vm->aux.augeas);
 	vm->aux.augeas = NULL;
+	vm->aux.augeas_dirty = 0;
+	hash_done(&vm->aux.augeas_incl, 0);
+	memset(&vm->aux.augeas_incl, 0, sizeof(hash_t));
+}
+
+static int s_augeas_load(vm_t *vm, const char *lens, const char *file)
+{
+	if (!vm->aux.augeas) {
+		vm->aux.augeas = aug_init(
+			hash_get(&vm->pragma, "augeas.root"),
+			hash_get(&vm->pragma, "augeas.libs"),
+			AUG_NO_STDINC|AUG_NO_LOAD|AUG_NO_MODL_AUTOLOAD);
+		if (!vm->aux.augeas)
+			return 1;
+	}
+
+	char *key = string("%s:%s", lens, file);
+	char *loaded = hash_get(&vm->aux.augeas_incl, key);
+	if (loaded) {
+		free(key);
+		return strcmp(loaded, "ok") == 0 ? 0 : 1;
+	}
+
+	/* aug_load() re-reads files that have changed on disk,
+	   so don't let it throw away anything we haven't saved */
+	if (vm->aux.augeas_dirty && aug_save(vm->aux.augeas) == 0)
+		vm->aux.augeas_dirty = 0;
+
+	char *path = string("/augeas/load/%s/lens", lens);
+	char *value = string("%s.lns", lens);
+	int rc = aug_set(vm->aux.augeas, path, value);
+	free(path); free(value);
+
+	if (rc == 0) {
+		path = string("/augeas/load/%s/incl[last()+1]", lens);
+		rc = aug_set(vm->aux.augeas, path, file);
+		free(path);
+	}
+	if (rc == 0)
+		rc = aug_load(vm->aux.augeas);
+
+	hash_set(&vm->aux.augeas_incl, key, rc == 0 ? "ok" : "failed");
+	free(key);
+	return rc == 0 ? 0 : 1;
+}
+
+static void op_augeas_init(vm_t *vm)
+{
+	ARG0("augeas.init");
+	vm->acc = s_augeas_load(vm, "Hosts", "/etc/hosts");
+}
+
+static void op_augeas_load(vm_t *vm)
+{
+	ARG2("augeas.load");
+	vm->acc = s_augeas_load(vm, STR1(vm), STR2(vm));
+}
+
+static void op_augeas_done(vm_t *vm)
+{
+	ARG0("augeas.done");
+	s_augeas_close(vm);
 	vm->acc = 0;
 }
 
@@ -1795,7 +2370,10 @@ static void op_augeas_write(vm_t *vm)
 		vm->acc = 1;
 		return;
 	}
+	s_stat_flush(vm);
 	vm->acc = aug_save(vm->aux.augeas);
+	if (vm->acc == 0)
+		vm->aux.augeas_dirty = 0;
 }
 
 static void op_augeas_set(vm_t *vm)
@@ -1806,6 +2384,7 @@ static void op_augeas_set(vm_t *vm)
 		return;
 	}
 	vm->acc = aug_set(vm->aux.augeas, STR1(vm), STR2(vm));
+	vm->aux.augeas_dirty = 1;
 }
 
 static void op_augeas_get(vm_t *vm)
@@ -1870,6 +2449,7 @@ static void op_augeas_remove(vm_t *vm)
 		return;
 	}
 	vm->acc = aug_rm(vm->aux.augeas, STR1(vm)) > 1 ? 0 : 1;
+	vm->aux.augeas_dirty = 1;
 }
 
 static void op_env_get(vm_t *vm)
@@ -1897,12 +2477,36 @@ static void op_env_unset(vm_t *vm)
 	vm->acc = unsetenv(STR1(vm));
 }
 
-static void op_localsys(vm_t *vm)
+/* runs a localsys request, via the helper if we can; the first
+   line of output (if any) goes in out, and the return code is
+   handed back to the caller */
+static int s_localsys(vm_t *vm, const char *request, char *out, size_t len)
 {
-	ARG2("localsys");
-	REGISTER2("localsys");
+	int rc;
+	char *cmd = string("%s %s", hash_get(&vm->pragma, "localsys.cmd"), request);
+	out[0] = '\0';
+	s_stat_flush(vm);
+
+	/* installing / removing packages makes what we
+	   know about the package database out of date */
+	if (strncmp(request, "pkg-install", 11) == 0 || strncmp(request, "pkg-remove", 10) == 0) {
+		pkgdb_close(vm->aux.pkgdb);
+		vm->aux.pkgdb = NULL;
+		vm->aux.pkgdb_read = 0;
+	}
+
+	if (strcmp(hash_get(&vm->pragma, "localsys.serve"), "on") == 0) {
+		rc = s_localsys_ask(vm, request, out, len);
+		if (rc >= 0) {
+			char *nl = strchr(out, '\n'); if (nl) *nl = '\0';
+			logger(LOG_INFO, "%s: `%s` (via helper) exited %d: \"%s\"",
+				(vm->topic ? vm->topic : "(no topic)"),
+				cmd, rc, out);
+			free(cmd);
+			return rc;
+		}
+	}
 
-	char execline[8192] = {0};
 	runner_t runner = {
 		.in  = NULL,
 		.out = tmpfile(),
@@ -1910,25 +2514,231 @@ static void op_localsys(vm_t *vm)
 		.uid = geteuid(),
 		.gid = getegid(),
 	};
+	rc = run2(&runner, "/bin/sh", "-c", cmd, NULL);
 
-	char *s = _sprintf(vm, STR1(vm));
-	char *cmd = string("%s %s", hash_get(&vm->pragma, "localsys.cmd"), s);
-	vm->acc = run2(&runner, "/bin/sh", "-c", cmd, NULL);
-
-	if (fgets(execline, sizeof(execline), runner.out)) {
-		char *s = strchr(execline, '\n'); if (s) *s = '\0';
-		REG2(vm) = vm_heap_strdup(vm, execline);
+	if (fgets(out, len, runner.out)) {
+		char *nl = strchr(out, '\n'); if (nl) *nl = '\0';
+	} else {
+		out[0] = '\0';
 	}
 	fclose(runner.out); runner.out = NULL;
 	fclose(runner.err); runner.err = NULL;
 
 	logger(LOG_INFO, "%s: `%s` exited %d: \"%s\"",
 		(vm->topic ? vm->topic : "(no topic)"),
-		cmd, vm->acc, execline);
+		cmd, rc, out);
 	free(cmd);
+	return rc;
+}
+
+static void op_localsys(vm_t *vm)
+{
+	ARG2("localsys");
+	REGISTER2("localsys");
+
+	char execline[8192];
+	char *s = _sprintf(vm, STR1(vm));
+	vm->acc = s_localsys(vm, s, execline, sizeof(execline));
+	if (*execline)
+		REG2(vm) = vm_heap_strdup(vm, execline);
 	free(s);
 }
 
+/* read the package database at most once per run (or once
+   per change to it); NULL means localsys will have to do */
+static pkgdb_t* s_pkgdb(vm_t *vm)
+{
+	if (strcmp(hash_get(&vm->pragma, "pkgdb"), "on") != 0)
+		return NULL;
+
+	if (!vm->aux.pkgdb_read) {
+		vm->aux.pkgdb = pkgdb_read(hash_get(&vm->pragma, "pkgdb.root"));
+		vm->aux.pkgdb_read = 1;
+	}
+	return vm->aux.pkgdb;
+}
+
+static void op_pkg_version(vm_t *vm)
+{
+	ARG2("pkg.version");
+	REGISTER2("pkg.version");
+
+	pkgdb_t *db = s_pkgdb(vm);
+	if (!db) {
+		vm->acc = PKGDB_UNKNOWN;
+		return;
+	}
+
+	const char *version;
+	vm->acc = pkgdb_version(db, STR1(vm), &version);
+	if (vm->acc == PKGDB_INSTALLED)
+		REG2(vm) = vm_heap_strdup(vm, version);
+}
+
+/* package installs and removals can be queued up between a
+   pkg.begin and the next pkg.flush, so that the package manager
+   only has to be run once for a whole set of package resources.
+   queued operations report success right away; if any of them
+   end up failing, pkg.flush takes back the flags raised on their
+   behalf (i.e. for dependent resources) and reports the failure
+   under the topic of the resource that queued it. */
+
+static void s_pkgop_free(pkgop_t *op)
+{
+	if (!op) return;
+	list_delete(&op->l);
+	free(op->name);
+	free(op->version);
+	strings_free(op->flags);
+	free(op);
+}
+
+static int s_pkg_queue(vm_t *vm, const char *name, const char *version)
+{
+	if (!vm->aux.pkgbatch)
+		return 1;
+
+	pkgop_t *op = vmalloc(sizeof(pkgop_t));
+	op->name    = strdup(name);
+	op->version = version ? strdup(version) : NULL;
+	op->topic   = vm->topic;
+	op->flags   = strings_new(NULL);
+	list_push(&vm->aux.pkgq, &op->l);
+	return 0;
+}
+
+static int s_pkg_state(vm_t *vm, const char *name, char *version, size_t len)
+{
+	const char *v;
+	pkgdb_t *db = s_pkgdb(vm);
+	if (db) {
+		int rc = pkgdb_version(db, name, &v);
+		if (rc == PKGDB_INSTALLED)
+			snprintf(version, len, "%s", v);
+		if (rc != PKGDB_UNKNOWN)
+			return rc;
+	}
+
+	char *request = string("pkg-version %s", name);
+	int rc = s_localsys(vm, request, version, len);
+	free(request);
+	return rc == 0 ? PKGDB_INSTALLED
+	     : rc == 1 ? PKGDB_MISSING
+	     :           PKGDB_UNKNOWN;
+}
+
+/* did a queued operation take? */
+static int s_pkg_done(vm_t *vm, pkgop_t *op)
+{
+	char version[8192];
+	int state = s_pkg_state(vm, op->name, version, sizeof(version));
+
+	if (!op->version)
+		return state == PKGDB_MISSING;
+	if (state != PKGDB_INSTALLED)
+		return 0;
+	if (strcmp(op->version, "latest") == 0)
+		return 1;
+
+	/* "1.2.3" is satisfied by "1.2.3" or "1.2.3-4", as per pkg-install */
+	size_t n = strlen(op->version);
+	return strncmp(version, op->version, n) == 0
+	    && (version[n] == '\0' || version[n] == '-');
+}
+
+static void op_pkg_begin(vm_t *vm)
+{
+	ARG0("pkg.begin");
+	vm->aux.pkgbatch = 1;
+	vm->acc = 0;
+}
+
+static void op_pkg_install(vm_t *vm)
+{
+	ARG2("pkg.install");
+	vm->acc = s_pkg_queue(vm, STR1(vm), STR2(vm));
+}
+
+static void op_pkg_remove(vm_t *vm)
+{
+	ARG1("pkg.remove");
+	vm->acc = s_pkg_queue(vm, STR1(vm), NULL);
+}
+
+static void op_pkg_flush(vm_t *vm)
+{
+	ARG0("pkg.flush");
+	vm->aux.pkgbatch = 0;
+	vm->acc = 0;
+	if (list_isempty(&vm->aux.pkgq))
+		return;
+
+	pkgop_t *op, *tmp;
+	strings_t *args = strings_new(NULL);
+	for_each_object(op, &vm->aux.pkgq, l) {
+		char *arg = !op->version                   ? string("-%s", op->name)
+		          : strcmp(op->version, "latest") == 0 ? string("%s", op->name)
+		          :                                    string("%s=%s", op->name, op->version);
+		strings_add(args, arg);
+		free(arg);
+	}
+
+	char out[8192];
+	char *list = strings_join(args, " ");
+	char *request = string("pkg-install-batch %s", list);
+	int rc = s_localsys(vm, request, out, sizeof(out));
+	free(request);
+	free(list);
+	strings_free(args);
+
+	/* the package managers we know of install a batch all-or-nothing;
+	   when it fails, find out which ones didn't take and try them on
+	   their own, so that one bad package doesn't sink the rest */
+	const char *topic = vm->topic;
+	for_each_object(op, &vm->aux.pkgq, l) {
+		vm->topic = op->topic;
+		if (rc != 0 && !s_pkg_done(vm, op)) {
+			request = op->version ? string("pkg-install %s %s", op->name, op->version)
+			                      : string("pkg-remove %s", op->name);
+			op->failed = s_localsys(vm, request, out, sizeof(out)) != 0;
+			free(request);
+
+			if (op->failed) {
+				logger(LOG_ERR, "%s: failed to %s package %s: %s",
+					(op->topic ? op->topic : "(no topic)"),
+					(op->version ? "install" : "remove"), op->name, out);
+				vm->acc++;
+			}
+		}
+	}
+	vm->topic = topic;
+
+	/* take back the flags that only failed operations raised */
+	for_each_object(op, &vm->aux.pkgq, l) {
+		if (!op->failed)
+			continue;
+
+		int i;
+		for (i = 0; i < op->flags->num; i++) {
+			const char *flag = op->flags->strings[i];
+			int keep = hash_get(&vm->aux.pkgheld, flag) != NULL;
+
+			pkgop_t *other;
+			for_each_object(other, &vm->aux.pkgq, l)
+				if (!other->failed && strings_search(other->flags, flag) == 0)
+					keep = 1;
+
+			if (!keep)
+				hash_set(&vm->flags, flag, NULL);
+		}
+	}
+
+	for_each_object_safe(op, tmp, &vm->aux.pkgq, l)
+		s_pkgop_free(op);
+	hash_done(&vm->aux.pkgheld, 0);
+	memset(&vm->aux.pkgheld, 0, sizeof(hash_t));
+}
+
 static void op_runas_uid(vm_t *vm)
 {
 	ARG1("runas.uid");
@@ -1960,6 +2770,7 @@ static void op_exec(vm_t *vm)
 	};
 
 	logger(LOG_DEBUG, "exec: running `/bin/sh -c \"%s\"`", STR1(vm));
+	s_stat_flush(vm);
 	vm->acc = run2(&runner, "/bin/sh", "-c", STR1(vm), NULL);
 	if (fgets(execline, sizeof(execline), runner.out)) {
 		char *s = strchr(execline, '\n'); if (s) *s = '\0';
@@ -1983,6 +2794,7 @@ static void op_system(vm_t *vm)
 
 	char *cmd = _sprintf(vm, STR1(vm));
 	logger(LOG_DEBUG, "exec: running `bin/sh -c \"%s\"`", cmd);
+	s_stat_flush(vm);
 	vm->acc = run2(&runner, "/bin/sh", "-c", cmd, NULL);
 	free(cmd);
 
@@ -2067,6 +2879,7 @@ static void op_remote_sha1(vm_t *vm)
 static void op_remote_file(vm_t *vm)
 {
 	ARG2("remote.file");
+	s_stat_forget(vm, STR2(vm));
 	vm->acc = s_remote_file(vm, STR1(vm), STR2(vm));
 }
 
@@ -2148,6 +2961,7 @@ static void op_fs_mkparent(vm_t *vm)
 		if (errno != ENOENT)
 			goto bail;
 
+		s_stat_forget(vm, paths->strings[i]);
 		if (mkdir(paths->strings[i], 0777) != 0)
 			goto bail;
 
@@ -2194,6 +3008,8 @@ int vm_reset(vm_t *vm)
 	assert(vm);
 	memset(vm, 0, sizeof(vm_t));
 	list_init(&vm->heap);
+	list_init(&vm->aux.pkgq);
+	list_init(&vm->aux.async.workers);
 	return 0;
 }
 
@@ -2206,9 +3022,15 @@ int vm_load(vm_t *vm, byte_t *code, size_t len)
 
 	/* default pragmas */
 	hash_set(&vm->pragma, "authdb.root",  AUTHDB_ROOT);
+	hash_set(&vm->pragma, "hosts.root",   HOSTSDB_ROOT);
+	hash_set(&vm->pragma, "pkgdb",        "on");
+	hash_set(&vm->pragma, "pkgdb.root",   PKGDB_ROOT);
+	hash_set(&vm->pragma, "sha1db",       "off");
+	hash_set(&vm->pragma, "sha1db.file",  CACHED_SHA1_DB);
 	hash_set(&vm->pragma, "augeas.root",  AUGEAS_ROOT);
 	hash_set(&vm->pragma, "augeas.libs",  AUGEAS_LIBS);
 	hash_set(&vm->pragma, "localsys.cmd", "cw localsys");
+	hash_set(&vm->pragma, "localsys.serve", "on");
 	hash_set(&vm->pragma, "filecache",    CACHED_FILES_DIR);
 	hash_set(&vm->pragma, "remote",       "online");
 
@@ -2265,7 +3087,7 @@ int vm_args(vm_t *vm, int argc, char **argv)
 	return 0;
 }
 
-int vm_exec(vm_t *vm)
+static int s_exec(vm_t *vm)
 {
 	vm->pc = 2; /* skip the header */
 again:
@@ -2332,6 +3154,17 @@ again:
 	return vm->acc;
 }
 
+int vm_exec(vm_t *vm)
+{
+	int rc = s_exec(vm);
+
+	/* a worker that halts (or trips over bad bytecode)
+	   is finished, same as if its function returned */
+	if (vm->aux.async.ret)
+		s_worker_exit(vm);
+	return rc;
+}
+
 int vm_disasm(vm_t *vm, FILE *out)
 {
 	if (vm->codesize < 3) return 1;
@@ -2484,6 +3317,28 @@ int vm_done(vm_t *vm)
 		free(h);
 	}
 
+	authdb_close(vm->aux.authdb);
+	vm->aux.authdb = NULL;
+	hostsdb_close(vm->aux.hostsdb);
+	vm->aux.hostsdb = NULL;
+	pkgdb_close(vm->aux.pkgdb);
+	vm->aux.pkgdb = NULL;
+	if (vm->aux.sha1db && sha1db_commit(vm->aux.sha1db) != 0)
+		logger(LOG_WARNING, "failed to save checksums to %s: %s",
+			vm->aux.sha1db->file, strerror(errno));
+	sha1db_close(vm->aux.sha1db);
+	vm->aux.sha1db = NULL;
+	pkgop_t *op, *next;
+	for_each_object_safe(op, next, &vm->aux.pkgq, l)
+		s_pkgop_free(op);
+	hash_done(&vm->aux.pkgheld, 0);
+	worker_t *w, *wnext;
+	for_each_object_safe(w, wnext, &vm->aux.async.workers, l)
+		s_worker_reap(vm, w);
+	s_augeas_close(vm);
+	s_localsys_stop(vm);
+	s_stat_flush(vm);
+
 	hash_done(&vm->props,  0);
 	hash_done(&vm->pragma, 0);
 	hash_done(&vm->flags,  0);
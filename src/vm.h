@@ -8,6 +8,9 @@
 
 #include <augeas.h>
 #include "authdb.h"
+#include "hostsdb.h"
+#include "pkgdb.h"
+#include "sha1db.h"
 
 /*
 
@@ -67,6 +70,22 @@ typedef struct {
 	strings_t *paths;
 } dirlist_t;
 
+typedef struct {
+	char       *name;
+	char       *version; /* NULL = remove the package */
+	const char *topic;   /* resource that asked for it */
+	strings_t  *flags;   /* flags raised on its behalf */
+	int         failed;  /* (in pkg.flush) couldn't be done */
+	list_t      l;
+} pkgop_t;
+
+typedef struct {
+	pid_t       pid;
+	dword_t     fn;  /* address of the function it is running */
+	int         fd;  /* read end of the pipe it hands flags back on */
+	list_t      l;
+} worker_t;
+
 #define NREGS 16
 #define VM_MAX_OPENDIRS 2048
 #define HEAP_ADDRMASK 0x80000000
@@ -106,15 +125,51 @@ typedef struct {
 	struct {
 		struct stat   stat;
 
+		struct {
+			hash_t         paths;  /* path -> last lstat() result */
+			unsigned long  hits;   /* lookups answered from the cache */
+			unsigned long  misses; /* ... and those that weren't */
+		} statcache;
+
 		augeas       *augeas;
+		hash_t        augeas_incl;  /* "lens:file" pairs loaded so far */
+		int           augeas_dirty; /* unsaved changes in the tree? */
 
 		authdb_t     *authdb;
 		user_t       *user;
 		group_t      *group;
 
+		hostsdb_t    *hostsdb;
+		hostent_t    *hostent;
+
+		pkgdb_t      *pkgdb;
+		int           pkgdb_read; /* tried to read it this run? */
+		list_t        pkgq;       /* queued installs / removals */
+		int           pkgbatch;   /* queueing them (pkg.begin)? */
+		hash_t        pkgheld;    /* flags raised by anything else */
+
+		sha1db_t     *sha1db;     /* checksums from previous runs */
+
 		void         *remote;
 		int           timeout;
 
+		struct {
+			int        max;     /* workers to run at once (pragma parallel) */
+			list_t     workers; /* ... that haven't been reaped yet */
+			int        failed;  /* summed results of workers reaped early */
+
+			dword_t    ret;     /* (in a worker) address its function returns to */
+			int        fd;      /* (in a worker) where to hand flags back */
+			strings_t *raised;  /* (in a worker) flags raised so far */
+		} async;
+
+		struct {
+			pid_t     pid;    /* long-running `localsys serve` helper */
+			FILE     *in;     /* ... its standard input */
+			FILE     *out;    /* ... and its standard output */
+			int       broken; /* couldn't start / talk to it */
+		} localsys;
+
 		dirlist_t     dirs[VM_MAX_OPENDIRS];
 
 		uid_t         runas_uid;
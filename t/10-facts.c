@@ -90,6 +90,29 @@ TESTS {
 
 	/**********************************************************/
 
+	facts = vmalloc(sizeof(hash_t));
+	ok(fact_core(facts) == 0, "gathered core facts natively");
+	ok(hash_get(facts, "sys.platform") != NULL, "sys.platform is defined");
+	ok(hash_get(facts, "sys.arch") != NULL, "sys.arch is defined");
+	ok(hash_get(facts, "sys.hostname") != NULL, "sys.hostname is defined");
+	ok(hash_get(facts, "sys.kernel.version") != NULL, "sys.kernel.version is defined");
+	ok(hash_get(facts, "sys.kernel.major") != NULL, "sys.kernel.major is defined");
+	ok(hash_get(facts, "sys.kernel.minor") != NULL, "sys.kernel.minor is defined");
+	ok(hash_get(facts, "sys.hostid") != NULL, "sys.hostid is defined");
+	ok(hash_get(facts, "sys.net.interfaces") != NULL, "sys.net.interfaces is defined");
+	ok(strncmp(hash_get(facts, "sys.kernel.version"),
+	           hash_get(facts, "sys.kernel.minor"),
+	           strlen(hash_get(facts, "sys.kernel.minor"))) == 0,
+		"sys.kernel.minor is a prefix of sys.kernel.version");
+	ok(strncmp(hash_get(facts, "sys.kernel.minor"),
+	           hash_get(facts, "sys.kernel.major"),
+	           strlen(hash_get(facts, "sys.kernel.major"))) == 0,
+		"sys.kernel.major is a prefix of sys.kernel.minor");
+	hash_done(facts, 1);
+	free(facts);
+
+	/**********************************************************/
+
 	facts = vmalloc(sizeof(hash_t));
 	mkdir("t/tmp", 0777);
 	mkdir("t/tmp/facts.d", 0777);
@@ -137,6 +160,8 @@ TESTS {
 		"not.defined fact (in skip.me) not defined");
 	ok(!hash_get(facts, "sys.policy.bad"),
 		"sys.policy.* facts are skipped in fact_gather() for security reasons");
+	ok(hash_get(facts, "sys.kernel.version") != NULL,
+		"core facts are gathered natively by fact_gather()");
 	hash_done(facts, 1);
 	free(facts);
 
@@ -248,5 +273,57 @@ TESTS {
 	hash_done(facts, 1);
 	free(facts);
 
+	/**********************************************************/
+
+	{
+		hash_t *base, *copy;
+		uint8_t *delta;
+		size_t len;
+
+		base = vmalloc(sizeof(hash_t));
+		hash_set(base, "test.same",    strdup("unchanged"));
+		hash_set(base, "test.changed", strdup("old value"));
+		hash_set(base, "test.removed", strdup("going away"));
+
+		facts = vmalloc(sizeof(hash_t));
+		hash_set(facts, "test.same",    strdup("unchanged"));
+		hash_set(facts, "test.changed", strdup("new value"));
+		hash_set(facts, "test.added",   strdup(""));
+
+		ok(fact_delta(NULL, base, &delta, &len) == 0,
+			"encoded a full fact delta (no base)");
+		copy = vmalloc(sizeof(hash_t));
+		ok(fact_patch(copy, delta, len) == 0,
+			"applied a full fact delta to an empty fact set");
+		free(delta);
+		is_string(hash_get(copy, "test.same"),    "unchanged",  "full delta: test.same");
+		is_string(hash_get(copy, "test.changed"), "old value",  "full delta: test.changed");
+		is_string(hash_get(copy, "test.removed"), "going away", "full delta: test.removed");
+
+		ok(fact_delta(base, facts, &delta, &len) == 0,
+			"encoded a partial fact delta");
+		ok(fact_patch(copy, delta, len) == 0,
+			"applied a partial fact delta");
+		is_string(hash_get(copy, "test.same"),    "unchanged", "partial delta: test.same");
+		is_string(hash_get(copy, "test.changed"), "new value", "partial delta: test.changed");
+		is_string(hash_get(copy, "test.added"),   "",          "partial delta: test.added");
+		ok(!hash_get(copy, "test.removed"), "partial delta: test.removed is gone");
+
+		ok(fact_patch(copy, delta, len - 1) != 0,
+			"fact_patch() rejects a truncated delta");
+		free(delta);
+
+		ok(fact_delta(facts, facts, &delta, &len) == 0,
+			"encoded an empty fact delta");
+		is_int(len, 0, "no changes encode to an empty delta");
+		ok(fact_patch(copy, delta, len) == 0,
+			"applied an empty fact delta");
+		free(delta);
+
+		hash_done(base, 1);  free(base);
+		hash_done(facts, 1); free(facts);
+		hash_done(copy, 1);  free(copy);
+	}
+
 	done_testing();
 }
@@ -414,6 +414,63 @@ TESTS {
 		ok(stree_compare(NULL, NULL) != 0, "stree(NULL) != stree(NULL)");
 	}
 
+	subtest {
+		struct stree *root, *node, *pol, *re, *bad;
+		struct policy *pol1;
+		hash_t *facts;
+
+		root = NODE(PROG, NULL, NULL);
+		pol  = child_of(root, NODE(POLICY, "regexen", NULL));
+		node = child_of(pol, NODE(IF, NULL, NULL));
+		re   = NODE(EXPR_REGEX, "^test\\d+$", "i");
+		child_of(node, EXPR(MATCH, NODE(EXPR_FACT, "sys.hostname", NULL), re));
+		child_of(child_of(node, NODE(RESOURCE, "user", "matched")), NODE(ATTR, "uid", "1"));
+		child_of(child_of(node, NODE(RESOURCE, "user", "unmatched")), NODE(ATTR, "uid", "2"));
+
+		ok(stree_compile(re) == 0, "compiled a valid regex node");
+		isnt_null(re->regex, "compiled regex is cached on the stree node");
+
+		facts = vmalloc(sizeof(hash_t));
+		hash_set(facts, "sys.hostname", "TEST42");
+		isnt_null(pol1 = policy_generate(root, facts), "generated policy");
+		if (!pol1) break;
+		ok(policy_find_resource(pol1, RES_USER, "username", "matched") != NULL,
+			"case-insensitive regex matched");
+		policy_free_all(pol1);
+
+		hash_set(facts, "sys.hostname", "host42");
+		isnt_null(pol1 = policy_generate(root, facts), "generated policy");
+		if (!pol1) break;
+		ok(policy_find_resource(pol1, RES_USER, "username", "unmatched") != NULL,
+			"cached regex re-used for non-matching host");
+		policy_free_all(pol1);
+		hash_done(facts, 0);
+		free(facts);
+
+		bad = NODE(EXPR_REGEX, "(unbalanced", "");
+		ok(stree_compile(bad) != 0, "invalid regex fails to compile");
+		is_null(bad->regex, "no regex cached for an invalid pattern");
+	}
+
+	subtest {
+		struct stree *a, *b, *c, *e1, *e2;
+
+		a = NODE(ATTR, "owner", "root");
+		b = NODE(ATTR, "owner", "root");
+		c = NODE(ATTR, "group", "root");
+		ok(a == b, "identical ATTR nodes are shared");
+		ok(a != c, "different ATTR nodes are not shared");
+		ok(a->data2 == c->data2, "attribute values are interned");
+
+		e1 = EXPR(EQ, NODE(EXPR_FACT, "sys.os", NULL), NODE(EXPR_VAL, "linux", NULL));
+		e2 = EXPR(EQ, NODE(EXPR_FACT, "sys.os", NULL), NODE(EXPR_VAL, "linux", NULL));
+		ok(e1 == e2, "identical EXPR subtrees are shared");
+		ok(NEGATE(e1) == NEGATE(e2), "negations of shared EXPRs are shared");
+		ok(NODE(PROG, NULL, NULL) != NODE(PROG, NULL, NULL), "PROG nodes are never shared");
+
+		ok(manifest_arena_size(MANIFEST) > 0, "nodes allocated from the manifest arena");
+	}
+
 	manifest_free(MANIFEST);
 
 	done_testing();
@@ -82,6 +82,10 @@ TESTS {
 		ok(resource_depends_on(c, a) != 0, "!(c -> a)");
 		ok(resource_depends_on(c, b) != 0, "!(c -> b)");
 
+		is_int(b->ndependents, 1, "b has one dependent");
+		ok(b->dependents[0] == a, "b's dependent is a");
+		is_int(a->ndependents, 0, "a has no dependents");
+
 		ok(resource_add_dependency(a, c) == 0, "make a -> c");
 		ok(resource_depends_on(a, b) == 0,   "a -> b");
 		ok(resource_depends_on(a, c) == 0,   "a -> c");
@@ -91,6 +95,8 @@ TESTS {
 		ok(resource_depends_on(c, b) != 0, "!(c -> b)");
 
 		ok(resource_drop_dependency(a, b) == 0, "dropped a -> b dep");
+		is_int(b->ndependents, 0, "b no longer has any dependents");
+		is_int(c->ndependents, 1, "c still has one dependent");
 		ok(resource_depends_on(a, b) != 0, "!(a -> b)");
 		ok(resource_depends_on(a, c) == 0,   "a -> c");
 		ok(resource_depends_on(b, a) != 0, "!(b -> a)");
@@ -226,5 +226,371 @@ TESTS {
 		manifest_free(m);
 	}
 
+	subtest {
+		struct manifest *m;
+		struct policy *pol;
+		struct stree *host;
+		hash_t *facts;
+		const char **slots;
+
+		mkdir("t/tmp", 0777);
+		FILE *io = fopen("t/tmp/manifest.pol", "w");
+		if (!io) BAIL_OUT("failed to create test file 't/tmp/manifest.pol'");
+
+		fprintf(io, "policy \"baseline\" {\n");
+		fprintf(io, "\tpackage \"always\" { }\n");
+		fprintf(io, "\tif (sys.os is \"linux\") {\n");
+		fprintf(io, "\t\tpackage \"linux-only\" { }\n");
+		fprintf(io, "\t}\n");
+		fprintf(io, "\tif (sys.policy.linux is \"enforced\") {\n");
+		fprintf(io, "\t\tpackage \"enforced\" { }\n");
+		fprintf(io, "\t}\n");
+		fprintf(io, "}\n");
+		fprintf(io, "policy \"linux\" {\n");
+		fprintf(io, "\textend \"baseline\"\n");
+		fprintf(io, "}\n");
+		fprintf(io, "host \"example\" { enforce \"linux\" }\n");
+		fclose(io);
+
+		isnt_null(m = parse_file("t/tmp/manifest.pol"),
+				"manifest parsed");
+		ok(hash_get(m->slots, "sys.os") != NULL,
+				"sys.os fact assigned a slot");
+		ok(hash_get(m->slots, "sys.policy.linux") != NULL,
+				"sys.policy.linux fact assigned a slot");
+		ok(hash_get(m->slots, "sys.fqdn") == NULL,
+				"unreferenced facts are not assigned slots");
+		isnt_null(host = hash_get(m->hosts, "example"),
+				"host 'example' found");
+
+		facts = vmalloc(sizeof(hash_t));
+		hash_set(facts, "sys.os", strdup("linux"));
+		isnt_null(pol = manifest_generate(m, host, facts),
+				"generated policy from fact slots");
+		is_int(num_res(pol, RES_PACKAGE), 3, "all packages enforced on linux");
+		is_string(hash_get(facts, "sys.policy.linux"), "enforced",
+				"include sets sys.policy.linux fact");
+		policy_free_all(pol);
+		hash_done(facts, 1);
+		free(facts);
+
+		facts = vmalloc(sizeof(hash_t));
+		hash_set(facts, "sys.os", strdup("openbsd"));
+		isnt_null(pol = manifest_generate(m, host, facts),
+				"generated policy from fact slots");
+		is_int(num_res(pol, RES_PACKAGE), 2, "linux-only package skipped on openbsd");
+		policy_free_all(pol);
+		hash_done(facts, 1);
+		free(facts);
+
+		facts = vmalloc(sizeof(hash_t));
+		hash_set(facts, "sys.os", strdup("openbsd"));
+		isnt_null(pol = policy_generate(host, facts),
+				"generated policy from fact hash");
+		is_int(num_res(pol, RES_PACKAGE), 2,
+				"policy_generate agrees with manifest_generate");
+		policy_free_all(pol);
+		hash_done(facts, 1);
+		free(facts);
+
+		slots = vcalloc(m->nslots + 1, sizeof(char*));
+		slots[(uintptr_t)hash_get(m->slots, "sys.os") - 1] = "linux";
+		facts = vmalloc(sizeof(hash_t));
+		isnt_null(pol = manifest_generate_slots(m, host, slots, facts),
+				"generated policy from pre-projected fact slots");
+		is_int(num_res(pol, RES_PACKAGE), 3, "all packages enforced on linux");
+		is_string(hash_get(facts, "sys.policy.linux"), "enforced",
+				"include sets sys.policy.linux fact");
+		is_string(slots[(uintptr_t)hash_get(m->slots, "sys.policy.linux") - 1], "enforced",
+				"include sets sys.policy.linux slot");
+		policy_free_all(pol);
+		hash_done(facts, 1);
+		free(facts);
+		free(slots);
+
+		manifest_free(m);
+	}
+
+	subtest {
+		struct policy *pol;
+		struct dependency *d1, *d2, *d3;
+
+		isnt_null(pol = policy_new("deps"), "created policy");
+		d1 = dependency_new("file:a", "dir:b");
+		d2 = dependency_new("file:a", "dir:b");
+		d3 = dependency_new("file:a:dir", "b");
+
+		is_int(policy_add_dependency(pol, d1), 0, "added file:a -> dir:b");
+		ok(policy_add_dependency(pol, d2) != 0, "duplicate file:a -> dir:b rejected");
+		is_int(policy_add_dependency(pol, d3), 0, "added file:a:dir -> b");
+
+		dependency_free(d2);
+		policy_free_all(pol);
+	}
+
+	subtest {
+		struct manifest *m;
+		struct policy *pol;
+		struct resource *r;
+		hash_t *facts;
+		char order[64];
+
+		mkdir("t/tmp", 0777);
+		FILE *io = fopen("t/tmp/manifest.pol", "w");
+		if (!io) BAIL_OUT("failed to create test file 't/tmp/manifest.pol'");
+
+		fprintf(io, "policy \"base\" {\n");
+		fprintf(io, "\tpackage \"a\" { depends on package(\"b\") }\n");
+		fprintf(io, "\tpackage \"b\" { depends on package(\"a\") }\n");
+		fprintf(io, "\tpackage \"c\" { depends on package(\"e\") }\n");
+		fprintf(io, "\tpackage \"d\" { }\n");
+		fprintf(io, "\tpackage \"e\" { }\n");
+		fprintf(io, "}\n");
+		fclose(io);
+
+		facts = vmalloc(sizeof(hash_t));
+		isnt_null(m = parse_file("t/tmp/manifest.pol"),
+				"manifest parsed");
+		isnt_null(pol = policy_generate(hash_get(m->policies, "base"), facts),
+				"policy 'base' found");
+
+		order[0] = '\0';
+		for_each_resource(r, pol)
+			strncat(order, r->key + strlen("package:"), sizeof(order) - strlen(order) - 1);
+		is_string(order, "decab",
+				"resources sorted stably, with the a <-> b cycle left at the end");
+
+		policy_free_all(pol);
+		free(facts);
+		manifest_free(m);
+	}
+
+	subtest {
+		struct policy *pol;
+		struct resource *user, *group, *dir, *other;
+
+		isnt_null(pol = policy_new("lookups"), "created policy");
+
+		user = resource_new("user", "james");
+		resource_set(user, "uid", "1009");
+		policy_add_resource(pol, user);
+
+		group = resource_new("group", "staff");
+		resource_set(group, "gid", "2001");
+		policy_add_resource(pol, group);
+
+		dir = resource_new("dir", "/srv");
+		policy_add_resource(pol, dir);
+
+		ok(policy_find_resource(pol, RES_USER, "username", "james") == user,
+				"found user by username");
+		ok(policy_find_resource(pol, RES_USER, "uid", "1009") == user,
+				"found user by uid");
+		ok(policy_find_resource(pol, RES_GROUP, "name", "staff") == group,
+				"found group by name");
+		ok(policy_find_resource(pol, RES_GROUP, "gid", "2001") == group,
+				"found group by gid");
+		ok(policy_find_resource(pol, RES_DIR, "path", "/srv") == dir,
+				"found dir by path");
+		is_null(policy_find_resource(pol, RES_FILE, "path", "/srv"),
+				"dir is not found as a file");
+		is_null(policy_find_resource(pol, RES_USER, "username", "jim"),
+				"no user 'jim' defined");
+
+		other = resource_new("user", "jim");
+		resource_set(other, "home", "/home/jim");
+		policy_add_resource(pol, other);
+		ok(policy_find_resource(pol, RES_USER, "username", "jim") == other,
+				"resources added after a lookup are found");
+		ok(policy_find_resource(pol, RES_USER, "home", "/home/jim") == other,
+				"unindexed attributes are still searched");
+
+		policy_free_all(pol);
+	}
+
+	subtest {
+		struct manifest *m, *img;
+		struct policy *pol;
+		struct stree *host;
+		hash_t *facts;
+		FILE *io;
+
+		mkdir("t/tmp", 0777);
+		mkdir("t/tmp/image.d", 0777);
+		unlink("t/tmp/image.d/extra.pol");
+		unlink("t/tmp/image.cache");
+
+		io = fopen("t/tmp/image.d/base.pol", "w");
+		if (!io) BAIL_OUT("failed to create test file 't/tmp/image.d/base.pol'");
+		fprintf(io, "policy \"base\" {\n");
+		fprintf(io, "\tpackage \"always\" { }\n");
+		fprintf(io, "\tif (sys.os =~ m/^LINUX$/i) {\n");
+		fprintf(io, "\t\tpackage \"linux-only\" { }\n");
+		fprintf(io, "\t}\n");
+		fprintf(io, "}\n");
+		fclose(io);
+
+		io = fopen("t/tmp/image.pol", "w");
+		if (!io) BAIL_OUT("failed to create test file 't/tmp/image.pol'");
+		fprintf(io, "include \"image.d/*.pol\"\n");
+		fprintf(io, "host \"example\" { enforce \"base\" }\n");
+		fprintf(io, "host fallback { enforce \"base\" }\n");
+		fclose(io);
+
+		isnt_null(m = parse_file("t/tmp/image.pol"), "manifest parsed");
+		is_int(m->sources->num, 3, "manifest tracks its file, glob and glob match");
+		ok(manifest_write(m, "t/tmp/image.cache") == 0, "wrote manifest image");
+
+		isnt_null(img = manifest_read("t/tmp/image.cache"), "read manifest image");
+		is_int(img->nodes_len, m->nodes_len, "image has all the nodes");
+		is_int(img->sources->num, 3, "image has all the sources");
+		ok(stree_compare(hash_get(img->policies, "base"), hash_get(m->policies, "base")) == 0,
+				"policy 'base' survives the round-trip");
+		ok(stree_compare(img->fallback, m->fallback) == 0,
+				"fallback host survives the round-trip");
+		ok(stree_compare(img->root, m->root) == 0,
+				"whole syntax tree survives the round-trip");
+		isnt_null(host = hash_get(img->hosts, "example"), "host 'example' found in image");
+
+		facts = vmalloc(sizeof(hash_t));
+		hash_set(facts, "sys.os", strdup("linux"));
+		isnt_null(pol = manifest_generate(img, host, facts),
+				"generated policy from manifest image");
+		is_int(num_res(pol, RES_PACKAGE), 2, "regex conditional evaluated from image");
+		policy_free_all(pol);
+		hash_done(facts, 1);
+		free(facts);
+		manifest_free(img);
+		manifest_free(m);
+
+		isnt_null(m = parse_cached("t/tmp/image.pol", "t/tmp/image.cache"),
+				"parse_cached with an up-to-date image");
+		isnt_null(m->image, "manifest was loaded from the image");
+		manifest_free(m);
+
+		io = fopen("t/tmp/image.d/extra.pol", "w");
+		if (!io) BAIL_OUT("failed to create test file 't/tmp/image.d/extra.pol'");
+		fprintf(io, "policy \"extra\" { }\n");
+		fclose(io);
+
+		isnt_null(m = parse_cached("t/tmp/image.pol", "t/tmp/image.cache"),
+				"parse_cached after a new file matches the glob");
+		is_null(m->image, "manifest was re-parsed");
+		isnt_null(hash_get(m->policies, "extra"), "new policy was picked up");
+		manifest_free(m);
+
+		isnt_null(m = parse_cached("t/tmp/image.pol", "t/tmp/image.cache"),
+				"parse_cached after re-parse");
+		isnt_null(m->image, "image was rewritten by the re-parse");
+		isnt_null(hash_get(m->policies, "extra"), "rewritten image has new policy");
+		manifest_free(m);
+
+		is_null(manifest_read("t/tmp/image.pol"), "policy source is not an image");
+	}
+
+	subtest {
+		struct manifest *m;
+		FILE *io;
+
+		mkdir("t/tmp", 0777);
+		io = fopen("t/tmp/manifest.pol", "w");
+		if (!io) BAIL_OUT("failed to create test file 't/tmp/manifest.pol'");
+		fprintf(io, "policy \"base\" { package \"vim\" { } }\n");
+		fclose(io);
+
+		isnt_null(m = parse_file("t/tmp/manifest.pol"), "manifest parsed");
+		is_int(m->refs, 1, "new manifest has a single reference");
+		ok(parse_current(m, "t/tmp/manifest.pol"), "manifest is current");
+		ok(!parse_current(m, "t/tmp/other.pol"), "manifest was not parsed from other.pol");
+
+		ok(manifest_retain(m) == m, "manifest_retain returns the manifest");
+		is_int(m->refs, 2, "retained manifest has two references");
+		manifest_free(m);
+		is_int(m->refs, 1, "manifest_free drops a reference");
+		isnt_null(hash_get(m->policies, "base"), "manifest is still usable");
+
+		io = fopen("t/tmp/manifest.pol", "w");
+		if (!io) BAIL_OUT("failed to create test file 't/tmp/manifest.pol'");
+		fprintf(io, "policy \"base\" { package \"emacs\" { } }\n");
+		fclose(io);
+		ok(!parse_current(m, "t/tmp/manifest.pol"), "manifest is stale after an edit");
+
+		manifest_free(m);
+	}
+
+	subtest {
+		struct manifest *m;
+		struct policy *pol1, *pol2;
+		struct stree *host;
+		hash_t *facts;
+
+		mkdir("t/tmp", 0777);
+		FILE *io = fopen("t/tmp/manifest.pol", "w");
+		if (!io) BAIL_OUT("failed to create test file 't/tmp/manifest.pol'");
+
+		fprintf(io, "policy \"static\" {\n");
+		fprintf(io, "\tpackage \"always\" { }\n");
+		fprintf(io, "}\n");
+		fprintf(io, "policy \"dynamic\" {\n");
+		fprintf(io, "\tif (sys.os is \"linux\") {\n");
+		fprintf(io, "\t\tpackage \"linux-only\" { }\n");
+		fprintf(io, "\t}\n");
+		fprintf(io, "}\n");
+		fprintf(io, "host \"static\" { enforce \"static\" }\n");
+		fprintf(io, "host \"dynamic\" { enforce \"static\" enforce \"dynamic\" }\n");
+		fclose(io);
+
+		isnt_null(m = parse_file("t/tmp/manifest.pol"), "manifest parsed");
+
+		isnt_null(host = hash_get(m->hosts, "static"), "host 'static' found");
+		facts = vmalloc(sizeof(hash_t));
+		hash_set(facts, "sys.os", strdup("linux"));
+		isnt_null(pol1 = manifest_generate(m, host, facts), "generated static policy");
+		hash_done(facts, 1);
+		free(facts);
+
+		facts = vmalloc(sizeof(hash_t));
+		hash_set(facts, "sys.os", strdup("openbsd"));
+		isnt_null(pol2 = manifest_generate(m, host, facts), "generated static policy again");
+		ok(pol1 == pol2, "fact-independent policy is only generated once");
+		is_string(hash_get(facts, "sys.policy.static"), "enforced",
+				"includes still set sys.policy.* facts for each host");
+		is_int(num_res(pol2, RES_PACKAGE), 1, "static policy has 1 package");
+		policy_free_all(pol1);
+		policy_free_all(pol2);
+		hash_done(facts, 1);
+		free(facts);
+
+		isnt_null(host = hash_get(m->hosts, "dynamic"), "host 'dynamic' found");
+		facts = vmalloc(sizeof(hash_t));
+		hash_set(facts, "sys.os", strdup("linux"));
+		hash_set(facts, "sys.fqdn", strdup("one.example.com"));
+		isnt_null(pol1 = manifest_generate(m, host, facts), "generated dynamic policy");
+		is_int(num_res(pol1, RES_PACKAGE), 2, "linux host gets 2 packages");
+		hash_done(facts, 1);
+		free(facts);
+
+		facts = vmalloc(sizeof(hash_t));
+		hash_set(facts, "sys.os", strdup("openbsd"));
+		isnt_null(pol2 = manifest_generate(m, host, facts), "generated dynamic policy");
+		ok(pol1 != pol2, "hosts that differ on tested facts get different policies");
+		is_int(num_res(pol2, RES_PACKAGE), 1, "openbsd host gets 1 package");
+		policy_free_all(pol2);
+		hash_done(facts, 1);
+		free(facts);
+
+		facts = vmalloc(sizeof(hash_t));
+		hash_set(facts, "sys.os", strdup("linux"));
+		hash_set(facts, "sys.fqdn", strdup("two.example.com"));
+		isnt_null(pol2 = manifest_generate(m, host, facts), "generated dynamic policy");
+		ok(pol1 == pol2, "hosts that agree on tested facts share a policy");
+		policy_free_all(pol1);
+		policy_free_all(pol2);
+		hash_done(facts, 1);
+		free(facts);
+
+		manifest_free(m);
+	}
+
 	done_testing();
 }
@@ -215,10 +215,10 @@ TESTS {
 
 		user = user_add(db);
 		isnt_null(user, "user_add() returned a new user");
-		user->name = strdup("new_user");
+		user_set_name(user, "new_user");
+		user_set_uid(user, 500);
 		user->clear_pass = strdup("x");
 		user->crypt_pass = strdup("$6$pwhash");
-		user->uid        = 500;
 		user->gid        = 500;
 		user->comment    = strdup("New User,,,");
 		user->home       = strdup("/home/new_user");
@@ -233,10 +233,10 @@ TESTS {
 
 		group = group_add(db);
 		isnt_null(group, "group_add() returns a new group");
-		group->name       = strdup("new_group");
+		group_set_name(group, "new_group");
+		group_set_gid(group, 500);
 		group->clear_pass = strdup("x");
 		group->crypt_pass = strdup("$6$pwhash");
-		group->gid        = 500;
 
 		authdb_write(db);
 		authdb_close(db);
@@ -499,5 +499,104 @@ TESTS {
 		authdb_close(db);
 	}
 
+	subtest {
+		reset("t/tmp");
+		authdb_t *db = authdb_read("t/tmp", AUTHDB_ALL);
+		is_int(db->dirty, 0, "freshly read authdb is clean");
+
+		user_t *user = user_find(db, "account4", NO_UID);
+		group_t *group = group_find(db, "members", NO_GID);
+		isnt_null(user,  "found 'account4' in database");
+		isnt_null(group, "found 'members' group in database");
+
+		group_join(group, GROUP_MEMBER, user);
+		is_int(db->dirty, AUTHDB_GROUP|AUTHDB_GSHADOW, "joining a group dirties group / gshadow");
+		is_int(authdb_commit(db), 0, "committed group membership");
+		is_int(db->dirty, 0, "authdb is clean after commit");
+
+		group_join(group, GROUP_MEMBER, user);
+		is_int(db->dirty, 0, "re-joining a group is a no-op");
+
+		unlink("t/tmp/passwd");
+		is_int(authdb_commit(db), 0, "committed a clean authdb");
+		ok(access("t/tmp/passwd", F_OK) != 0, "clean databases are not rewritten");
+
+		user_add(db);
+		is_int(db->dirty, AUTHDB_PASSWD|AUTHDB_SHADOW, "adding a user dirties passwd / shadow");
+		authdb_close(db);
+	}
+
+	subtest {
+		reset("t/tmp");
+		authdb_t *db = authdb_read("t/tmp", AUTHDB_ALL);
+		user_t *user = user_find(db, "account1", NO_UID);
+		isnt_null(user, "found 'account1' in database (via index)");
+		ok(user_find(db, NULL, 901) == user, "found uid 901 (via index)");
+
+		user_set_name(user, "renamed1");
+		user_set_uid(user, 1901);
+		is_null(user_find(db, "account1", NO_UID), "renamed user not found by old name");
+		is_null(user_find(db, NULL, 901), "renumbered user not found by old uid");
+		ok(user_find(db, "renamed1", NO_UID) == user, "renamed user found by new name");
+		ok(user_find(db, NULL, 1901) == user, "renumbered user found by new uid");
+
+		is_int(authdb_nextuid(db, 901), 901, "nextuid reuses the old uid");
+		is_int(authdb_nextuid(db, 1901), 1902, "nextuid skips the new uid");
+
+		user_t *added = user_add(db);
+		user_set_name(added, "added");
+		user_set_uid(added, 1902);
+		ok(user_find(db, "added", NO_UID) == added, "new user found by name");
+		is_int(authdb_nextuid(db, 1901), 1903, "nextuid skips newly added uid");
+
+		user_remove(added);
+		is_null(user_find(db, "added", NO_UID), "removed user not found by name");
+		is_int(authdb_nextuid(db, 1901), 1902, "nextuid reuses the removed uid");
+
+		group_t *group = group_find(db, "service", NO_GID);
+		isnt_null(group, "found 'service' group (via index)");
+		ok(group_find(db, NULL, 909) == group, "found gid 909 (via index)");
+		is_int(group_has(group, GROUP_MEMBER, user), 0, "renamed user is still a member of 'service'");
+
+		group_set_name(group, "services");
+		group_set_gid(group, 910);
+		is_null(group_find(db, "service", NO_GID), "renamed group not found by old name");
+		is_null(group_find(db, NULL, 909), "renumbered group not found by old gid");
+		ok(group_find(db, "services", NO_GID) == group, "renamed group found by new name");
+		ok(group_find(db, NULL, 910) == group, "renumbered group found by new gid");
+		is_int(authdb_nextgid(db, 909), 909, "nextgid reuses the old gid");
+		is_int(authdb_nextgid(db, 909 + 1), 911, "nextgid skips the new gid");
+
+		group_t *added_group = group_add(db);
+		group_set_name(added_group, "added");
+		group_set_gid(added_group, 911);
+		ok(group_find(db, NULL, 911) == added_group, "new group found by gid");
+		group_remove(added_group);
+		is_null(group_find(db, "added", NO_GID), "removed group not found by name");
+		is_null(group_find(db, NULL, 911), "removed group not found by gid");
+		authdb_close(db);
+	}
+
+	subtest {
+		reset("t/tmp");
+		authdb_t *db = authdb_read("t/tmp", AUTHDB_ALL);
+		user_t *root = user_find(db, "root", NO_UID);
+		user_t *sys  = user_find(db, "sys", NO_UID);
+		isnt_null(root, "found 'root' in database");
+		isnt_null(sys,  "found 'sys' in database");
+
+		user_set_uid(sys, 0);
+		ok(user_find(db, NULL, 0) == root, "first user with a shared uid is found first");
+		is_null(user_find(db, NULL, 3), "renumbered user not found by old uid");
+
+		user_remove(root);
+		ok(user_find(db, NULL, 0) == sys, "next user with a shared uid is found once the first is gone");
+
+		user_set_uid(sys, 3);
+		is_null(user_find(db, NULL, 0), "no users left with uid 0");
+		ok(user_find(db, NULL, 3) == sys, "renumbered user found by uid again");
+		authdb_close(db);
+	}
+
 	done_testing();
 }
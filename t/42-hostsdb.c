@@ -0,0 +1,147 @@
+/*
+  Copyright 2011-2015 James Hunt <james@jameshunt.us>
+
+  This file is part of Clockwork.
+
+  Clockwork is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Clockwork is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Clockwork.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+
+#include "test.h"
+#include "../src/hostsdb.h"
+
+static void reset(const char *root)
+{
+	mkdir(root, 0755);
+	char *file = string("%s/hosts", root);
+	put_file(file, 0644,
+		"# managed hosts file\n"
+		"127.0.0.1   localhost localhost.localdomain\n"
+		"\n"
+		"10.0.0.1    one.example.com   one # the first\n"
+		"10.0.0.2    two.example.com\n"
+		"10.0.0.1    one.example.com   dupe\n"
+		"::1 ip6-localhost ip6-loopback\n");
+	free(file);
+}
+
+static char* slurp(const char *path)
+{
+	char buf[8192];
+	FILE *io = fopen(path, "r");
+	if (!io) return NULL;
+
+	size_t n = fread(buf, 1, sizeof(buf) - 1, io);
+	buf[n] = '\0';
+	fclose(io);
+	return strdup(buf);
+}
+
+TESTS {
+	subtest {
+		reset("t/tmp");
+
+		hostsdb_t *db;
+		hostent_t *ent;
+		char *s;
+
+		is_null(hostsdb_read("t/tmp/nonexistent"), "hostsdb_read fails if there is no hosts file");
+
+		isnt_null(db = hostsdb_read("t/tmp"), "read t/tmp/hosts");
+		isnt_null(ent = hostent_find(db, "10.0.0.1", "one.example.com"), "found one.example.com");
+		is_int(ent->aliases->num, 1, "first entry for one.example.com wins");
+		is_string(ent->aliases->strings[0], "one", "one.example.com alias");
+		is_string(ent->comment, " the first", "trailing comment is kept");
+
+		is_null(hostent_find(db, "10.0.0.2", "one.example.com"), "address and hostname must both match");
+		is_null(hostent_find(db, "managed", "hosts"), "comments are not entries");
+
+		is_int(hostsdb_commit(db), 0, "committed unchanged hosts database");
+		s = slurp("t/tmp/hosts");
+		is_string(s,
+			"# managed hosts file\n"
+			"127.0.0.1   localhost localhost.localdomain\n"
+			"\n"
+			"10.0.0.1    one.example.com   one # the first\n"
+			"10.0.0.2    two.example.com\n"
+			"10.0.0.1    one.example.com   dupe\n"
+			"::1 ip6-localhost ip6-loopback\n",
+			"untouched hosts file is left as-is");
+		free(s);
+
+		/* re-setting the same aliases is not a change */
+		struct stat before, after;
+		stat("t/tmp/hosts", &before);
+		hostent_unalias(ent);
+		hostent_alias(ent, "one");
+		is_int(hostsdb_commit(db), 0, "committed re-aliased hosts database");
+		stat("t/tmp/hosts", &after);
+		ok(before.st_ino == after.st_ino, "hosts file was not re-written");
+		hostsdb_close(db);
+	}
+
+	subtest {
+		reset("t/tmp");
+
+		hostsdb_t *db;
+		hostent_t *ent;
+		char *s;
+
+		isnt_null(db = hostsdb_read("t/tmp"), "read t/tmp/hosts");
+
+		ent = hostent_find(db, "10.0.0.2", "two.example.com");
+		isnt_null(ent, "found two.example.com");
+		hostent_alias(ent, "two");
+		hostent_alias(ent, "deux");
+
+		ent = hostent_find(db, "10.0.0.1", "one.example.com");
+		hostent_remove(ent);
+		ent = hostent_find(db, "10.0.0.1", "one.example.com");
+		isnt_null(ent, "duplicate entry takes over after removal");
+		is_string(ent->aliases->strings[0], "dupe", "found the duplicate entry");
+		hostent_unalias(ent);
+
+		ent = hostent_add(db, "10.0.0.3", "three.example.com");
+		isnt_null(ent, "added three.example.com");
+		ok(hostent_find(db, "10.0.0.3", "three.example.com") == ent, "new entry is found");
+
+		is_int(hostsdb_commit(db), 0, "wrote hosts database");
+
+		struct stat before, after;
+		stat("t/tmp/hosts", &before);
+		is_int(hostsdb_commit(db), 0, "committed hosts database again");
+		stat("t/tmp/hosts", &after);
+		ok(before.st_ino == after.st_ino, "hosts file was not re-written a second time");
+		hostsdb_close(db);
+
+		s = slurp("t/tmp/hosts");
+		is_string(s,
+			"# managed hosts file\n"
+			"127.0.0.1   localhost localhost.localdomain\n"
+			"\n"
+			"10.0.0.2\ttwo.example.com two deux\n"
+			"10.0.0.1\tone.example.com\n"
+			"::1 ip6-localhost ip6-loopback\n"
+			"10.0.0.3\tthree.example.com\n",
+			"only changed entries are re-written");
+		free(s);
+
+		struct stat st;
+		is_int(stat("t/tmp/hosts", &st), 0, "stat'd t/tmp/hosts");
+		is_int(st.st_mode, 0100644, "t/tmp/hosts kept its 0644 permissions");
+	}
+
+	done_testing();
+}
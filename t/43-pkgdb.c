@@ -0,0 +1,74 @@
+/*
+  Copyright 2011-2015 James Hunt <james@jameshunt.us>
+
+  This file is part of Clockwork.
+
+  Clockwork is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Clockwork is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Clockwork.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+
+#include "test.h"
+#include "../src/pkgdb.h"
+
+TESTS {
+	subtest {
+		sys("mkdir -p t/tmp/pkgdb/var/lib/dpkg");
+		put_file("t/tmp/pkgdb/var/lib/dpkg/status", 0644,
+			"Package: libc6\n"
+			"Status: install ok installed\n"
+			"Priority: required\n"
+			"Architecture: amd64\n"
+			"Version: 2.19-18\n"
+			"\n"
+			"Package: libc6\n"
+			"Status: install ok installed\n"
+			"Architecture: i386\n"
+			"Version: 2.19-17\n"
+			"\n"
+			"Package: removed\n"
+			"Status: deinstall ok config-files\n"
+			"Version: 1.0-1\n"
+			"\n"
+			"Package: held\n"
+			"Status: hold ok installed\n"
+			"Version: 3.0\n"
+			"\n"
+			"Package: broken\n"
+			"Status: install reinstreq half-installed\n"
+			"Version: 4.0\n");
+
+		pkgdb_t *db;
+		const char *v;
+
+		isnt_null(db = pkgdb_read("t/tmp/pkgdb"), "read dpkg status file");
+
+		is_int(pkgdb_version(db, "libc6", &v), PKGDB_INSTALLED, "libc6 is installed");
+		is_string(v, "2.19-18", "first installed libc6 version wins");
+
+		is_int(pkgdb_version(db, "removed", &v), PKGDB_MISSING,
+			"packages with only config-files left are not installed");
+		is_int(pkgdb_version(db, "enoent", &v), PKGDB_MISSING,
+			"unknown packages are not installed");
+
+		is_int(pkgdb_version(db, "held", &v), PKGDB_UNKNOWN,
+			"held packages are left to localsys");
+		is_int(pkgdb_version(db, "broken", &v), PKGDB_UNKNOWN,
+			"half-installed packages are left to localsys");
+
+		pkgdb_close(db);
+	}
+
+	done_testing();
+}
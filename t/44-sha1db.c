@@ -0,0 +1,121 @@
+/*
+  Copyright 2011-2015 James Hunt <james@jameshunt.us>
+
+  This file is part of Clockwork.
+
+  Clockwork is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Clockwork is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Clockwork.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+
+#include "test.h"
+#include "../src/sha1db.h"
+
+#define HAIKU \
+	"This is a haiku.\n" \
+	"You could write a better one.\n" \
+	"Go ahead and try.\n"
+
+static char* slurp(const char *path)
+{
+	char buf[8192];
+	FILE *io = fopen(path, "r");
+	if (!io) return NULL;
+
+	size_t n = fread(buf, 1, sizeof(buf) - 1, io);
+	buf[n] = '\0';
+	fclose(io);
+	return strdup(buf);
+}
+
+static int lines(const char *path)
+{
+	char *s = slurp(path), *p;
+	int n = 0;
+	if (!s) return -1;
+	for (p = s; *p; p++)
+		if (*p == '\n') n++;
+	free(s);
+	return n;
+}
+
+TESTS {
+	subtest {
+		sys("rm -rf t/tmp/sha1db && mkdir -p t/tmp/sha1db");
+		put_file("t/tmp/sha1db/haiku", 0644, HAIKU);
+		sleep(1); /* so it doesn't look like it is still being written */
+
+		sha1db_t *db;
+		sha1_t sha1;
+		char *s;
+
+		isnt_null(db = sha1db_read("t/tmp/sha1db/index"), "sha1db_read works without an index");
+		ok(sha1db_file(db, &sha1, "t/tmp/sha1db/enoent") != 0, "sha1db_file fails for missing files");
+		is_int(sha1db_file(db, &sha1, "t/tmp/sha1db/haiku"), 0, "hashed t/tmp/sha1db/haiku");
+		is_string(sha1.hex, "9b032ba6005e483b9e33706a8e9e3f17e4c3d1fc", "checksum of t/tmp/sha1db/haiku");
+		is_int(sha1db_commit(db), 0, "wrote the checksum index");
+		is_int(lines("t/tmp/sha1db/index"), 1, "index has one checksum in it");
+		sha1db_close(db);
+
+		/* doctor the index, to see if it gets used */
+		s = slurp("t/tmp/sha1db/index");
+		memcpy(strchr(s, '\n') - 40, "0123456789012345678901234567890123456789", 40);
+		put_file("t/tmp/sha1db/index", 0600, s);
+		free(s);
+
+		isnt_null(db = sha1db_read("t/tmp/sha1db/index"), "re-read the checksum index");
+		is_int(sha1db_file(db, &sha1, "t/tmp/sha1db/haiku"), 0, "looked up t/tmp/sha1db/haiku");
+		is_string(sha1.hex, "0123456789012345678901234567890123456789",
+			"unchanged file is not re-hashed");
+
+		put_file("t/tmp/sha1db/haiku", 0644, HAIKU "Or not.\n");
+		is_int(sha1db_file(db, &sha1, "t/tmp/sha1db/haiku"), 0, "looked up t/tmp/sha1db/haiku");
+		is_string(sha1.hex, "3db2578a787c7e39a90093398386a26ded4685fc",
+			"changed file is re-hashed");
+
+		put_file("t/tmp/sha1db/fresh", 0644, "fresh\n");
+		is_int(sha1db_file(db, &sha1, "t/tmp/sha1db/fresh"), 0, "hashed t/tmp/sha1db/fresh");
+		is_string(sha1.hex, "ca02969e73890f8ea6d6ec35dca6c1c2a56c6554", "checksum of t/tmp/sha1db/fresh");
+
+		is_int(sha1db_commit(db), 0, "wrote the checksum index");
+		is_int(lines("t/tmp/sha1db/index"), 0,
+			"checksums of files changed this second are not remembered");
+		sha1db_close(db);
+	}
+
+	subtest {
+		sys("rm -rf t/tmp/sha1db && mkdir -p t/tmp/sha1db");
+		put_file("t/tmp/sha1db/a", 0644, "a\n");
+		put_file("t/tmp/sha1db/b", 0644, "b\n");
+		sleep(1);
+
+		sha1db_t *db;
+		sha1_t sha1;
+
+		db = sha1db_read("t/tmp/sha1db/index");
+		sha1db_file(db, &sha1, "t/tmp/sha1db/a");
+		sha1db_file(db, &sha1, "t/tmp/sha1db/b");
+		is_int(sha1db_commit(db), 0, "wrote the checksum index");
+		is_int(lines("t/tmp/sha1db/index"), 2, "index has two checksums in it");
+		sha1db_close(db);
+
+		db = sha1db_read("t/tmp/sha1db/index");
+		sha1db_file(db, &sha1, "t/tmp/sha1db/b");
+		is_int(sha1db_commit(db), 0, "wrote the checksum index");
+		is_int(lines("t/tmp/sha1db/index"), 1, "checksums nobody asked for are dropped");
+		sha1db_close(db);
+	}
+
+	done_testing();
+}
@@ -943,6 +943,24 @@ EOF
 	"SHA1:9b032ba6005e483b9e33706a8e9e3f17e4c3d1fc\n",
 	"fs.sha1");
 
+	unlink "t/tmp/pn.sha1db";
+	sleep 1; # checksums of files changed this second aren't kept
+	for (1 .. 2) {
+		pendulum_ok(qq(
+		fn main
+			pragma sha1db      "on"
+			pragma sha1db.file "t/tmp/pn.sha1db"
+			fs.sha1 "t/tmp/sha1" %d
+			jz +2
+				print "fail"
+				ret
+			print "SHA1:%[d]s\\n"),
+
+		"SHA1:9b032ba6005e483b9e33706a8e9e3f17e4c3d1fc\n",
+		"fs.sha1 (with sha1db, run #$_)");
+		ok(-s "t/tmp/pn.sha1db", "fs.sha1 saved the checksum to t/tmp/pn.sha1db");
+	}
+
 
 	unlink "t/tmp/symread";
 	symlink "/path/to/somewhere", "t/tmp/symread";
@@ -984,6 +1002,72 @@ EOF
 	"replacement data!",
 	"fs.put overwrites a file");
 
+	unlink "t/tmp/statcache";
+	pendulum_ok(qq(
+	fn main
+		set %a "t/tmp/statcache"
+		fs.file? %a
+		jz +1
+			print "missing\\n"
+
+		fs.put %a "four"
+		fs.size %a %b
+		print "size=%[b]d\\n"
+		fs.put %a "eight..."
+		fs.size %a %b
+		print "size=%[b]d\\n"
+
+		fs.chmod %a 0600
+		fs.mode %a %b
+		print "mode=%[b]04o\\n"
+		exec "chmod 0640 t/tmp/statcache" %c
+		fs.mode %a %b
+		print "mode=%[b]04o\\n"
+
+		fs.unlink %a
+		fs.file? %a
+		jz +1
+			print "gone\\n"
+		ret),
+
+	"missing\n".
+	"size=4\n".
+	"size=8\n".
+	"mode=0600\n".
+	"mode=0640\n".
+	"gone\n",
+	"fs.* opcodes see changes made during the run");
+
+	system "rm -rf t/tmp/statdir";
+	put_file "t/tmp/statcache.tgt", "target\n";
+	chmod 0644, "t/tmp/statcache.tgt";
+	unlink "t/tmp/statcache.lnk";
+	symlink "statcache.tgt", "t/tmp/statcache.lnk";
+	pendulum_ok(qq(
+	fn main
+		set %a "t/tmp/statdir/a"
+		fs.dir? %a
+		jz +1
+			print "missing\n"
+		fs.mkparent "t/tmp/statdir/a/b/file"
+		fs.dir? %a
+		jnz +1
+			print "created\n"
+
+		set %b "t/tmp/statcache.tgt"
+		fs.mode %b %c
+		print "mode=%[c]04o\n"
+		fs.chmod "t/tmp/statcache.lnk" 0600
+		fs.mode %b %c
+		print "mode=%[c]04o\n"
+		ret),
+
+	"missing\n".
+	"created\n".
+	"mode=0644\n".
+	"mode=0600\n",
+	"fs.* opcodes see directories made by fs.mkparent, and chmods through symlinks");
+
 	mkdir "t/tmp/readdir";
 	mkdir "t/tmp/readdir/$_" for qw/a b c d/;
 	pendulum_ok(qq(
@@ -1585,6 +1669,67 @@ EOF
 	"group.join and group.kick");
 };
 
+subtest "hosts operators" => sub {
+	mkdir "t/tmp/hosts";
+	put_file "t/tmp/hosts/hosts", <<EOF;
+127.0.0.1 localhost localhost.localdomain
+
+# The following lines are desirable for IPv6 capable hosts
+::1     ip6-localhost ip6-loopback
+10.0.0.5 old.example.com old
+EOF
+
+	pendulum_ok(qq(
+	fn main
+		pragma hosts.root "t/tmp/hosts"
+		hosts.open
+		jz +2
+			perror "failed to open hosts database"
+			halt
+
+		hosts.find "127.0.0.1" "localhost"
+		jz +2
+			print "localhost not found"
+			halt
+
+		hosts.find "127.0.0.1" "ip6-localhost"
+		jnz +2
+			print "found 127.0.0.1 / ip6-localhost"
+			halt
+
+		hosts.find "10.0.0.5" "old.example.com"
+		hosts.delete
+		jz +2
+			print "failed to delete old.example.com"
+			halt
+
+		hosts.new "10.0.0.6" "new.example.com"
+		hosts.alias "new"
+		hosts.alias "nouveau"
+
+		hosts.find "::1" "ip6-localhost"
+		hosts.unalias
+
+		hosts.save
+		jz +2
+			perror "failed to save hosts database"
+			halt
+
+		hosts.close
+		print "ok"),
+
+	"ok",
+	"hosts operators");
+
+	file_is "t/tmp/hosts/hosts", <<EOF, "hosts file updated in place";
+127.0.0.1 localhost localhost.localdomain
+
+# The following lines are desirable for IPv6 capable hosts
+::1	ip6-localhost
+10.0.0.6	new.example.com new nouveau
+EOF
+};
+
 subtest "augeas operators" => sub {
 	mkdir "t/tmp/root";
 	mkdir "t/tmp/root/etc";
@@ -1782,6 +1927,40 @@ EOF
 	"ok:B",
 	"augeas.find returns non-zero to accumulator on failure");
 
+	pendulum_ok(qq(
+	fn main
+		pragma augeas.root "t/tmp/root"
+		pragma augeas.libs "t/tmp/augeas/lenses"
+
+		augeas.init
+		jz +2
+			print "init failed"
+			ret
+
+		augeas.set "/files/etc/hosts/9999/ipaddr" "10.9.8.7"
+		augeas.init
+		jz +2
+			print "second init failed"
+			ret
+
+		augeas.load "Hosts" "/etc/hosts"
+		jz +2
+			print "load failed"
+			ret
+
+		augeas.get "/files/etc/hosts/9999/ipaddr" %a
+		jz +2
+			augeas.perror "lost unsaved changes"
+			ret
+
+		print "ip=%[a]s\\n"
+		augeas.done
+		print "ok"),
+
+	"ip=10.9.8.7\n".
+	"ok",
+	"augeas.init / augeas.load reuse the already-loaded tree");
+
 	pendulum_ok(qq(
 	fn main
 		pragma test        "on"
@@ -2246,6 +2425,188 @@ subtest "localsys" => sub {
 
 	"{{ok}}",
 	"localsys deals in format strings");
+
+	put_file "t/tmp/serve", <<'EOF';
+#!/bin/sh
+[ "$1" = "serve" ] || exit 99
+echo "ready"
+n=0
+while read -r line; do
+	n=$((n + 1))
+	echo "$n $line"
+done
+EOF
+	chmod 0755, "t/tmp/serve";
+
+	pendulum_ok(qq(
+	fn main
+		pragma localsys.cmd "./t/tmp/serve"
+		pragma localsys.serve "on"
+		localsys "first" %a
+		localsys "second" %b
+		acc %c
+		print "%[a]s/%[b]s acc=%[c]u"),
+
+	"first/second acc=2",
+	"localsys reuses a single helper process");
+
+	pendulum_ok(qq(
+	fn main
+		pragma localsys.cmd "/bin/echo"
+		pragma localsys.serve "on"
+		localsys "one-shot" %b
+		jz +1
+		print "fail"
+		print %b),
+
+	"one-shot",
+	"localsys falls back to one-shot commands if the helper won't serve");
+
+	put_file "t/tmp/serve", <<'EOF';
+#!/bin/sh
+[ "$1" = "serve" ] || { echo "$*" >>t/tmp/oneshot; exit 0; }
+echo "ready"
+while read -r line; do
+	case "$line" in
+	long*) printf '0 '; head -c 10000 /dev/zero | tr '\0' x; echo ;;
+	bad*)  echo "garbled" ;;
+	*)     echo "0 $line" ;;
+	esac
+done
+EOF
+	chmod 0755, "t/tmp/serve";
+	unlink "t/tmp/oneshot";
+
+	pendulum_ok(qq(
+	fn main
+		pragma localsys.cmd "./t/tmp/serve"
+		pragma localsys.serve "on"
+		localsys "long" %a
+		localsys "next" %b
+		print "%[b]s\\n"
+		localsys "bad" %c
+		acc %d
+		localsys "after" %e
+		print "bad=%[d]u\\n"),
+
+	"next\n".
+	"bad=125\n",
+	"localsys stays in step with the helper, and gives up on it if it stops making sense");
+	file_is "t/tmp/oneshot", "after\n",
+		"requests the helper was sent are not re-run one-shot";
+};
+
+subtest "package database" => sub {
+	mkdir "t/tmp/pkgdb";
+	mkdir "t/tmp/pkgdb/var";
+	mkdir "t/tmp/pkgdb/var/lib";
+	mkdir "t/tmp/pkgdb/var/lib/dpkg";
+	put_file "t/tmp/pkgdb/var/lib/dpkg/status", <<EOF;
+Package: installed
+Status: install ok installed
+Version: 1.2.3-4
+
+Package: removed
+Status: deinstall ok config-files
+Version: 2.0
+EOF
+
+	pendulum_ok(qq(
+	fn main
+		pragma pkgdb.root "t/tmp/pkgdb"
+		pkg.version "installed" %a
+		acc %b
+		pkg.version "removed" %c
+		acc %c
+		print "installed=%[a]s/%[b]u removed=%[c]u"),
+
+	"installed=1.2.3-4/0 removed=1",
+	"pkg.version reads the dpkg status file");
+
+	pendulum_ok(qq(
+	fn main
+		pragma pkgdb.root "t/tmp/pkgdb"
+		pragma localsys.cmd "/bin/echo"
+		pkg.version "installed" %a
+		acc %b
+		print "acc=%[b]u"),
+
+	"acc=2",
+	"pkg.version defers to a custom localsys.cmd");
+
+	put_file "t/tmp/batch", <<'EOF';
+#!/bin/sh
+case "$1" in
+pkg-install-batch) exit 1 ;;
+pkg-version)       [ "$2" = "foo" ] && echo "1.2-1" && exit 0
+                   [ "$2" = "bar" ] && echo "3.0"   && exit 0
+                   exit 1 ;;
+pkg-remove)        exit 1 ;;
+esac
+exit 2
+EOF
+	chmod 0755, "t/tmp/batch";
+
+	pendulum_ok(qq(
+	fn main
+		pragma localsys.cmd "./t/tmp/batch"
+		pkg.install "foo" "1.2"
+		acc %a
+
+		topic "main"
+		flag "service:held"
+		pkg.begin
+		topic "package:foo"
+		pkg.install "foo" "1.2"
+		flag "service:foo"
+		flag "service:shared"
+		topic "package:bar"
+		pkg.remove "bar"
+		flag "service:bar"
+		flag "service:shared"
+		flag "service:held"
+		topic "main"
+		pkg.flush
+		acc %b
+
+		set %c 0
+		set %d 0
+		set %e 0
+		set %f 0
+		flagged? "service:foo"    jnz +1 set %c 1
+		flagged? "service:bar"    jnz +1 set %d 1
+		flagged? "service:shared" jnz +1 set %e 1
+		flagged? "service:held"   jnz +1 set %f 1
+		print "nobatch=%[a]u failed=%[b]u foo=%[c]u bar=%[d]u shared=%[e]u held=%[f]u"),
+
+	"nobatch=1 failed=1 foo=1 bar=0 shared=1 held=1",
+	"pkg.flush maps batch failures back to the queueing resources");
+};
+
+subtest "workers" => sub {
+	for my $n (1, 4) {
+		pendulum_ok(qq(
+		fn raises
+			flag "raised"
+			retv 0
+		fn fails
+			bail 3
+		fn main
+			pragma parallel $n
+			async raises
+			async fails
+			await raises
+			acc %a
+			set %b 0
+			flagged? "raised" jnz +1 set %b 1
+			await.all
+			acc %c
+			print "raises=%[a]u flagged=%[b]u all=%[c]u"),
+
+		($n == 1 ? "raises=0 flagged=1 all=0"
+		         : "raises=0 flagged=1 all=3"),
+		"async / await with pragma parallel $n");
+	}
 };
 
 subtest "remote" => sub {
@@ -369,7 +369,6 @@ fn fix:00000001
   call util.authdb.open
   set %a "t1user"
   call res.user.absent
-  call util.authdb.save
 
 fn main
   set %o 0
@@ -377,6 +376,10 @@ fn main
   try res:00000001
   acc %p
   add %o %p
+  ;; write out user / group changes
+  try util.authdb.save
+  acc %p
+  add %o %p
   retv 0
 EOF
 		"user removal");
@@ -420,7 +423,6 @@ fn fix:00000001
   jz +2
     error "Failed to set %[a]s' home directory to %[b]s"
     bail 1
-  call util.authdb.save
 
 fn main
   set %o 0
@@ -428,6 +430,10 @@ fn main
   try res:00000001
   acc %p
   add %o %p
+  ;; write out user / group changes
+  try util.authdb.save
+  acc %p
+  add %o %p
   retv 0
 EOF
 		"UID/GID, home and password management");
@@ -477,7 +483,6 @@ fn fix:00000001
     user.get "uid" %c
     user.get "gid" %d
     call res.user.mkhome
-  call util.authdb.save
 
 fn main
   set %o 0
@@ -485,6 +490,10 @@ fn main
   try res:00000001
   acc %p
   add %o %p
+  ;; write out user / group changes
+  try util.authdb.save
+  acc %p
+  add %o %p
   retv 0
 EOF
 		"home directory / password management");
@@ -578,7 +587,6 @@ fn fix:00000001
   jz +2
     error "Failed to set %[a]s' account expiration to %[b]li"
     bail 1
-  call util.authdb.save
 
 fn main
   set %o 0
@@ -586,6 +594,10 @@ fn main
   try res:00000001
   acc %p
   add %o %p
+  ;; write out user / group changes
+  try util.authdb.save
+  acc %p
+  add %o %p
   retv 0
 EOF
 		"all user attributes under the sun");
@@ -620,7 +632,6 @@ fn fix:00000001
   call util.authdb.open
   set %a "group1"
   call res.group.absent
-  call util.authdb.save
 
 fn main
   set %o 0
@@ -628,6 +639,10 @@ fn main
   try res:00000001
   acc %p
   add %o %p
+  ;; write out user / group changes
+  try util.authdb.save
+  acc %p
+  add %o %p
   retv 0
 EOF
 		"group resource");
@@ -658,7 +673,6 @@ fn fix:00000001
   set %a "group2"
   set %b 6766
   call res.group.present
-  call util.authdb.save
 
 fn main
   set %o 0
@@ -666,6 +680,10 @@ fn main
   try res:00000001
   acc %p
   add %o %p
+  ;; write out user / group changes
+  try util.authdb.save
+  acc %p
+  add %o %p
   retv 0
 EOF
 		"group with specific gid");
@@ -694,7 +712,6 @@ fn fix:00000001
   set %a "group3"
   set %b 0
   call res.group.present
-  call util.authdb.save
 
 fn main
   set %o 0
@@ -702,6 +719,10 @@ fn main
   try res:00000001
   acc %p
   add %o %p
+  ;; write out user / group changes
+  try util.authdb.save
+  acc %p
+  add %o %p
   retv 0
 EOF
 		"default group");
@@ -760,7 +781,6 @@ fn fix:00000001
   set %b 0 set %c "admin"
   set %d "root"
     call res.group.member
-  call util.authdb.save
 
 fn main
   set %o 0
@@ -768,6 +788,10 @@ fn main
   try res:00000001
   acc %p
   add %o %p
+  ;; write out user / group changes
+  try util.authdb.save
+  acc %p
+  add %o %p
   retv 0
 EOF
 		"group resource with member / admin changes");
@@ -1123,6 +1147,7 @@ fn res:00000001
   retv 1
 
 fn fix:00000001
+  call util.package.begin
   set %a "binutils"
   set %b ""
   call res.package.install
@@ -1133,6 +1158,10 @@ fn main
   try res:00000001
   acc %p
   add %o %p
+  ;; install / remove queued packages
+  try util.package.save
+  acc %p
+  add %o %p
   retv 0
 EOF
 		"package resource");
@@ -1159,6 +1188,7 @@ fn res:00000001
   retv 1
 
 fn fix:00000001
+  call util.package.begin
   set %a "binutils"
   call res.package.absent
 
@@ -1168,6 +1198,10 @@ fn main
   try res:00000001
   acc %p
   add %o %p
+  ;; install / remove queued packages
+  try util.package.save
+  acc %p
+  add %o %p
   retv 0
 EOF
 		"package removal");
@@ -1195,6 +1229,7 @@ fn res:00000001
   retv 1
 
 fn fix:00000001
+  call util.package.begin
   set %a "binutils"
   set %b "1.2.3"
   call res.package.install
@@ -1205,6 +1240,10 @@ fn main
   try res:00000001
   acc %p
   add %o %p
+  ;; install / remove queued packages
+  try util.package.save
+  acc %p
+  add %o %p
   retv 0
 EOF
 		"explicit version specification");
@@ -1232,6 +1271,7 @@ fn res:00000001
   retv 1
 
 fn fix:00000001
+  call util.package.begin
   set %a "binutils"
   set %b "latest"
   call res.package.install
@@ -1242,6 +1282,10 @@ fn main
   try res:00000001
   acc %p
   add %o %p
+  ;; install / remove queued packages
+  try util.package.save
+  acc %p
+  add %o %p
   retv 0
 EOF
 		"'latest' version specification");
@@ -1269,6 +1313,7 @@ fn res:00000001
   retv 1
 
 fn fix:00000001
+  call util.package.begin
   set %a "binutils"
   set %b ""
   call res.package.install
@@ -1279,11 +1324,97 @@ fn main
   try res:00000001
   acc %p
   add %o %p
+  ;; install / remove queued packages
+  try util.package.save
+  acc %p
+  add %o %p
   retv 0
 EOF
 		"'any' version will suffice");
 
 	#######################################################
+
+	put_file "t/tmp/manifest.pol", <<'EOF';
+policy "example" {
+	package "libfoo" { }
+	package "bar" { }
+	package "foo" { }
+	package("foo") depends on package("libfoo")
+}
+host "example" { enforce "example" }
+EOF
+
+	gencode_ok(<<'EOF',
+#include stdlib
+fn res:00000001
+  unflag "changed"
+  call fix:00000001
+  flagged? "changed"
+  jz +1 retv 0
+  flag "package:foo"
+  retv 1
+
+fn fix:00000001
+  call util.package.begin
+  set %a "libfoo"
+  set %b ""
+  call res.package.install
+
+fn res:00000002
+  unflag "changed"
+  call fix:00000002
+  flagged? "changed"
+  jz +1 retv 0
+  ;; no dependencies
+  retv 1
+
+fn fix:00000002
+  call util.package.begin
+  set %a "bar"
+  set %b ""
+  call res.package.install
+
+fn res:00000003
+  unflag "changed"
+  call fix:00000003
+  flagged? "changed"
+  jz +1 retv 0
+  ;; no dependencies
+  retv 1
+
+fn fix:00000003
+  call util.package.begin
+  set %a "foo"
+  set %b ""
+  call res.package.install
+
+fn main
+  set %o 0
+  topic "package:libfoo"
+  try res:00000001
+  acc %p
+  add %o %p
+  topic "package:bar"
+  try res:00000002
+  acc %p
+  add %o %p
+  ;; install / remove queued packages
+  try util.package.save
+  acc %p
+  add %o %p
+  topic "package:foo"
+  try res:00000003
+  acc %p
+  add %o %p
+  ;; install / remove queued packages
+  try util.package.save
+  acc %p
+  add %o %p
+  retv 0
+EOF
+		"queued packages are installed before their dependents");
+
+	#######################################################
 };
 subtest "res_host" => sub {
 	mkdir "t/tmp";
@@ -1311,6 +1442,7 @@ fn res:00000001
   retv 1
 
 fn fix:00000001
+  call util.hosts.open
   set %a "1.2.3.4"
   set %b "example.com"
   call res.host.present
@@ -1327,6 +1459,10 @@ fn main
   try res:00000001
   acc %p
   add %o %p
+  ;; write out hosts changes
+  try util.hosts.save
+  acc %p
+  add %o %p
   retv 0
 EOF
 		"host resource with two aliases");
@@ -1354,6 +1490,7 @@ fn res:00000001
   retv 1
 
 fn fix:00000001
+  call util.hosts.open
   set %a "2.4.6.8"
   set %b "remove.me"
   call res.host.absent
@@ -1364,6 +1501,10 @@ fn main
   try res:00000001
   acc %p
   add %o %p
+  ;; write out hosts changes
+  try util.hosts.save
+  acc %p
+  add %o %p
   retv 0
 EOF
 		"host removal");
@@ -1962,6 +2103,31 @@ fn fix:00000002
 
 fn main
   set %o 0
+  runtime %p lt %p 20150501 jz serial
+  topic "dir:/tmp"
+  async res:00000001
+  acc %p
+  add %o %p
+  await res:00000001
+  acc %p
+  add %o %p
+  topic "dir:/tmp/inner"
+  async res:00000003
+  acc %p
+  add %o %p
+  await res:00000003
+  acc %p
+  add %o %p
+  topic "file:/tmp/inner/file"
+  async res:00000002
+  acc %p
+  add %o %p
+  await.all
+  acc %p
+  add %o %p
+  retv 0
+
+serial:
   topic "dir:/tmp"
   try res:00000001
   acc %p
@@ -2090,6 +2256,108 @@ EOF
 EOF
 
 	#######################################################
+
+	put_file "t/tmp/manifest.pol", <<'EOF';
+policy "example" {
+	exec "/bin/a" { }
+	exec "/bin/b" { }
+	package "p" { }
+	exec("/bin/b") depends on exec("/bin/a")
+}
+host "example" { enforce "example" }
+EOF
+	gencode_ok <<'EOF', "independent resources run in parallel";
+#include stdlib
+fn res:00000001
+  unflag "changed"
+  call fix:00000001
+  flagged? "changed"
+  jz +1 retv 0
+  flag "exec:/bin/b"
+  retv 1
+
+fn fix:00000001
+  set %b "/bin/a"
+  runas.uid 0
+  runas.gid 0
+  exec %b %d
+
+fn res:00000003
+  unflag "changed"
+  call fix:00000003
+  flagged? "changed"
+  jz +1 retv 0
+  ;; no dependencies
+  retv 1
+
+fn fix:00000003
+  call util.package.begin
+  set %a "p"
+  set %b ""
+  call res.package.install
+
+fn res:00000002
+  unflag "changed"
+  call fix:00000002
+  flagged? "changed"
+  jz +1 retv 0
+  ;; no dependencies
+  retv 1
+
+fn fix:00000002
+  set %b "/bin/b"
+  runas.uid 0
+  runas.gid 0
+  exec %b %d
+
+fn main
+  set %o 0
+  runtime %p lt %p 20150501 jz serial
+  topic "exec:/bin/a"
+  async res:00000001
+  acc %p
+  add %o %p
+  topic "package:p"
+  try res:00000003
+  acc %p
+  add %o %p
+  ;; install / remove queued packages
+  try util.package.save
+  acc %p
+  add %o %p
+  await res:00000001
+  acc %p
+  add %o %p
+  topic "exec:/bin/b"
+  async res:00000002
+  acc %p
+  add %o %p
+  await.all
+  acc %p
+  add %o %p
+  retv 0
+
+serial:
+  topic "exec:/bin/a"
+  try res:00000001
+  acc %p
+  add %o %p
+  topic "package:p"
+  try res:00000003
+  acc %p
+  add %o %p
+  ;; install / remove queued packages
+  try util.package.save
+  acc %p
+  add %o %p
+  topic "exec:/bin/b"
+  try res:00000002
+  acc %p
+  add %o %p
+  retv 0
+EOF
+
+	#######################################################
 };
 
 subtest "acl parsing" => sub {